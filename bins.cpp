@@ -14,6 +14,7 @@
 #include <limits>
 #include <numeric>
 #include <utility>
+#include <vector>
 
 #include "bins.h"
 
@@ -73,8 +74,9 @@ void binmap_t::twist (uint64_t mask) {
 }
 
 binmap_t::binmap_t (const binmap_t& b) : height(b.height), free_top(b.free_top),
-blocks_allocated(b.blocks_allocated), cells_allocated(b.cells_allocated) {
-    size_t memsz = blocks_allocated*16*32;
+blocks_allocated(b.blocks_allocated), cells_allocated(b.cells_allocated),
+twist_mask(b.twist_mask) {
+    size_t memsz = blocks_allocated*16*sizeof(uint32_t);
     cells = (uint32_t*) malloc(memsz);
     memcpy(cells,b.cells,memsz);
 }
@@ -294,6 +296,14 @@ void binmap_t::clear () {
 }
 
 
+void binmap_t::clear_before (uint64_t offset) {
+    bin64_t peaks[64];
+    int count = bin64_t::peaks(offset,peaks);
+    for(int i=0; i<count; i++)
+        set(peaks[i],EMPTY);
+}
+
+
 uint64_t binmap_t::mass () {
     iterator i(this,bin64_t(0,0),false);
     uint64_t ret = 0;
@@ -327,6 +337,135 @@ void binmap_t::set (bin64_t bin, fill_t val) {
 }
 
 
+/** Serialized binmap: "swbm", version, height, 2 zero bytes, twist mask,
+    cell count; then both halves of every cell, in breadth-first order
+    starting from the root; a deep half holds the number of its cell in
+    that order. Then the deep flags of the halves, one bit each, lowest
+    bit first. Integers are big-endian. */
+#define BINMAP_MAGIC "swbm"
+#define BINMAP_VERSION 1
+#define BINMAP_HEADERSZ 20
+#define BINMAP_MAX_CELLS (15*4096) // cells are numbered by uint16_t
+
+static void put_uint (uint8_t* to, uint64_t val, int bytes) {
+    for(int i=bytes-1; i>=0; i--, val>>=8)
+        to[i] = val & 0xff;
+}
+
+static uint64_t get_uint (const uint8_t* from, int bytes) {
+    uint64_t val = 0;
+    for(int i=0; i<bytes; i++)
+        val = (val<<8) | from[i];
+    return val;
+}
+
+
+/** A flat half has 16 bits for the bins 4 layers down; below layer 4
+    the bits come in groups, one per base bin (see split16to32). */
+bool        binmap_t::is_flat_ok (uint16_t val, int layer) {
+    if (is_solid(val) || layer>=4)
+        return true;
+    if (layer==0)
+        return false;
+    uint32_t split = split16to32(val);
+    return is_flat_ok(split&0xffff,layer-1) && is_flat_ok(split>>16,layer-1);
+}
+
+
+size_t      binmap_t::serialize (uint8_t* buf, size_t size) const {
+    std::vector<uint16_t> order(1,0);
+    for(size_t c=0; c<order.size(); c++)
+        for(int lr=0; lr<2; lr++)
+            if (deep(order[c]*2+lr))
+                order.push_back(halves[order[c]*2+lr]);
+    size_t count = order.size();
+    size_t need = BINMAP_HEADERSZ + count*4 + (count*2+7)/8;
+    if (size<need)
+        return need;
+    memcpy(buf,BINMAP_MAGIC,4);
+    buf[4] = BINMAP_VERSION;
+    buf[5] = height;
+    buf[6] = buf[7] = 0;
+    put_uint(buf+8,twist_mask,8);
+    put_uint(buf+16,count,4);
+    uint8_t* flags = buf + BINMAP_HEADERSZ + count*4;
+    memset(flags,0,(count*2+7)/8);
+    uint16_t next = 1;
+    for(size_t c=0; c<count; c++)
+        for(int lr=0; lr<2; lr++) {
+            uint32_t half = order[c]*2+lr, i = c*2+lr;
+            if (deep(half))
+                flags[i>>3] |= 1<<(i&7);
+            put_uint(buf+BINMAP_HEADERSZ+i*2, deep(half) ? next++ : halves[half], 2);
+        }
+    return need;
+}
+
+
+bool        binmap_t::deserialize (const uint8_t* buf, size_t size) {
+    if (size<BINMAP_HEADERSZ || memcmp(buf,BINMAP_MAGIC,4) ||
+            buf[4]!=BINMAP_VERSION || buf[5]<4 || buf[5]>62)
+        return false;
+    uint32_t count = get_uint(buf+16,4);
+    if (!count || count>BINMAP_MAX_CELLS ||
+            size<BINMAP_HEADERSZ + count*4 + (count*2+7)/8)
+        return false;
+    const uint8_t* vals = buf + BINMAP_HEADERSZ;
+    const uint8_t* flags = vals + count*4;
+    // every cell but the root is referred to once, by a preceding cell;
+    // half 0 is the whole range, half 1 is an unused 0; no deep base halves
+    std::vector<bool> seen(count,false);
+    std::vector<uint8_t> layer(count,buf[5]);
+    uint32_t refs = 0;
+    for(uint32_t i=0; i<count*2; i++)
+        if (flags[i>>3] & (1<<(i&7))) {
+            uint32_t child = get_uint(vals+i*2,2);
+            if (child<=i/2 || child>=count || seen[child] ||
+                    i==1 || layer[i/2]==0)
+                return false;
+            seen[child] = true;
+            layer[child] = layer[i/2]-1;
+            refs++;
+        }
+    if (refs!=count-1 || get_uint(vals+2,2))
+        return false;
+    for(uint32_t i=2; i<count*2; i++)
+        if (!(flags[i>>3] & (1<<(i&7))) &&
+                !is_flat_ok(get_uint(vals+i*2,2),layer[i/2]))
+            return false;
+    // cells go in their order, skipping every 16th (deep flags)
+    uint32_t blocks = 1;
+    while (blocks*15<count)
+        blocks <<= 1;
+    uint32_t* ncells = (uint32_t*) malloc(blocks*16*sizeof(uint32_t));
+    if (!ncells)
+        return false;
+    memset(ncells,0,blocks*16*sizeof(uint32_t));
+    free(cells);
+    cells = ncells;
+    blocks_allocated = blocks;
+    cells_allocated = count;
+    height = buf[5];
+    twist_mask = get_uint(buf+8,8);
+    for(uint32_t i=0; i<count*2; i++) {
+        uint32_t half = (i/30)*32 + i%30;
+        uint16_t val = get_uint(vals+i*2,2);
+        if (flags[i>>3] & (1<<(i&7))) {
+            halves[half] = (val/15)*16 + val%15;
+            mark(half);
+        } else
+            halves[half] = val;
+    }
+    free_top = 0; // the free list ends at the root, see extend()
+    for(uint32_t c=blocks*15; c>count; c--) {
+        uint16_t cell = ((c-1)/15)*16 + (c-1)%15;
+        halves[cell*2] = free_top;
+        free_top = cell;
+    }
+    return true;
+}
+
+
 uint64_t*   binmap_t::get_stripes (int& count) {
     int size = 32;
     uint64_t *stripes = (uint64_t*) malloc(32*8);
@@ -360,21 +499,7 @@ uint64_t*   binmap_t::get_stripes (int& count) {
 
 
 void    binmap_t::remove (binmap_t& b) {
-    uint8_t start_lr = b.height>height ? b.height : height;
-    bin64_t top(start_lr,0);
-    iterator zis(this,top), zat(&b,top);
-    while (!zis.end()) {
-        while (zis.deep() || zat.deep()) {
-            zis.left(); zat.left();
-        }
-        
-        *zis &= ~*zat;
-        
-        while (zis.pos.is_right()) {
-            zis.parent(); zat.parent();
-        }
-        zis.sibling(); zat.sibling();
-    }
+    range_op(b,bin64_t::ALL,REMOVE_OP);
 }
 
 
@@ -390,64 +515,169 @@ bin64_t     binmap_t::cover(bin64_t val) {
 }
 
 
+/*  The operations below walk both binmaps at once, recursively. Unlike
+    iterators, they split no cells: a flat half of one binmap facing a deep
+    half of the other one is split virtually (see child). A solid half
+    applies to a whole subtree in one step; two flat halves are processed
+    16 bits at once, two flat cells 32 bits at once. */
+
+binmap_t::halfref_t binmap_t::locate (bin64_t bin) {
+    while (!bin.within(bin64_t(height,0)))
+        extend_range();
+    halfref_t ref;
+    ref.half = 0;
+    ref.deep = deep(0);
+    ref.val = halves[0];
+    for(bin64_t pos(height,0); pos!=bin; ) {
+        bin64_t next = pos.towards(bin);
+        ref = child(ref,next==pos.right(),next.layer());
+        pos = next;
+    }
+    return ref;
+}
+
+
+binmap_t::halfref_t binmap_t::child
+    (const halfref_t& ref, bool right, int layer) const
+{
+    if ( (twist_mask >> layer) & 1 )
+        right = !right;
+    halfref_t ret;
+    if (ref.deep) {
+        ret.half = (halves[ref.half]<<1) + right;
+        ret.deep = deep(ret.half);
+        ret.val = halves[ret.half];
+    } else {
+        uint32_t split = split16to32(ref.val);
+        ret.half = 0;
+        ret.deep = false;
+        ret.val = right ? split>>16 : split&0xffff;
+    }
+    return ret;
+}
+
+
+void        binmap_t::free_subtree (uint16_t cell) {
+    for(int lr=0; lr<2; lr++)
+        if (deep(cell*2+lr))
+            free_subtree(halves[cell*2+lr]);
+    free_cell(cell);
+}
+
+
+static inline uint32_t apply_op (uint32_t a, uint32_t b, binmap_t::bin_op_t op) {
+    switch (op) {
+        case binmap_t::REMOVE_OP: return a & ~b;
+        case binmap_t::AND_OP:    return a & b;
+        case binmap_t::COPY_OP:   return b;
+        default:                  return a | b;
+    }
+}
+
+
+void        binmap_t::half_op (uint32_t half, int layer, binmap_t& mask,
+                               halfref_t mref, bin_op_t op) {
+    if (!mref.deep) {
+        if (!deep(half)) {
+            halves[half] = apply_op(halves[half],mref.val,op);
+            return;
+        }
+        if (is_solid(mref.val)) {
+            uint16_t solid = apply_op(EMPTY,mref.val,op);
+            if (solid!=apply_op(FILLED,mref.val,op))
+                return; // the op leaves the subtree as it is
+            free_subtree(halves[half]);
+            unmark(half);
+            halves[half] = solid;
+            return;
+        }
+    } else if (!deep(half)) {
+        uint16_t val = halves[half];
+        if ( val==apply_op(val,EMPTY,op) && val==apply_op(val,FILLED,op) )
+            return; // whatever the mask is
+        split(half);
+    }
+    uint32_t cell = halves[half];
+    bool twisted = (twist_mask>>(layer-1)) & 1;
+    halfref_t left = mask.child(mref,twisted,layer-1);
+    halfref_t right = mask.child(mref,!twisted,layer-1);
+    if ( !deep(cell*2) && !deep(cell*2+1) && !left.deep && !right.deep )
+        cells[cell] = apply_op(cells[cell],left.val|(right.val<<16),op);
+    else {
+        half_op(cell*2,layer-1,mask,left,op);
+        half_op(cell*2+1,layer-1,mask,right,op);
+    }
+    join(half);
+}
+
+
+/** Whether a pair of halves is a match (1), has no match inside (0)
+    or must be looked into (2). */
+static inline int find_verdict (uint16_t val, bool deep, uint16_t fval,
+                                bool fdeep, uint16_t seek) {
+    uint16_t stop = ~seek;
+    if ( (!fdeep && fval==binmap_t::FILLED) || (!deep && val==stop) )
+        return 0;
+    if (deep || fdeep)
+        return 2;
+    if (val==seek && fval==binmap_t::EMPTY)
+        return 1;
+    return ((val^stop) & ~fval) ? 2 : 0;
+}
+
+
+bin64_t     binmap_t::find_half (halfref_t ref, binmap_t& filter,
+                                 halfref_t fref, bin64_t pos, fill_t seek) {
+    int layer = pos.layer()-1;
+    halfref_t kids[2] = { child(ref,false,layer), child(ref,true,layer) };
+    halfref_t fkids[2] =
+        { filter.child(fref,false,layer), filter.child(fref,true,layer) };
+    if ( !kids[0].deep && !kids[1].deep && !fkids[0].deep && !fkids[1].deep &&
+            !( ((kids[0].val|kids[1].val<<16) ^ ~(uint32_t)(seek|seek<<16)) &
+               ~(fkids[0].val|fkids[1].val<<16) ) )
+        return bin64_t::NONE; // both flat, no candidates: 32 bits at once
+    for(int lr=0; lr<2; lr++) {
+        bin64_t kid = lr ? pos.right() : pos.left();
+        switch (find_verdict(kids[lr].val,kids[lr].deep,
+                             fkids[lr].val,fkids[lr].deep,seek)) {
+            case 1:
+                return kid;
+            case 2:
+                if (!layer)
+                    break; // mixed base bin, broken binmap
+                bin64_t found = find_half(kids[lr],filter,fkids[lr],kid,seek);
+                if (found!=bin64_t::NONE)
+                    return found;
+        }
+    }
+    return bin64_t::NONE;
+}
+
+
 bin64_t     binmap_t::find_filtered 
     (binmap_t& filter, bin64_t range, fill_t seek)  
 {
     if (range==bin64_t::ALL)
         range = bin64_t ( height>filter.height ? height : filter.height, 0 );
-    iterator ti(this,range,true), fi(&filter,range,true);
-    fill_t stop = seek==EMPTY ? FILLED : EMPTY;
-    while (true) {
-        while ( 
-                fi.deep() ?
-                (ti.deep() || *ti!=stop)  :
-                (ti.deep() ? *fi!=FILLED : 
-                    ( ((*ti^stop)&~*fi) && (*ti!=seek || *fi!=EMPTY) ) ) 
-              ) 
-        {
-            ti.left(); fi.left();                
-        }
-        if (!ti.deep() && *ti==seek && !fi.deep() && *fi==EMPTY)
-            return ti.bin();
-        while (ti.bin().is_right() && ti.bin()!=range)
-            ti.parent(), fi.parent();
-        if (ti.bin()==range)
-            break;
-        ti.sibling(), fi.sibling();
+    halfref_t ref = locate(range), fref = filter.locate(range);
+    switch (find_verdict(ref.val,ref.deep,fref.val,fref.deep,seek)) {
+        case 1:  return range;
+        case 2:  if (range.layer())
+                    return find_half(ref,filter,fref,range,seek);
     }
-    return bin64_t::NONE;    
+    return bin64_t::NONE;
 }
 
+
 void        binmap_t::range_op (binmap_t& mask, bin64_t range, bin_op_t op) {
     if (range==bin64_t::ALL)
         range = bin64_t ( height>mask.height ? height : mask.height, 0 );
-    iterator zis(this,range,true), zat(&mask,range,true);
-    while (zis.pos.within(range)) {
-        while (zis.deep() || zat.deep()) {
-            zis.left(); zat.left();
-        }
-
-        switch (op) {
-            case REMOVE_OP:
-                *zis &= ~*zat;
-                break;
-            case AND_OP:
-                *zis &= *zat;
-                break;
-            case COPY_OP:
-                *zis = *zat;
-                break;
-            case OR_OP:
-                *zis |= *zat;
-        }
-        
-        while (zis.pos.is_right()) {
-            zis.parent(); zat.parent();
-        }
-        zis.sibling(); zat.sibling();
-    }
+    halfref_t mref = mask.locate(range);
+    iterator zis(this,range,true);
+    half_op(zis.half,range.layer(),mask,mref,op);
 }
 
+
 uint64_t    binmap_t::seq_length () {
     iterator i(this,bin64_t(height,0));
     if (!i.deep() && *i==FILLED)
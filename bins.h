@@ -81,6 +81,16 @@ public:
         the next stripe will also start at 0). */
     uint64_t*   get_stripes (int& count);
 
+    /** Put the binmap into a compact, self-contained, versioned form
+        fit for files and the wire (see bins.cpp). Returns the number of
+        bytes written or, if it does not fit, the number of bytes needed. */
+    size_t      serialize (uint8_t* buf, size_t size) const;
+    
+    /** Load a serialized binmap in O(cells), replacing the contents.
+        The data might be mmap'd. If it is malformed, false is returned
+        and the binmap is left as it was. */
+    bool        deserialize (const uint8_t* buf, size_t size);
+
     /** Return the number of cells allocated in the binmap. */
     uint32_t    size() { return cells_allocated; }
     
@@ -102,6 +112,8 @@ public:
 
     /** Clear everything, empty all bins. */
     void        clear ();
+    /** Empty all the bins before the offset (in base bins). */
+    void        clear_before (uint64_t offset);
     
     /** Returns whether the int is mixed (not all-1 or all-0). */
     static bool is_mixed (uint16_t val) { return val!=EMPTY && val!=FILLED; }
@@ -169,9 +181,28 @@ private:
     
     static uint32_t split16to32(uint16_t half);
     static int join32to16(uint32_t cell);
+    static bool is_flat_ok (uint16_t val, int layer);
 
     void        map16 (uint16_t* target, bin64_t range);
     
+    /** A half, or a part of a flat half (as if it was split); the latter
+        kind is only good for reading. */
+    struct halfref_t {
+        uint32_t    half;
+        uint16_t    val;
+        bool        deep;
+    };
+    /** Find the bin, without splitting anything. */
+    halfref_t   locate (bin64_t bin);
+    /** Left or right child of a half of the given layer. */
+    halfref_t   child (const halfref_t& ref, bool right, int layer) const;
+    /** range_op on a half, solid mask halves applied in bulk. */
+    void        half_op (uint32_t half, int layer, binmap_t& mask,
+                         halfref_t mref, bin_op_t op);
+    bin64_t     find_half (halfref_t ref, binmap_t& filter, halfref_t fref,
+                           bin64_t pos, fill_t seek);
+    void        free_subtree (uint16_t cell);
+    
     friend class iterator;
 #ifdef FRIEND_TEST
     FRIEND_TEST(BinsTest,Routines);
@@ -30,9 +30,11 @@ swift::tint Channel::last_tick = 0;
 int Channel::MAX_REORDERING = 4;
 bool Channel::SELF_CONN_OK = false;
 swift::tint Channel::TIMEOUT = TINT_SEC*60;
-std::vector<Channel*> Channel::channels(1);
+std::vector<Channel::slot_t> Channel::channels(1);
+uint32_t Channel::free_head = 0;
+uint32_t Channel::free_tail = 0;
 Address Channel::tracker;
-tbheap Channel::send_queue;
+tbidxheap Channel::send_queue;
 FILE* Channel::debug_file = NULL;
 #include "ext/simple_selector.cpp"
 PeerSelector* Channel::peer_selector = new SimpleSelector();
@@ -40,32 +42,93 @@ PeerSelector* Channel::peer_selector = new SimpleSelector();
 Channel::Channel    (FileTransfer* transfer, int socket, Address peer_addr) :
     transfer_(transfer), peer_(peer_addr), peer_channel_id_(0), pex_out_(0),
     socket_(socket==INVALID_SOCKET?Datagram::default_socket():socket), // FIXME
-    data_out_cap_(bin64_t::ALL), last_data_out_time_(0), last_data_in_time_(0),
+    last_data_out_time_(0), last_data_in_time_(0),
     own_id_mentioned_(false), next_send_time_(0), last_send_time_(0),
     last_recv_time_(0), rtt_avg_(TINT_SEC), dev_avg_(0), dip_avg_(TINT_SEC),
-    data_in_dbl_(bin64_t::NONE), hint_out_size_(0),
-    cwnd_(1), send_interval_(TINT_SEC), send_control_(PING_PONG_CONTROL),
+    data_in_dbl_(bin64_t::NONE), data_out_dups_(0), hint_out_size_(0),
+    controller_(NewCongestionController(transfer->congestion())),
+    send_interval_(TINT_SEC), send_control_(PING_PONG_CONTROL),
     sent_since_recv_(0), ack_rcvd_recent_(0), ack_not_rcvd_recent_(0),
-    last_loss_time_(0), owd_min_bin_(0), owd_min_bin_start_(NOW), 
-    owd_cur_bin_(0), dgrams_sent_(0), dgrams_rcvd_(0), 
-    data_in_(TINT_NEVER,bin64_t::NONE)
+    dgrams_sent_(0), dgrams_rcvd_(0), 
+    data_in_(TINT_NEVER,bin64_t::NONE), cap_in_(0), peaks_out_(0),
+    peaks_out_time_(0), hint_due_(false)
 {
+    ResetHave();
     if (peer_==Address())
         peer_ = tracker;
-    this->id_ = channels.size();
-    channels.push_back(this);
-    transfer_->hs_in_.push_back(id_);
-    for(int i=0; i<4; i++) {
-        owd_min_bins_[i] = TINT_NEVER;
-        owd_current_[i] = TINT_NEVER;
+    if (free_head) { // oldest free slot first, so ids are slow to repeat
+        id_ = free_head;
+        free_head = channels[id_].next_free;
+        if (!free_head)
+            free_tail = 0;
+    } else {
+        id_ = channels.size();
+        assert(id_<(1<<ID_BITS));
+        channels.push_back(slot_t());
     }
+    channels[id_].channel = this;
+    transfer_->peer_channels_.add(peer_,id_);
+    hs_in_pos_ = transfer_->hs_in_.size() + transfer_->hs_in_offset_;
+    transfer_->hs_in_.push_back(id_);
     Reschedule();
     dprintf("%s #%u init %s\n",tintstr(),id_,peer_.str());
 }
 
 
 Channel::~Channel () {
-    channels[id_] = NULL;
+    ReportAckIn(-1);
+    delete controller_;
+    send_queue.remove(id_);
+    transfer_->peer_channels_.remove(peer_,id_);
+    int pos = hs_in_pos_ - transfer_->hs_in_offset_;
+    assert(transfer_->hs_in_[pos]==bin64_t(id_));
+    transfer_->RemoveChannel(pos);
+    slot_t& slot = channels[id_];
+    slot.channel = NULL;
+    slot.generation = (slot.generation+1) & ((1<<(32-ID_BITS))-1);
+    slot.next_free = 0;
+    if (free_tail)
+        channels[free_tail].next_free = id_;
+    else
+        free_head = id_;
+    free_tail = id_;
+}
+
+
+/** Channels are carved out of slabs of CHANNEL_SLAB and never given back
+    to the heap; freed ones are chained through their first word. This way
+    a seeder with constant peer churn keeps its channels in a few pages. */
+#define CHANNEL_SLAB 64
+
+static void* channel_free_mem = NULL;
+
+void* Channel::operator new (size_t size) {
+    if (size!=sizeof(Channel))
+        return ::operator new(size);
+    if (!channel_free_mem) {
+        char* slab = (char*) malloc(CHANNEL_SLAB*sizeof(Channel));
+        if (!slab)
+            throw std::bad_alloc();
+        for(int i=CHANNEL_SLAB-1; i>=0; i--) {
+            *(void**)(slab+i*sizeof(Channel)) = channel_free_mem;
+            channel_free_mem = slab+i*sizeof(Channel);
+        }
+    }
+    void* ret = channel_free_mem;
+    channel_free_mem = *(void**)ret;
+    return ret;
+}
+
+
+void Channel::operator delete (void* p, size_t size) {
+    if (!p)
+        return;
+    if (size!=sizeof(Channel)) {
+        ::operator delete(p);
+        return;
+    }
+    *(void**)p = channel_free_mem;
+    channel_free_mem = p;
 }
 
 
@@ -74,11 +137,154 @@ void     swift::SetTracker(const Address& tracker) {
 }
 
 
+Channel* Channel::Find (const Address& addr, FileTransfer* trans) {
+    int pos = -1;
+    uint32_t id = trans->peer_channels_.next(addr,pos);
+    return id ? channel(id) : NULL;
+}
+
+
+uint32_t addrindex::home (uint32_t ipv4, uint16_t port) const {
+    uint32_t h = (ipv4 ^ ((uint32_t)port<<16 | port)) * 0x9E3779B1;
+    return (h ^ h>>16) & (slots_.size()-1);
+}
+
+
+void addrindex::add (const Address& addr, uint32_t id) {
+    if (2*(count_+1)>slots_.size()) {
+        std::vector<slot_t> old(slots_.size()*2);
+        old.swap(slots_);
+        count_ = 0;
+        for(int i=0; i<old.size(); i++)
+            if (old[i].id)
+                add(Address(old[i].ipv4,old[i].port),old[i].id);
+    }
+    uint32_t i = home(addr.ipv4(),addr.port()), mask = slots_.size()-1;
+    while (slots_[i].id)
+        i = (i+1) & mask;
+    slots_[i].ipv4 = addr.ipv4();
+    slots_[i].port = addr.port();
+    slots_[i].id = id;
+    count_++;
+}
+
+
+void addrindex::remove (const Address& addr, uint32_t id) {
+    uint32_t i = home(addr.ipv4(),addr.port()), mask = slots_.size()-1;
+    while ( slots_[i].id && (slots_[i].id!=id ||
+            slots_[i].ipv4!=addr.ipv4() || slots_[i].port!=addr.port()) )
+        i = (i+1) & mask;
+    if (!slots_[i].id)
+        return;
+    // backward shift deletion, as in FileTransfer::IndexRemove
+    for(uint32_t j=(i+1)&mask; slots_[j].id; j=(j+1)&mask) {
+        uint32_t h = home(slots_[j].ipv4,slots_[j].port);
+        if ( ((j-h)&mask) >= ((j-i)&mask) ) {
+            slots_[i] = slots_[j];
+            i = j;
+        }
+    }
+    slots_[i].id = 0;
+    count_--;
+}
+
+
+uint32_t addrindex::next (const Address& addr, int& pos) const {
+    uint32_t mask = slots_.size()-1;
+    uint32_t i = pos==-1 ? home(addr.ipv4(),addr.port()) : (pos+1)&mask;
+    for(; slots_[i].id; i=(i+1)&mask)
+        if (slots_[i].ipv4==addr.ipv4() && slots_[i].port==addr.port()) {
+            pos = i;
+            return slots_[i].id;
+        }
+    return 0;
+}
+
+
+void tbring::grow () {
+    tintbin* data = new tintbin[2*(mask_+1)];
+    for(uint32_t i=0; i<size_; i++)
+        data[i] = data_[(head_+i)&mask_];
+    delete [] data_;
+    data_ = data;
+    mask_ = 2*mask_ + 1;
+    head_ = 0;
+}
+
+
+void binindex::clear () {
+    slots_.resize(16);
+    for(int i=0; i<slots_.size(); i++)
+        slots_[i].bin = bin64_t::NONE;
+    count_ = 0;
+}
+
+
+uint64_t binindex::get (bin64_t bin, uint64_t def) const {
+    uint32_t mask = slots_.size()-1;
+    for(uint32_t i=home(bin); slots_[i].bin!=bin64_t::NONE; i=(i+1)&mask)
+        if (slots_[i].bin==bin)
+            return slots_[i].val;
+    return def;
+}
+
+
+void binindex::set (bin64_t bin, uint64_t val) {
+    uint32_t mask = slots_.size()-1, i = home(bin);
+    while (slots_[i].bin!=bin64_t::NONE && slots_[i].bin!=bin)
+        i = (i+1) & mask;
+    if (slots_[i].bin==bin) {
+        slots_[i].val = val;
+        return;
+    }
+    if (2*(count_+1)>slots_.size()) {
+        std::vector<slot_t> old(slots_.size()*2);
+        for(int j=0; j<old.size(); j++)
+            old[j].bin = bin64_t::NONE;
+        old.swap(slots_);
+        count_ = 0;
+        for(int j=0; j<old.size(); j++)
+            if (old[j].bin!=bin64_t::NONE)
+                set(old[j].bin,old[j].val);
+        set(bin,val);
+        return;
+    }
+    slots_[i].bin = bin;
+    slots_[i].val = val;
+    count_++;
+}
+
+
+void binindex::remove (bin64_t bin) {
+    uint32_t mask = slots_.size()-1, i = home(bin);
+    while (slots_[i].bin!=bin64_t::NONE && slots_[i].bin!=bin)
+        i = (i+1) & mask;
+    if (slots_[i].bin==bin64_t::NONE)
+        return;
+    for(uint32_t j=(i+1)&mask; slots_[j].bin!=bin64_t::NONE; j=(j+1)&mask) {
+        uint32_t h = home(slots_[j].bin);
+        if ( ((j-h)&mask) >= ((j-i)&mask) ) {
+            slots_[i] = slots_[j];
+            i = j;
+        }
+    }
+    slots_[i].bin = bin64_t::NONE;
+    count_--;
+}
+
+
+/** Returns -1 for an id from another generation of the slot. */
 int Channel::DecodeID(int scrambled) {
-    return scrambled ^ (int)Datagram::start;
+    uint32_t id = scrambled ^ (int)Datagram::start;
+    uint32_t slot = id & ((1<<ID_BITS)-1);
+    if (slot>=channels.size() || channels[slot].generation!=id>>ID_BITS)
+        return -1;
+    return slot;
 }
 int Channel::EncodeID(int unscrambled) {
-    return unscrambled ^ (int)Datagram::start;
+    uint32_t gen = unscrambled<channels.size() ?
+                   channels[unscrambled].generation : 0;
+    return ((gen<<ID_BITS) | unscrambled) ^ (int)Datagram::start;
 }
 
 
@@ -101,8 +307,9 @@ void    swift::Loop (tint till) {
 
 
 
-int      swift::Open (const char* filename, const Sha1Hash& hash) {
-    FileTransfer* ft = new FileTransfer(filename, hash);
+int      swift::Open (const char* filename, const Sha1Hash& hash,
+                      size_t chunk_size) {
+    FileTransfer* ft = new FileTransfer(filename, hash, chunk_size);
     if (ft && ft->file().file_descriptor()) {
 
         /*if (FileTransfer::files.size()<fdes)  // FIXME duplication
@@ -122,6 +329,19 @@ int      swift::Open (const char* filename, const Sha1Hash& hash) {
 }
 
 
+int      swift::OpenLive (const char* filename, const Sha1Hash& key,
+                          size_t chunk_size, uint64_t window) {
+    FileTransfer* ft = new FileTransfer(key, filename, chunk_size, window);
+    if (!ft->file().file_descriptor()) {
+        delete ft;
+        return -1;
+    }
+    if (Channel::tracker!=Address())
+        new Channel(ft);
+    return ft->file().file_descriptor();
+}
+
+
 void    swift::Close (int fd) {
     if (fd<FileTransfer::files.size() && FileTransfer::files[fd])
         delete FileTransfer::files[fd];
@@ -141,6 +361,12 @@ uint64_t  swift::Size (int fdes) {
 }
 
 
+size_t    swift::ChunkSize (int fdes) {
+    FileTransfer* trans = FileTransfer::file(fdes);
+    return trans ? trans->file().chunk_size() : 0;
+}
+
+
 bool  swift::IsComplete (int fdes) {
     if (FileTransfer::files.size()>fdes && FileTransfer::files[fdes])
         return FileTransfer::files[fdes]->file().is_complete();
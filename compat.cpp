@@ -59,12 +59,13 @@ void print_error(const char* msg) {
 #endif
 }
 
-void*   memory_map (int fd, size_t size) {
+void*   memory_map (int fd, size_t size, bool writable) {
     if (!size)
         size = file_size(fd);
     void *mapping;
 #ifndef _WIN32
-    mapping = mmap (NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    mapping = mmap (NULL, size, writable ? PROT_READ|PROT_WRITE : PROT_READ,
+                    MAP_SHARED, fd, 0);
     if (mapping==MAP_FAILED)
         return NULL;
     return mapping;
@@ -73,7 +74,7 @@ void*   memory_map (int fd, size_t size) {
     assert(fd<1024);
     HANDLE maphandle = CreateFileMapping(     fhandle,
                                        NULL,
-                                       PAGE_READWRITE,
+                                       writable ? PAGE_READWRITE : PAGE_READONLY,
                                        0,
                                        0,
                                        NULL    );
@@ -82,7 +83,7 @@ void*   memory_map (int fd, size_t size) {
     map_handles[fd] = maphandle;
 
     mapping = MapViewOfFile         (  maphandle,
-                                       FILE_MAP_WRITE,
+                                       writable ? FILE_MAP_WRITE : FILE_MAP_READ,
                                        0,
                                        0,
                                        0  );
@@ -91,7 +91,8 @@ int     file_seek (int fd, size_t offset);
 
 int     file_resize (int fd, size_t new_size);
 
-void*   memory_map (int fd, size_t size=0);
+/** Map the file shared; read-only unless writable. */
+void*   memory_map (int fd, size_t size=0, bool writable=true);
 void    memory_unmap (int fd, void*, size_t size);
 
 void    print_error (const char* msg);
@@ -7,6 +7,7 @@
  *
  */
 #include <iostream>
+#include <errno.h>
 
 #ifdef _WIN32
     #include <winsock2.h>
@@ -15,6 +16,10 @@
     #include <arpa/inet.h>
     #include <netdb.h>
 #endif
+#ifdef __linux__
+    #include <sys/epoll.h>
+    #include <sys/timerfd.h>
+#endif
 
 #include "datagram.h"
 #include "compat.h"
@@ -27,8 +32,8 @@ tint Datagram::epoch = now/360000000LL*360000000LL; // make logs mergeable
 uint32_t Address::LOCALHOST = INADDR_LOOPBACK;
 uint64_t Datagram::dgrams_up=0, Datagram::dgrams_down=0,
          Datagram::bytes_up=0, Datagram::bytes_down=0;
-sckrwecb_t Datagram::sock_open[] = {};
-int Datagram::sock_count = 0;
+std::vector<sckrwecb_t> Datagram::sock_open;
+Poller* Datagram::poller_ = NULL;
 
 const char* tintstr (tint time) {
     if (time==0)
@@ -89,38 +94,184 @@ Address::Address(const char* ip_port) {
     
 bool    Datagram::Listen3rdPartySocket (sckrwecb_t cb) {
     int i=0;
-    while (i<sock_count && sock_open[i].sock!=cb.sock) i++;
-    if (i==sock_count)
-        if (i==DGRAM_MAX_SOCK_OPEN)
-            return false;
-        else
-            sock_count++;
-    sock_open[i]=cb;
-    //if (!cb.may_read && !cb.may_write && !cb.on_error)
-    //    sock_open[i] = sock_open[--sock_count];
+    while (i<sock_open.size() && sock_open[i].sock!=cb.sock) i++;
+    if (!cb.may_read && !cb.may_write && !cb.on_error) {
+        poller()->Remove(cb.sock);
+        if (i<sock_open.size()) {
+            sock_open[i] = sock_open.back();
+            sock_open.pop_back();
+        }
+        return true;
+    }
+    if (!poller()->Add(cb))
+        return false;
+    if (i==sock_open.size())
+        sock_open.push_back(cb);
+    else
+        sock_open[i]=cb;
     return true;
 }
 
     
 void Datagram::Shutdown () {
-    while (sock_count--)
-        Close(sock_open[sock_count].sock);
+    while (sock_open.size())
+        Close(sock_open.back().sock);
 }
     
 
 int Datagram::Send () {
-    int r = sendto(sock,(const char *)buf+offset,length-offset,0,
-                   (struct sockaddr*)&(addr.addr),sizeof(struct sockaddr_in));
+    int r;
+#ifndef _WIN32
+    if (ref_length) {
+        struct iovec iov[2];
+        iov[0].iov_base = buf+offset;
+        iov[0].iov_len = length-offset;
+        iov[1].iov_base = (void*)ref;
+        iov[1].iov_len = ref_length;
+        struct msghdr msg;
+        memset(&msg,0,sizeof(struct msghdr));
+        msg.msg_name = &(addr.addr);
+        msg.msg_namelen = sizeof(struct sockaddr_in);
+        msg.msg_iov = iov;
+        msg.msg_iovlen = 2;
+        r = sendmsg(sock,&msg,0);
+    } else
+#else
+    if (ref_length) {
+        memcpy(buf+length,ref,ref_length);
+        length += ref_length;
+        ref_length = 0;
+    }
+#endif
+    r = sendto(sock,(const char *)buf+offset,length-offset,0,
+               (struct sockaddr*)&(addr.addr),sizeof(struct sockaddr_in));
     if (r<0)
         perror("can't send");
     dgrams_up++;
     bytes_up+=size();
-    offset=0;
-    length=0;
+    Clear();
     Time();
     return r;
 }
 
+
+int Datagram::PushFile (int fd, int l, uint64_t file_offset) {
+    if (l>space())
+        l = space();
+    int r = pread(fd,buf+length,l,file_offset);
+    if (r<0)
+        return -1;
+    length += r;
+    return r;
+}
+
+
+/** The transmit batch, kept in the order of Queue() calls, so whatever
+    one channel sends goes out in the same order. The datagrams lie in
+    out_slots; the one handed out by Outgoing is not on the batch yet. */
+static Datagram out_slots[DGRAM_MAX_BATCH+1];
+static Datagram* out_batch[DGRAM_MAX_BATCH];
+static int out_batch_size = 0;
+static Datagram* out_free[DGRAM_MAX_BATCH+1];
+static int out_free_size = -1;
+static Datagram* out_open = NULL;
+
+/** a slot that is neither queued nor handed out; there is one as long
+    as the batch is not full */
+static Datagram* out_slot () {
+    if (out_free_size<0)
+        for(out_free_size=0; out_free_size<=DGRAM_MAX_BATCH; out_free_size++)
+            out_free[out_free_size] = out_slots + out_free_size;
+    assert(out_free_size>0);
+    return out_free[--out_free_size];
+}
+
+Datagram& Datagram::Outgoing (SOCKET sock, const Address& addr) {
+    if (!out_open) // or reuse the one never queued
+        out_open = out_slot();
+    out_open->Clear();
+    out_open->sock = sock;
+    out_open->addr = addr;
+    return *out_open;
+}
+
+int Datagram::Queue () {
+    if (this!=out_open)
+        return QueueHead();
+    if (out_batch_size==DGRAM_MAX_BATCH)
+        Flush();
+    out_batch[out_batch_size++] = this;
+    out_open = NULL;
+    Time();
+    return size();
+}
+
+int Datagram::QueueHead () {
+    if (out_batch_size==DGRAM_MAX_BATCH)
+        Flush();
+    Datagram& q = *out_slot();
+    q.sock = sock;
+    q.addr = addr;
+    q.offset = 0;
+    q.length = length-offset;
+    memcpy(q.buf,buf+offset,length-offset);
+    q.ref = ref; // not copied
+    q.ref_length = ref_length;
+    out_batch[out_batch_size++] = &q;
+    Clear();
+    Time();
+    return q.size();
+}
+
+int Datagram::Flush () {
+    int queued = out_batch_size;
+    out_batch_size = 0;
+    for(int i=0; i<queued; ) {
+        SOCKET s = out_batch[i]->sock;
+        int run = 1;
+        while (i+run<queued && out_batch[i+run]->sock==s)
+            run++;
+#ifdef __linux__
+        struct mmsghdr msgs[DGRAM_MAX_BATCH];
+        struct iovec iovs[DGRAM_MAX_BATCH*2];
+        memset(msgs,0,sizeof(struct mmsghdr)*run);
+        for(int j=0; j<run; j++) {
+            Datagram& d = *out_batch[i+j];
+            iovs[j*2].iov_base = d.buf+d.offset;
+            iovs[j*2].iov_len = d.length-d.offset;
+            iovs[j*2+1].iov_base = (void*)d.ref;
+            iovs[j*2+1].iov_len = d.ref_length;
+            msgs[j].msg_hdr.msg_name = &(d.addr.addr);
+            msgs[j].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+            msgs[j].msg_hdr.msg_iov = iovs+j*2;
+            msgs[j].msg_hdr.msg_iovlen = d.ref_length ? 2 : 1;
+            dgrams_up++;
+            bytes_up += d.size();
+        }
+        int done = 0;
+        while (done<run) {
+            int r = sendmmsg(s,msgs+done,run-done,0);
+            if (r<0) {
+                perror("can't send");
+                r = 1; // drop that one, as sendto would
+            }
+            done += r;
+        }
+        for(int j=i; j<i+run; j++)
+            out_batch[j]->Clear();
+#else
+        for(int j=i; j<i+run; j++)
+            out_batch[j]->Send();
+#endif
+        for(int j=i; j<i+run; j++)
+            out_free[out_free_size++] = out_batch[j];
+        i += run;
+    }
+    if (queued)
+        Time();
+    return queued;
+}
+
 int Datagram::Recv () {
     socklen_t addrlen = sizeof(struct sockaddr_in);
     offset = 0;
@@ -128,7 +279,13 @@ int Datagram::Recv () {
                        (struct sockaddr*)&(addr.addr), &addrlen);
     if (length<0) {
         length = 0;
-        print_error("error on recv");
+#ifdef _WIN32
+        if (WSAGetLastError()!=WSAEWOULDBLOCK)
+#else
+        if (errno!=EAGAIN && errno!=EWOULDBLOCK)
+#endif
+            print_error("error on recv");
+        return -1;
     }
     dgrams_down++;
     bytes_down+=length;
@@ -136,42 +293,270 @@ int Datagram::Recv () {
     return length;
 }
 
+int Datagram::RecvBatch (SOCKET sock, Datagram* dgrams, int count) {
+    if (count>DGRAM_MAX_BATCH)
+        count = DGRAM_MAX_BATCH;
+#ifdef __linux__
+    struct mmsghdr msgs[DGRAM_MAX_BATCH];
+    struct iovec iovs[DGRAM_MAX_BATCH];
+    memset(msgs,0,sizeof(struct mmsghdr)*count);
+    for(int i=0; i<count; i++) {
+        Datagram& d = dgrams[i];
+        d.sock = sock;
+        d.offset = d.length = 0;
+        iovs[i].iov_base = d.buf;
+        iovs[i].iov_len = MAXDGRAMSZ*2;
+        msgs[i].msg_hdr.msg_name = &(d.addr.addr);
+        msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        msgs[i].msg_hdr.msg_iov = iovs+i;
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    int got = recvmmsg(sock,msgs,count,MSG_DONTWAIT,NULL);
+    if (got<0) {
+        if (errno==EAGAIN || errno==EWOULDBLOCK)
+            return 0;
+        print_error("error on recv");
+        return -1;
+    }
+    for(int i=0; i<got; i++) {
+        dgrams[i].length = msgs[i].msg_len;
+        bytes_down += msgs[i].msg_len;
+    }
+    dgrams_down += got;
+    Time();
+    return got;
+#else
+    int got = 0;
+    while (got<count) {
+        dgrams[got].sock = sock;
+        if (dgrams[got].Recv()<0)
+            break;
+        got++;
+    }
+    return got;
+#endif
+}
+
 
 SOCKET Datagram::Wait (tint usec) {
-    struct timeval timeout;
-    timeout.tv_sec = usec/TINT_SEC;
-    timeout.tv_usec = usec%TINT_SEC;
-    int max_sock_fd = 0;
-    fd_set rdfd, wrfd, errfd;
-    FD_ZERO(&rdfd);
-    FD_ZERO(&wrfd);
-    FD_ZERO(&errfd);
-    for(int i=0; i<sock_count; i++) {
-        if (sock_open[i].may_read!=0)
-            FD_SET(sock_open[i].sock,&rdfd);
-        if (sock_open[i].may_write!=0)
-            FD_SET(sock_open[i].sock,&wrfd);
-        if (sock_open[i].on_error!=0)
-            FD_SET(sock_open[i].sock,&errfd);
-        if (sock_open[i].sock>max_sock_fd)
-            max_sock_fd = sock_open[i].sock;
-    }
-    SOCKET sel = select(max_sock_fd+1, &rdfd, &wrfd, &errfd, &timeout);
-    Time();
-    if (sel>0) {
-        for (int i=0; i<=sock_count; i++) {
-            sckrwecb_t& sct = sock_open[i];
-            if (sct.may_read && FD_ISSET(sct.sock,&rdfd))
-                (*(sct.may_read))(sct.sock);
-            if (sct.may_write && FD_ISSET(sct.sock,&wrfd))
-                (*(sct.may_write))(sct.sock);
-            if (sct.on_error && FD_ISSET(sct.sock,&errfd))
-                (*(sct.on_error))(sct.sock);
+    Flush();
+    return poller()->Wait(usec);
+}
+
+
+/** select() backend. The fd_sets are maintained on (un)registration and
+    copied on every wait; the registry is walked to dispatch the events. */
+class SelectPoller : public Poller {
+    fd_set      rdfd_, wrfd_, errfd_;
+    std::vector<sckrwecb_t> socks_;
+    int         max_sock_fd_;
+public:
+    SelectPoller () : max_sock_fd_(0) {
+        FD_ZERO(&rdfd_);
+        FD_ZERO(&wrfd_);
+        FD_ZERO(&errfd_);
+    }
+    bool Add (const sckrwecb_t& cb, bool edge) {
+#ifndef _WIN32
+        if (cb.sock<0 || cb.sock>=FD_SETSIZE)
+            return false;
+#endif
+        int i=0;
+        while (i<socks_.size() && socks_[i].sock!=cb.sock) i++;
+        if (i==socks_.size()) {
+            if (i==FD_SETSIZE)
+                return false;
+            socks_.push_back(cb);
+        } else
+            socks_[i] = cb;
+        FD_CLR(cb.sock,&rdfd_);
+        FD_CLR(cb.sock,&wrfd_);
+        FD_CLR(cb.sock,&errfd_);
+        if (cb.may_read)
+            FD_SET(cb.sock,&rdfd_);
+        if (cb.may_write)
+            FD_SET(cb.sock,&wrfd_);
+        if (cb.on_error)
+            FD_SET(cb.sock,&errfd_);
+        if ((int)cb.sock>max_sock_fd_)
+            max_sock_fd_ = cb.sock;
+        return true;
+    }
+    void Remove (SOCKET sock) {
+        for(int i=0; i<socks_.size(); i++)
+            if (socks_[i].sock==sock) {
+                FD_CLR(sock,&rdfd_);
+                FD_CLR(sock,&wrfd_);
+                FD_CLR(sock,&errfd_);
+                socks_[i] = socks_.back();
+                socks_.pop_back();
+                break;
+            }
+    }
+    int Wait (tint usec) {
+        if (usec<0)
+            usec = 0;
+        struct timeval timeout;
+        timeout.tv_sec = usec/TINT_SEC;
+        timeout.tv_usec = usec%TINT_SEC;
+        fd_set rdfd = rdfd_, wrfd = wrfd_, errfd = errfd_;
+        int sel = select(max_sock_fd_+1, &rdfd, &wrfd, &errfd, &timeout);
+        Datagram::Time();
+        if (sel>0) {
+            // callbacks may (un)register sockets, so mind the bounds
+            for (int i=0; i<socks_.size(); i++) {
+                if (socks_[i].may_read && FD_ISSET(socks_[i].sock,&rdfd))
+                    (*(socks_[i].may_read))(socks_[i].sock);
+                if (i<socks_.size() && socks_[i].may_write &&
+                        FD_ISSET(socks_[i].sock,&wrfd))
+                    (*(socks_[i].may_write))(socks_[i].sock);
+                if (i<socks_.size() && socks_[i].on_error &&
+                        FD_ISSET(socks_[i].sock,&errfd))
+                    (*(socks_[i].on_error))(socks_[i].sock);
+            }
+        } else if (sel<0) {
+            print_error("select fails");
+        }
+        return sel;
+    }
+    const char* name () const { return "select"; }
+};
+
+
+#ifdef __linux__
+
+/** epoll backend. Registration lives in the kernel; waking up costs
+    O(ready sockets), not O(registered sockets). A wait rounded up to a
+    whole millisecond makes paced data go out late, then in bursts; so
+    the timeout is set on a timerfd (registered like a socket, but never
+    in socks_) and epoll waits for it or the sockets. */
+class EpollPoller : public Poller {
+    int         epfd_;
+    int         timerfd_;
+    std::vector<sckrwecb_t> socks_;
+#define EPOLL_MAX_EVENTS 64
+    struct epoll_event events_[EPOLL_MAX_EVENTS];
+public:
+    EpollPoller (int epfd, int timerfd) : epfd_(epfd), timerfd_(timerfd) {}
+    ~EpollPoller () {
+        close(epfd_);
+        if (timerfd_>=0)
+            close(timerfd_);
+    }
+    bool Add (const sckrwecb_t& cb, bool edge) {
+        if (cb.sock<0)
+            return false;
+        if (socks_.size()<=cb.sock)
+            socks_.resize(cb.sock+1,sckrwecb_t(INVALID_SOCKET));
+        struct epoll_event ev;
+        memset(&ev,0,sizeof(ev));
+        ev.data.fd = cb.sock;
+        if (cb.may_read)
+            ev.events |= EPOLLIN;
+        if (cb.may_write)
+            ev.events |= EPOLLOUT;
+        if (edge)
+            ev.events |= EPOLLET;
+        int op = socks_[cb.sock].sock==cb.sock ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+        if (epoll_ctl(epfd_,op,cb.sock,&ev)!=0) {
+            op = op==EPOLL_CTL_ADD ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+            if (epoll_ctl(epfd_,op,cb.sock,&ev)!=0) {
+                print_error("epoll registration fails");
+                return false;
+            }
         }
-    } else if (sel<0) {
-        print_error("select fails");
+        socks_[cb.sock] = cb;
+        return true;
     }
-    return sel;
+    void Remove (SOCKET sock) {
+        if (sock<0 || sock>=socks_.size() || socks_[sock].sock!=sock)
+            return;
+        epoll_ctl(epfd_,EPOLL_CTL_DEL,sock,NULL); // fails if already closed
+        socks_[sock] = sckrwecb_t(INVALID_SOCKET);
+    }
+    int Wait (tint usec) {
+        int msec = usec<=0 ? 0 : (usec+TINT_MSEC-1)/TINT_MSEC;
+        if (usec>0 && timerfd_>=0) {
+            struct itimerspec its;
+            memset(&its,0,sizeof(its));
+            its.it_value.tv_sec = usec / TINT_SEC;
+            its.it_value.tv_nsec = usec % TINT_SEC * 1000;
+            if (timerfd_settime(timerfd_,0,&its,NULL)==0)
+                msec = -1;
+        }
+        int n = epoll_wait(epfd_,events_,EPOLL_MAX_EVENTS,msec);
+        Datagram::Time();
+        if (n<0) {
+            if (errno!=EINTR)
+                print_error("epoll fails");
+            return -1;
+        }
+        int ret = n;
+        for(int i=0; i<n; i++) {
+            SOCKET sock = events_[i].data.fd;
+            uint32_t evs = events_[i].events;
+            if (sock==timerfd_) { // expired; might be a stale one too
+                uint64_t expirations;
+                if (read(timerfd_,&expirations,sizeof(expirations))<0 &&
+                        errno!=EAGAIN)
+                    print_error("timerfd fails");
+                ret--;
+                continue;
+            }
+            // callbacks are re-read each time: any of them may reregister
+            if ( (evs&(EPOLLIN|EPOLLHUP)) && socks_[sock].may_read )
+                (*(socks_[sock].may_read))(sock);
+            if ( (evs&EPOLLOUT) && socks_[sock].may_write )
+                (*(socks_[sock].may_write))(sock);
+            if ( (evs&EPOLLERR) && socks_[sock].on_error )
+                (*(socks_[sock].on_error))(sock);
+        }
+        return ret;
+    }
+    const char* name () const {
+        return timerfd_>=0 ? "epoll+timerfd" : "epoll";
+    }
+};
+
+Poller* Poller::Epoll (bool precise) {
+    int epfd = epoll_create(EPOLL_MAX_EVENTS);
+    if (epfd<0)
+        return NULL;
+    if (!precise)
+        return new EpollPoller(epfd,-1);
+    int tfd = timerfd_create(CLOCK_MONOTONIC,TFD_NONBLOCK);
+    struct epoll_event ev;
+    memset(&ev,0,sizeof(ev));
+    ev.data.fd = tfd;
+    ev.events = EPOLLIN;
+    if (tfd<0 || epoll_ctl(epfd,EPOLL_CTL_ADD,tfd,&ev)!=0) {
+        if (tfd>=0)
+            close(tfd);
+        close(epfd);
+        return NULL; // waits rounded to milliseconds would spoil pacing
+    }
+    return new EpollPoller(epfd,tfd);
+}
+
+#else
+
+Poller* Poller::Epoll (bool precise) {
+    return NULL;
+}
+
+#endif
+
+Poller* Poller::Select () {
+    return new SelectPoller();
+}
+
+
+Poller* Datagram::poller () {
+    if (!poller_)
+        poller_ = Poller::Epoll();
+    if (!poller_)
+        poller_ = Poller::Select();
+    return poller_;
 }
 
 tint Datagram::Time () {
@@ -197,14 +582,19 @@ SOCKET Datagram::Bind (Address address, sckrwecb_t callbacks) {
     //setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (setsockoptptr_t)&enable, sizeof(int));
     dbnd_ensure ( ::bind(fd, (sockaddr*)&addr, len) == 0 );
     callbacks.sock = fd;
-    Datagram::sock_open[Datagram::sock_count++] = callbacks;
+    dbnd_ensure ( poller()->Add(callbacks,true) ); // reader drains the socket
+    sock_open.push_back(callbacks);
     return fd;
 }
 
 void Datagram::Close (SOCKET sock) {
-    for(int i=0; i<Datagram::sock_count; i++)
-        if (Datagram::sock_open[i].sock==sock)
-            Datagram::sock_open[i] = Datagram::sock_open[--Datagram::sock_count];
+    Flush(); // nothing queued may go to a recycled descriptor
+    poller()->Remove(sock);
+    for(int i=0; i<sock_open.size(); i++)
+        if (sock_open[i].sock==sock) {
+            sock_open[i] = sock_open.back();
+            sock_open.pop_back();
+        }
     if (!close_socket(sock))
         print_error("on closing a socket");
 }
@@ -11,13 +11,15 @@
 
 #include <sys/stat.h>
 #include <string.h>
+#include <vector>
 #include "hashtree.h"
 #include "compat.h"
 
 
 namespace swift {
 
-#define MAXDGRAMSZ 2800
+#define MAXDGRAMSZ (SWIFT_MAX_CHUNK_SIZE+1776)
+#define DGRAM_MAX_BATCH 64
 #ifndef _WIN32
 #define INVALID_SOCKET -1
 #endif
@@ -95,6 +97,32 @@ struct sckrwecb_t {
 };
 
 
+/** Readiness notification backend behind Datagram::Wait. Sockets are
+    registered once (Bind, Listen3rdPartySocket) and stay registered till
+    Close, so nothing is rebuilt on every wait. */
+class Poller {
+public:
+    /** Register a socket or update its callbacks. An edge-triggered socket
+        is reported once per readiness change, so its may_read callback
+        must drain it (see Channel::RecvDatagram). */
+    virtual bool    Add (const sckrwecb_t& cb, bool edge=false) = 0;
+    /** Forget the socket; no-op for unknown ones. */
+    virtual void    Remove (SOCKET sock) = 0;
+    /** Wait for io for usec at most, invoke the callbacks; returns the
+        number of ready sockets, 0 on timeout, -1 on error. */
+    virtual int     Wait (tint usec) = 0;
+    virtual const char* name () const = 0;
+    virtual ~Poller () {}
+
+    /** The portable select() backend; limited to FD_SETSIZE. */
+    static Poller*  Select ();
+    /** The epoll backend (Linux); NULL if not available. epoll_wait
+        takes milliseconds, so the timeouts are kept by a timerfd, to the
+        microsecond; with no timerfd, NULL too, unless precise is false. */
+    static Poller*  Epoll (bool precise=true);
+};
+
+
 /** UDP datagram class, a nice wrapping around sendto/recvfrom/select. 
     Reading/writing from/to a datagram is done in a FIFO (deque) fashion:
     written data is appended to the tail (push) while read data is
@@ -105,10 +133,12 @@ class Datagram {
     SOCKET sock;
     int offset, length;
     uint8_t    buf[MAXDGRAMSZ*2];
+    /** tail sent from where it lies, see PushRef */
+    const uint8_t* ref;
+    int ref_length;
 
-#define DGRAM_MAX_SOCK_OPEN 128
-    static int sock_count;
-    static sckrwecb_t sock_open[DGRAM_MAX_SOCK_OPEN];
+    static std::vector<sckrwecb_t> sock_open;
+    static Poller* poller_;
     
 public:
 
@@ -123,31 +153,37 @@ public:
 
     /** wait till one of the sockets has some io to do; usec is the timeout */
     static SOCKET Wait (tint usec);
+
+    /** the readiness backend: epoll where it waits to the microsecond,
+        select() otherwise */
+    static Poller* poller ();
     
     static bool Listen3rdPartySocket (sckrwecb_t cb) ;
     
     static void Shutdown ();
     
     static SOCKET default_socket() 
-        { return sock_count ? sock_open[0].sock : INVALID_SOCKET; }
+        { return sock_open.size() ? sock_open[0].sock : INVALID_SOCKET; }
 
     static tint now, epoch, start;
     static uint64_t dgrams_up, dgrams_down, bytes_up, bytes_down;
 
     /** This constructor is normally used to SEND something to the address. */
     Datagram (SOCKET socket, const Address addr_) : addr(addr_), offset(0),
-        length(0), sock(socket) {}
+        length(0), sock(socket), ref(NULL), ref_length(0) {}
     /** This constructor is normally used to RECEIVE something at the socket. */
-    Datagram (SOCKET socket) : offset(0), length(0), sock(socket) {
+    Datagram (SOCKET socket=INVALID_SOCKET) : offset(0), length(0),
+        sock(socket), ref(NULL), ref_length(0) {
     }
 
     /** space remaining */
-    int space () const { return MAXDGRAMSZ-length; }
+    int space () const { return MAXDGRAMSZ-length-ref_length; }
     /** size of the data (not counting UDP etc headers) */
-    int size() const { return length-offset; }
-    std::string str() const { return std::string((char*)buf+offset,size()); }
+    int size() const { return length-offset+ref_length; }
+    std::string str() const { return std::string((char*)buf+offset,length-offset); }
     const uint8_t* operator * () const { return buf+offset; }
     const Address& address () const { return addr; }
+    SOCKET socket_fd () const { return sock; }
     /** Append some data at the back */
     int Push (const uint8_t* data, int l) { // scatter-gather one day
         int toc = l<space() ? l : space();
@@ -155,6 +191,17 @@ public:
         length += toc;
         return toc;
     }
+    /** Append data by reference: it is sent right from where it lies
+        (scatter-gather), so it must stay intact till the datagram is
+        sent or flushed; nothing may be pushed after it. */
+    int PushRef (const uint8_t* data, int l) {
+        ref = data;
+        ref_length = l<space() ? l : space();
+        return ref_length;
+    }
+    /** Append up to l bytes read from the file at the offset, with no
+        intermediate buffer; returns the number of bytes read or -1 */
+    int PushFile (int fd, int l, uint64_t file_offset);
     /** Read something from the front of the datagram */
     int Pull (uint8_t** data, int l) {
         int toc = l<size() ? l : size();
@@ -165,9 +212,28 @@ public:
     }
 
     int Send ();
+    /** An empty datagram to the address, to be built right in the
+        outgoing batch: its Queue() copies nothing. There is one such
+        datagram at a time; it is not to be used after the Queue(). */
+    static Datagram& Outgoing (SOCKET sock, const Address& addr);
+    /** put the datagram on the outgoing batch (the datagram itself is
+        cleared, unless it is the Outgoing one, queued as it lies);
+        returns the number of bytes queued. The batch goes out on Flush,
+        which Wait and Close do implicitly, or once it is full. */
+    int Queue ();
+    /** queue a copy of what is in the datagram so far and go on with an
+        empty one to the same address; a copy, so meant for short heads */
+    int QueueHead ();
+    /** send all queued datagrams, one sendmmsg per run of datagrams on
+        the same socket where available; returns the number of datagrams */
+    static int Flush ();
+    /** receive a datagram; returns its size or -1 if there is none */
     int Recv ();
+    /** receive up to count datagrams in one go (recvmmsg where available);
+        returns the number of datagrams received, -1 on error */
+    static int RecvBatch (SOCKET sock, Datagram* dgrams, int count);
 
-    void Clear() { offset=length=0; }
+    void Clear() { offset=length=ref_length=0; ref=NULL; }
 
     void    PushString (std::string str) {
         Push((uint8_t*)str.c_str(),str.size());
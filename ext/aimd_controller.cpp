@@ -0,0 +1,76 @@
+/*
+ *  aimd_controller.cpp
+ *  swift
+ *
+ *  Copyright 2009 Delft University of Technology. All rights reserved.
+ *
+ */
+
+#include "swift.h"
+
+using namespace swift;
+
+
+/** Additive increase, multiplicative decrease, as TCP Reno does: the
+    window doubles every round trip in slow start, grows by a packet per
+    round trip after that and halves on a loss. Losses of one round trip
+    count as one. */
+class AimdController : public CongestionController {
+
+protected:
+
+    float           cwnd_;
+    /** Slow start goes on while the window is below that; it is set by
+        losses. */
+    float           ssthresh_;
+    bool            slow_start_;
+    tint            rtt_avg_;
+    tint            last_loss_time_;
+
+    void Sample (tint rtt) {
+        rtt_avg_ = (rtt_avg_*7 + rtt) >> 3;
+    }
+
+    /** Shrinks the window, once per round trip. */
+    bool BackOff (float ratio) {
+        if (last_loss_time_>=NOW-rtt_avg_)
+            return false;
+        last_loss_time_ = NOW;
+        cwnd_ *= ratio;
+        if (cwnd_<1)
+            cwnd_ = 1;
+        return true;
+    }
+
+public:
+
+    AimdController () : cwnd_(1), ssthresh_(1e9), slow_start_(true),
+    rtt_avg_(TINT_SEC), last_loss_time_(0) {}
+    virtual ~AimdController() {}
+
+    virtual void Restart () {
+        cwnd_ = 1;
+        slow_start_ = true;
+    }
+
+    virtual void OnAck (int acked, tint sent, tint rtt, tint owd) {
+        Sample(rtt);
+        if (slow_start_ && cwnd_>=ssthresh_)
+            slow_start_ = false;
+        if (slow_start_)
+            cwnd_ += acked;
+        else
+            cwnd_ += acked / cwnd_;
+    }
+
+    virtual void OnLoss () {
+        slow_start_ = false;
+        if (BackOff(0.5))
+            ssthresh_ = cwnd_;
+    }
+
+    virtual float cwnd () const {
+        return cwnd_;
+    }
+
+};
@@ -0,0 +1,212 @@
+/*
+ *  bbr_controller.cpp
+ *  swift
+ *
+ *  Copyright 2009 Delft University of Technology. All rights reserved.
+ *
+ */
+
+#include <deque>
+#include <math.h>
+#include "swift.h"
+
+using namespace swift;
+
+
+/** BBR: models the path as its bottleneck bandwidth (the best delivery
+    rate of the last BW_ROUNDS round trips) and its propagation delay
+    (the least round trip time of the last MIN_RTT_WINDOW), paces at the
+    bandwidth times a gain and keeps two bandwidth-delay products in
+    flight. Random losses do not shrink the window. Startup doubles the
+    rate every round trip till the bandwidth stops growing (or over 2%
+    of a round is lost: the queue is full already), drain then
+    empties the queue that made; from then on the gain cycles to probe
+    for more bandwidth, and every MIN_RTT_WINDOW the window drops to 4
+    packets for PROBE_RTT_TIME to see the delay without a queue. */
+class BbrController : public CongestionController {
+
+    typedef enum { STARTUP, DRAIN, PROBE_BW, PROBE_RTT } bbr_state_t;
+
+    /** What was delivered when a packet went out, and when the last of
+        that was acked; the delivery rate is measured from then to the
+        ack of the packet. */
+    struct sent_t {
+        tint        time, delivered_time;
+        uint64_t    delivered;
+    };
+
+    static const int BW_ROUNDS = 10;
+    static const int CYCLE = 8;
+
+    bbr_state_t     state_;
+    float           cwnd_;
+    float           pacing_gain_;
+    int             inflight_;
+    uint64_t        delivered_;
+    tint            delivered_time_;
+    std::deque<sent_t> sent_;
+    /** Round trips are counted by acks of packets sent after the
+        previous round started. */
+    int             round_;
+    tint            round_start_;
+    /** Best delivery rate of the recent rounds, packets per second. */
+    float           bw_[BW_ROUNDS];
+    float           btl_bw_;
+    tint            min_rtt_, min_rtt_time_;
+    /** Startup ends after three rounds without 25% more bandwidth. */
+    float           full_bw_;
+    int             round_acked_, round_lost_;
+    int             full_bw_rounds_;
+    bool            filled_;
+    int             cycle_;
+    tint            cycle_start_;
+    tint            probe_rtt_done_;
+
+    float bdp () const {
+        return btl_bw_ * min_rtt_ / TINT_SEC;
+    }
+
+    void EnterProbeBw () {
+        state_ = PROBE_BW;
+        cycle_ = 2; // not right after a drain
+        cycle_start_ = NOW;
+        pacing_gain_ = PROBE_GAIN[cycle_];
+    }
+
+    void NewRound () {
+        round_++;
+        round_start_ = NOW;
+        bw_[round_%BW_ROUNDS] = 0;
+        bool lossy = round_lost_*50>round_acked_+round_lost_;
+        round_acked_ = round_lost_ = 0;
+        if (state_!=STARTUP)
+            return;
+        if (btl_bw_>=full_bw_*1.25 && !lossy) {
+            full_bw_ = btl_bw_;
+            full_bw_rounds_ = 0;
+        } else if (++full_bw_rounds_>=3 || lossy) {
+            filled_ = true;
+            state_ = DRAIN;
+            pacing_gain_ = 1 / HIGH_GAIN;
+        }
+    }
+
+public:
+
+    /** The gain of startup, 2/ln(2): doubles the rate every round. */
+    static float HIGH_GAIN;
+    static float PROBE_GAIN[CYCLE];
+    static tint MIN_RTT_WINDOW;
+    static tint PROBE_RTT_TIME;
+
+    BbrController () : state_(STARTUP), cwnd_(1), pacing_gain_(HIGH_GAIN),
+    inflight_(0), delivered_(0), delivered_time_(NOW), round_(0), round_start_(0), btl_bw_(0),
+    min_rtt_(TINT_NEVER), min_rtt_time_(NOW), full_bw_(0),
+    round_acked_(0), round_lost_(0),
+    full_bw_rounds_(0), filled_(false), cycle_(0), cycle_start_(0), probe_rtt_done_(0) {
+        for(int i=0; i<BW_ROUNDS; i++)
+            bw_[i] = 0;
+    }
+    virtual ~BbrController() {}
+
+    /** The model survives a pause; what was in flight is not counted. */
+    virtual void Restart () {
+        sent_.clear();
+        inflight_ = 0;
+    }
+
+    virtual void OnSend () {
+        if (sent_.empty() && !inflight_)
+            delivered_time_ = NOW; // no acks to wait for
+        sent_t s = {NOW,delivered_time_,delivered_};
+        sent_.push_back(s);
+        inflight_++;
+    }
+
+    virtual void OnAck (int acked, tint sent, tint rtt, tint owd) {
+        delivered_ += acked;
+        delivered_time_ = NOW;
+        round_acked_ += acked;
+        inflight_ = std::max(0,inflight_-acked);
+        bool have = false;
+        sent_t s;
+        while (!sent_.empty() && sent_.front().time<=sent) {
+            s = sent_.front();
+            sent_.pop_front();
+            have = true;
+        }
+        if (sent>=round_start_)
+            NewRound();
+        if (have && NOW>s.delivered_time) {
+            float rate = (float)(delivered_-s.delivered) * TINT_SEC /
+                         (NOW-s.delivered_time);
+            if (rate>bw_[round_%BW_ROUNDS])
+                bw_[round_%BW_ROUNDS] = rate;
+            btl_bw_ = 0;
+            for(int i=0; i<BW_ROUNDS; i++)
+                btl_bw_ = std::max(btl_bw_,bw_[i]);
+        }
+        if (rtt<=min_rtt_) {
+            min_rtt_ = rtt;
+            min_rtt_time_ = NOW;
+        } else if (state_!=PROBE_RTT && min_rtt_time_<NOW-MIN_RTT_WINDOW) {
+            state_ = PROBE_RTT;
+            pacing_gain_ = 1;
+            probe_rtt_done_ = NOW + std::max(PROBE_RTT_TIME,min_rtt_);
+            min_rtt_ = rtt;
+            min_rtt_time_ = NOW;
+        }
+        switch (state_) {
+            case STARTUP:
+                break;
+            case DRAIN:
+                if (inflight_<=bdp())
+                    EnterProbeBw();
+                break;
+            case PROBE_BW:
+                if (NOW-cycle_start_>min_rtt_) {
+                    cycle_ = (cycle_+1) % CYCLE;
+                    cycle_start_ = NOW;
+                    pacing_gain_ = PROBE_GAIN[cycle_];
+                }
+                break;
+            case PROBE_RTT:
+                if (NOW>=probe_rtt_done_) {
+                    if (filled_)
+                        EnterProbeBw();
+                    else {
+                        state_ = STARTUP;
+                        pacing_gain_ = HIGH_GAIN;
+                    }
+                }
+                break;
+        }
+        cwnd_ += acked;
+        if (btl_bw_)
+            cwnd_ = std::min(cwnd_,(state_==STARTUP?HIGH_GAIN:2)*bdp());
+        if (cwnd_<4)
+            cwnd_ = 4;
+    }
+
+    virtual void OnLoss () {
+        round_lost_++;
+        inflight_ = std::max(0,inflight_-1);
+    }
+
+    virtual float cwnd () const {
+        return state_==PROBE_RTT ? 4 : cwnd_;
+    }
+
+    virtual tint send_interval (tint rtt) const {
+        if (!btl_bw_)
+            return rtt / cwnd();
+        return (tint) ceil(TINT_SEC / (pacing_gain_*btl_bw_)); // not faster
+    }
+
+};
+
+
+float BbrController::HIGH_GAIN = 2.885;
+float BbrController::PROBE_GAIN[CYCLE] = {1.25, 0.75, 1, 1, 1, 1, 1, 1};
+tint BbrController::MIN_RTT_WINDOW = 10*TINT_SEC;
+tint BbrController::PROBE_RTT_TIME = 200*TINT_MSEC;
@@ -0,0 +1,106 @@
+/*
+ *  cubic_controller.cpp
+ *  swift
+ *
+ *  Copyright 2009 Delft University of Technology. All rights reserved.
+ *
+ */
+
+#include <math.h>
+#include "swift.h"
+
+using namespace swift;
+
+
+/** CUBIC (RFC 8312): after a loss the window grows as a cubic function
+    of the time since, fast when far below the window the loss happened
+    at (w_max_), flat around it, fast again past it; so the growth does
+    not depend on the round trip time. Where Reno would do better (short
+    round trips) the window follows Reno's estimate instead. */
+class CubicController : public CongestionController {
+
+    float           cwnd_;
+    float           ssthresh_;
+    /** The window at the last loss. */
+    float           w_max_;
+    /** The window Reno would have (the TCP-friendly region). */
+    float           w_est_;
+    /** When the cubic growth started, the time to reach its origin and
+        the origin. */
+    tint            epoch_start_;
+    float           k_;
+    float           origin_;
+    tint            rtt_min_, rtt_avg_;
+    tint            last_loss_time_;
+
+public:
+
+    /** The scaling constant and the multiplicative decrease. */
+    static float C;
+    static float BETA;
+
+    CubicController () : cwnd_(1), ssthresh_(1e9), w_max_(0), w_est_(0),
+    epoch_start_(TINT_NEVER), k_(0), origin_(0), rtt_min_(TINT_NEVER),
+    rtt_avg_(TINT_SEC), last_loss_time_(0) {}
+    virtual ~CubicController() {}
+
+    virtual void Restart () {
+        cwnd_ = 1;
+        epoch_start_ = TINT_NEVER;
+    }
+
+    virtual void OnAck (int acked, tint sent, tint rtt, tint owd) {
+        rtt_avg_ = (rtt_avg_*7 + rtt) >> 3;
+        rtt_min_ = std::min(rtt_min_,rtt);
+        if (cwnd_<ssthresh_) {
+            cwnd_ += acked;
+            return;
+        }
+        if (epoch_start_==TINT_NEVER) {
+            epoch_start_ = NOW;
+            if (cwnd_<w_max_) {
+                k_ = pow((w_max_-cwnd_)/C,1.0/3);
+                origin_ = w_max_;
+            } else {
+                k_ = 0;
+                origin_ = cwnd_;
+            }
+            w_est_ = cwnd_;
+        }
+        double t = (double)(NOW + rtt_min_ - epoch_start_) / TINT_SEC - k_;
+        double target = origin_ + C*t*t*t;
+        if (target>cwnd_*1.5)
+            target = cwnd_*1.5;
+        if (target>cwnd_)
+            cwnd_ += (target-cwnd_) * acked / cwnd_;
+        else
+            cwnd_ += 0.01 * acked / cwnd_;
+        w_est_ += 3*(1-BETA)/(1+BETA) * acked / cwnd_;
+        if (w_est_>cwnd_)
+            cwnd_ = w_est_;
+    }
+
+    virtual void OnLoss () {
+        if (last_loss_time_>=NOW-rtt_avg_)
+            return;
+        last_loss_time_ = NOW;
+        epoch_start_ = TINT_NEVER;
+        if (cwnd_<w_max_) // fast convergence: yield to newcomers
+            w_max_ = cwnd_ * (1+BETA) / 2;
+        else
+            w_max_ = cwnd_;
+        cwnd_ *= BETA;
+        if (cwnd_<1)
+            cwnd_ = 1;
+        ssthresh_ = cwnd_;
+    }
+
+    virtual float cwnd () const {
+        return cwnd_;
+    }
+
+};
+
+
+float CubicController::C = 0.4;
+float CubicController::BETA = 0.7;
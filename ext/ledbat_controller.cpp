@@ -0,0 +1,70 @@
+/*
+ *  ledbat_controller.cpp
+ *  swift
+ *
+ *  Copyright 2009 Delft University of Technology. All rights reserved.
+ *
+ */
+
+#include "swift.h"
+
+using namespace swift;
+
+
+/** LEDBAT: yields to other traffic by keeping the queueing delay it adds
+    near Channel::LEDBAT_TARGET. The delay is the one-way delay over the
+    least one seen in the last few LEDBAT_DELAY_BIN periods (the clocks
+    need not agree). Slow start ends on a loss or once the packets go out
+    more often than ten a second; a loss backs off by a fifth. */
+class LedbatController : public AimdController {
+
+    tint            owd_min_bins_[4];
+    int             owd_min_bin_;
+    tint            owd_min_bin_start_;
+    tint            owd_current_;
+
+    tint owd_min () const {
+        tint ret = TINT_NEVER;
+        for(int i=0; i<4; i++)
+            ret = std::min(ret,owd_min_bins_[i]);
+        return ret;
+    }
+
+public:
+
+    LedbatController () : owd_min_bin_(0), owd_min_bin_start_(NOW),
+    owd_current_(TINT_NEVER) {
+        for(int i=0; i<4; i++)
+            owd_min_bins_[i] = TINT_NEVER;
+    }
+    virtual ~LedbatController() {}
+
+    virtual void OnAck (int acked, tint sent, tint rtt, tint owd) {
+        Sample(rtt);
+        owd_current_ = owd;
+        if (owd_min_bin_start_+Channel::LEDBAT_DELAY_BIN<NOW) {
+            owd_min_bin_start_ = NOW;
+            owd_min_bin_ = (owd_min_bin_+1) & 3;
+            owd_min_bins_[owd_min_bin_] = TINT_NEVER;
+        }
+        if (owd_min_bins_[owd_min_bin_]>owd)
+            owd_min_bins_[owd_min_bin_] = owd;
+        if (slow_start_) {
+            cwnd_ += acked;
+            if (rtt_avg_/cwnd_<TINT_SEC/10)
+                slow_start_ = false;
+            return;
+        }
+        tint queueing_delay = owd_current_ - owd_min();
+        tint off_target = Channel::LEDBAT_TARGET - queueing_delay;
+        cwnd_ += Channel::LEDBAT_GAIN * off_target * acked / cwnd_;
+        if (cwnd_<1)
+            cwnd_ = 1;
+    }
+
+    virtual void OnLoss () {
+        BackOff(slow_start_ ? 0.5 : 0.8);
+        slow_start_ = false;
+    }
+
+};
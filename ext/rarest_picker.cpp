@@ -0,0 +1,166 @@
+/*
+ *  rarest_picker.cpp
+ *  swift
+ *
+ *  Copyright 2009 Delft University of Technology. All rights reserved.
+ *
+ */
+
+#include <climits>
+#include "swift.h"
+
+using namespace swift;
+
+
+/** Picks the pieces fewest peers have, so peers have something to trade
+    and no piece depends on the seeder only. Availability is kept as a
+    tree of range counters, indexed by bin number: cnt_[b] peers have
+    all of b (and said so in one piece), min_[b] is the least number of
+    peers having any chunk within b, counters above b not included. */
+class RarestPiecePicker : public PiecePicker {
+
+    binmap_t        ack_hint_out_;
+    tbqueue         hint_out_;
+    FileTransfer*   transfer_;
+    uint64_t        twist_;
+    bin64_t         range_;
+    std::vector<int> cnt_, min_;
+    /** The root of the counter tree; NONE while the size is unknown. */
+    bin64_t         root_;
+    /** Availability was reported before the size was known. */
+    bool            stale_;
+
+    HashTree& file() {
+        return transfer_->file();
+    }
+
+    /** The tree is made once the size is known; the reports that came
+        before are asked for again. */
+    bool Ready () {
+        if (root_==bin64_t::NONE) {
+            if (!file().size())
+                return false;
+            int layer = 0;
+            while ((1ULL<<layer)<file().packet_size())
+                layer++;
+            root_ = bin64_t(layer,0);
+            cnt_.assign(2ULL<<layer,0);
+            min_.assign(2ULL<<layer,0);
+        }
+        if (stale_) {
+            stale_ = false;
+            transfer_->ReportAvailability();
+        }
+        return true;
+    }
+
+    /** Depth-first branch and bound over the bins the peer offers and
+        we neither have nor asked for; above is the sum of the counters
+        above pos. Finds the offered and wanted bin with the rarest chunk
+        in it; children go in the order set by the twist. */
+    void Rarest (binmap_t& offer, bin64_t pos, int above,
+                 bin64_t& best, int& best_avail) {
+        if (above+min_[pos]>=best_avail)
+            return;
+        if (offer.is_empty(pos) || ack_hint_out_.is_filled(pos))
+            return;
+        if (offer.is_filled(pos) && ack_hint_out_.is_empty(pos)) {
+            best = pos;
+            best_avail = above + min_[pos];
+            return;
+        }
+        above += cnt_[pos];
+        bool right = (twist_>>pos.layer()) & 1;
+        Rarest(offer,right?pos.right():pos.left(),above,best,best_avail);
+        Rarest(offer,right?pos.left():pos.right(),above,best,best_avail);
+    }
+
+public:
+
+    RarestPiecePicker (FileTransfer* file_to_pick_from) :
+    transfer_(file_to_pick_from), twist_(0), range_(bin64_t::ALL),
+    root_(bin64_t::NONE), stale_(false) {
+        ack_hint_out_.range_copy(file().ack_out(),bin64_t::ALL);
+    }
+    virtual ~RarestPiecePicker() {}
+
+    virtual void Randomize (uint64_t twist) {
+        twist_ = twist * 0x9E3779B97F4A7C15ULL; // all the layers
+    }
+
+    virtual void LimitRange (bin64_t range) {
+        range_ = range;
+    }
+
+    virtual bool AllHinted () {
+        if (!file().size())
+            return false;
+        for(int i=0; i<file().peak_count(); i++)
+            if (!ack_hint_out_.is_filled(file().peak(i)))
+                return false;
+        return true;
+    }
+
+    virtual void Available (bin64_t bin, int delta) {
+        if (!Ready()) {
+            stale_ = true;
+            return;
+        }
+        if (root_.within(bin))
+            bin = root_;
+        else if (!bin.within(root_))
+            return;
+        cnt_[bin] += delta;
+        min_[bin] += delta;
+        while (bin!=root_) {
+            bin = bin.parent();
+            min_[bin] = cnt_[bin] + std::min(min_[bin.left()],min_[bin.right()]);
+        }
+    }
+
+    virtual bin64_t Pick (binmap_t& offer, uint64_t max_width, tint expires) {
+        while (hint_out_.size() && hint_out_.front().time<NOW-TINT_SEC*3/2) { // FIXME sec
+            ack_hint_out_.range_copy(file().ack_out(), hint_out_.front().bin);
+            hint_out_.pop_front();
+        }
+        if (!Ready())
+            return bin64_t(0,0); // whoever sends it first
+        bin64_t from = root_;
+        if (range_!=bin64_t::ALL) {
+            if (!range_.within(root_))
+                return bin64_t::NONE;
+            from = range_;
+        }
+        int above = 0;
+        for(bin64_t b=from; b!=root_; ) {
+            b = b.parent();
+            above += cnt_[b];
+        }
+    retry:
+        bin64_t hint = bin64_t::NONE;
+        int avail = INT_MAX;
+        Rarest(offer,from,above,hint,avail);
+        if (hint==bin64_t::NONE)
+            return hint; // all hinted, see EndGame
+        if (!file().ack_out().is_empty(hint)) { // unhinted/late data
+            ack_hint_out_.range_copy(file().ack_out(), hint);
+            goto retry;
+        }
+        // down to the rarest chunk, then up to max_width around it
+        bin64_t chunk = hint;
+        while (!chunk.is_base()) {
+            bin64_t l = chunk.left(), r = chunk.right();
+            bool right = min_[r]<min_[l] ||
+                         (min_[r]==min_[l] && ((twist_>>chunk.layer())&1));
+            chunk = right ? r : l;
+        }
+        while (chunk!=hint && chunk.parent().width()<=max_width)
+            chunk = chunk.parent();
+        hint = chunk;
+        assert(ack_hint_out_.get(hint)==binmap_t::EMPTY);
+        ack_hint_out_.set(hint);
+        hint_out_.push_back(tintbin(NOW,hint));
+        return hint;
+    }
+
+};
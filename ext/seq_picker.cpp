@@ -41,6 +41,15 @@ public:
     virtual void LimitRange (bin64_t range) {
         range_ = range;
     }
+
+    virtual bool AllHinted () {
+        if (!file().size())
+            return false;
+        for(int i=0; i<file().peak_count(); i++)
+            if (!ack_hint_out_.is_filled(file().peak(i)))
+                return false;
+        return true;
+    }
     
     virtual bin64_t Pick (binmap_t& offer, uint64_t max_width, tint expires) {
         while (hint_out_.size() && hint_out_.front().time<NOW-TINT_SEC*3/2) { // FIXME sec
@@ -66,9 +75,8 @@ public:
             offer.twist(0);
             ack_hint_out_.twist(0);
         }
-        if (hint==bin64_t::NONE) {
-            return hint; // TODO: end-game mode
-        }
+        if (hint==bin64_t::NONE)
+            return hint; // all hinted, see EndGame
         if (!file().ack_out().is_empty(hint)) { // unhinted/late data
             ack_hint_out_.range_copy(file().ack_out(), hint);
             goto retry;
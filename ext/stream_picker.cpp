@@ -0,0 +1,171 @@
+/*
+ *  stream_picker.cpp
+ *  swift
+ *
+ *  Copyright 2009 Delft University of Technology. All rights reserved.
+ *
+ */
+
+#include "swift.h"
+
+using namespace swift;
+
+
+/** Picks pieces for a player: every chunk within WINDOW ahead of the
+    playback position has a deadline, set by the bitrate. A channel that
+    delivers about as soon as any other (see the expires argument of
+    Pick) gets the earliest chunk missing; a slower one gets the earliest
+    it can deliver in time, so the urgent ones go to the fastest (but
+    it takes them late if nothing else in the window is left, as the
+    fastest may not have them). Past the window, the rest of the file
+    is filled in order. */
+class StreamPiecePicker : public PiecePicker {
+
+    /** When the last chunk asked of a channel is due; channels are told
+        apart by their offers (ack_in_). */
+    struct lane_t {
+        binmap_t*   offer;
+        tint        arrives, seen;
+    };
+
+    binmap_t        ack_hint_out_;
+    tbqueue         hint_out_;
+    FileTransfer*   transfer_;
+    bin64_t         range_;
+    /** The byte the player needs next and the bytes it plays per
+        second; no deadlines while rate_ is 0. */
+    uint64_t        play_, rate_;
+    std::vector<lane_t> lanes_;
+
+    HashTree& file() {
+        return transfer_->file();
+    }
+
+    /** The chunk played at time, if playback goes on from now. */
+    uint64_t chunk_at (tint time) {
+        uint64_t byte = play_;
+        if (time>NOW)
+            byte += (time-NOW) * rate_ / TINT_SEC;
+        return byte / file().chunk_size();
+    }
+
+    /** Whether the channel delivers within 5/4 of the delay of the
+        fastest other one it knows of. */
+    bool Fast (binmap_t& offer, tint expires) {
+        tint best = TINT_NEVER;
+        int mine = -1;
+        for(int i=0; i<lanes_.size(); i++)
+            if (lanes_[i].seen<NOW-TINT_SEC) { // gone
+                lanes_[i--] = lanes_.back();
+                lanes_.pop_back();
+            } else if (lanes_[i].offer==&offer)
+                mine = i;
+            else
+                best = std::min(best,std::max(lanes_[i].arrives,NOW));
+        if (mine==-1) {
+            lane_t lane = {&offer,expires,NOW};
+            lanes_.push_back(lane);
+        } else {
+            lanes_[mine].arrives = expires;
+            lanes_[mine].seen = NOW;
+        }
+        return best==TINT_NEVER || expires-NOW <= (best-NOW)*5/4;
+    }
+
+    /** The first chunk in [from,to) the peer offers and nobody was
+        asked for; aligned bins are taken left to right, as in WalkHave. */
+    bin64_t Find (binmap_t& offer, uint64_t from, uint64_t to) {
+        while (from<to) {
+            bin64_t range(0,from);
+            while ( range.is_left() && range.parent().base_offset()+
+                    range.parent().width()<=to )
+                range = range.parent();
+            bin64_t hint = offer.find_filtered
+                (ack_hint_out_,range,binmap_t::FILLED);
+            if (hint!=bin64_t::NONE)
+                return hint;
+            from += range.width();
+        }
+        return bin64_t::NONE;
+    }
+
+public:
+
+    /** How far ahead of the playback position deadlines are set. */
+    static tint WINDOW;
+
+    StreamPiecePicker (FileTransfer* file_to_pick_from) :
+    transfer_(file_to_pick_from), range_(bin64_t::ALL), play_(0), rate_(0) {
+        ack_hint_out_.range_copy(file().ack_out(),bin64_t::ALL);
+    }
+    virtual ~StreamPiecePicker() {}
+
+    virtual void Randomize (uint64_t twist) {
+        // in order, deadlines first
+    }
+
+    virtual void LimitRange (bin64_t range) {
+        range_ = range;
+    }
+
+    virtual void Playback (uint64_t offset, uint64_t bytes_per_sec) {
+        play_ = offset;
+        rate_ = bytes_per_sec;
+    }
+
+    virtual bool AllHinted () {
+        if (!file().size())
+            return false;
+        for(int i=0; i<file().peak_count(); i++)
+            if (!ack_hint_out_.is_filled(file().peak(i)))
+                return false;
+        return true;
+    }
+
+    virtual bin64_t Pick (binmap_t& offer, uint64_t max_width, tint expires) {
+        while (hint_out_.size() && hint_out_.front().time<NOW-TINT_SEC*3/2) { // FIXME sec
+            ack_hint_out_.range_copy(file().ack_out(), hint_out_.front().bin);
+            hint_out_.pop_front();
+        }
+        if (!file().size())
+            return bin64_t(0,0); // whoever sends it first
+        bool fast = Fast(offer,expires);
+        uint64_t start = 0, end = file().packet_size();
+        if (range_!=bin64_t::ALL) {
+            start = range_.base_offset();
+            end = std::min(end,start+range_.width());
+        }
+    retry:
+        bin64_t hint = bin64_t::NONE;
+        if (rate_) {
+            uint64_t played = std::max(start,chunk_at(NOW)), from = played,
+                     to = std::min(end,chunk_at(NOW+WINDOW)+1);
+            if (!fast) // what it can make in time
+                from = std::max(from,chunk_at(expires)+1);
+            hint = Find(offer,from,to);
+            if (hint==bin64_t::NONE) // late beats never: the fast may lack it
+                hint = Find(offer,played,from);
+            if (hint==bin64_t::NONE)
+                hint = Find(offer,std::max(from,to),end);
+            if (hint==bin64_t::NONE) // played already: to complete the file
+                hint = Find(offer,start,played);
+        } else
+            hint = Find(offer,start,end);
+        if (hint==bin64_t::NONE)
+            return hint; // all hinted, see EndGame
+        if (!file().ack_out().is_empty(hint)) { // unhinted/late data
+            ack_hint_out_.range_copy(file().ack_out(), hint);
+            goto retry;
+        }
+        while (hint.width()>max_width)
+            hint = hint.left();
+        assert(ack_hint_out_.get(hint)==binmap_t::EMPTY);
+        ack_hint_out_.set(hint);
+        hint_out_.push_back(tintbin(NOW,hint));
+        return hint;
+    }
+
+};
+
+
+tint StreamPiecePicker::WINDOW = 8*TINT_SEC;
@@ -14,17 +14,30 @@
 #include <stdlib.h>
 #include <fcntl.h>
 #include "compat.h"
+#ifndef _WIN32
+#include <pthread.h>
+#endif
 
 #ifdef _WIN32
 #define OPENFLAGS         O_RDWR|O_CREAT|_O_BINARY
+#define READFLAGS         O_RDONLY|_O_BINARY
 #else
 #define OPENFLAGS         O_RDWR|O_CREAT
+#define READFLAGS         O_RDONLY
 #endif
 
 
 using namespace swift;
 
 #define HASHSZ 20
+#define TRAILER_MAGIC "swft"
+#define TRAILERSZ 8
+/** Checkpoint: magic, version, chunk size, root hash, size in chunks,
+    length of the binmap; then the serialized binmap of complete chunks;
+    then the SHA1 of all the preceding. Integers are big-endian. */
+#define CHECKPOINT_MAGIC "swfa"
+#define CHECKPOINT_VERSION 2
+#define CHECKPOINT_HEADERSZ 48
 const size_t Sha1Hash::SIZE = HASHSZ;
 const Sha1Hash Sha1Hash::ZERO = Sha1Hash();
 
@@ -52,6 +65,19 @@ Sha1Hash::Sha1Hash(const uint8_t* data, size_t length) {
     SHA1(data,length,bits);
 }
 
+#define HASH_MANY_MAX 64
+
+void Sha1Hash::HashMany (int count, const uint8_t* const* data,
+                         const size_t* lengths, Sha1Hash* const* hashes) {
+    unsigned char* outs[HASH_MANY_MAX];
+    for(int i=0; i<count; i+=HASH_MANY_MAX) {
+        int n = count-i<HASH_MANY_MAX ? count-i : HASH_MANY_MAX;
+        for(int j=0; j<n; j++)
+            outs[j] = hashes[i+j]->bits;
+        blk_SHA1_Multi(n,data+i,lengths+i,outs);
+    }
+}
+
 Sha1Hash::Sha1Hash(bool hex, const char* hash) {
     if (hex) {
         char hx[3]; hx[2]=0;
@@ -78,14 +104,148 @@ std::string    Sha1Hash::hex() const {
 
 
 
+/**     P a r a l l e l   h a s h i n g       */
+
+/** A share of Submit's work: either leaves [from,till) are read and hashed
+    or bins of some layer at offsets [from,till) are derived. */
+struct hash_job_t {
+    Sha1Hash*   hashes;
+    int         fd;
+    size_t      chunk_size;
+    int         layer;
+    uint64_t    leaves;
+    uint64_t    from, till;
+    bool        ok;
+};
+
+#define HASH_READ_SIZE (1<<20)
+#define HASH_MAX_THREADS 64
+
+static void* HashLeaves (void* arg) {
+    hash_job_t* job = (hash_job_t*) arg;
+    size_t per_read = HASH_READ_SIZE / job->chunk_size;
+    char* buf = (char*) malloc(per_read*job->chunk_size);
+    job->ok = buf!=NULL;
+    for(uint64_t i=job->from; job->ok && i<job->till; i+=per_read) {
+        size_t want = job->till-i<per_read ? job->till-i : per_read;
+        int rd = pread(job->fd,buf,want*job->chunk_size,i*job->chunk_size);
+        if ( rd<=(int)((want-1)*job->chunk_size) ||
+             (rd<(int)(want*job->chunk_size) && i+want!=job->leaves) ) {
+            job->ok = false; // the file got shorter
+            break;
+        }
+        for(size_t j=0; j<want; j+=HASH_MANY_MAX) {
+            const uint8_t* data[HASH_MANY_MAX];
+            size_t lengths[HASH_MANY_MAX];
+            Sha1Hash* hashes[HASH_MANY_MAX];
+            int n = 0;
+            for(; n<HASH_MANY_MAX && j+n<want; n++) {
+                data[n] = (uint8_t*) buf + (j+n)*job->chunk_size;
+                lengths[n] = rd-(j+n)*job->chunk_size;
+                if (lengths[n]>job->chunk_size)
+                    lengths[n] = job->chunk_size;
+                hashes[n] = job->hashes + bin64_t(0,i+j+n);
+            }
+            Sha1Hash::HashMany(n,data,lengths,hashes);
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+static void* HashLayer (void* arg) {
+    hash_job_t* job = (hash_job_t*) arg;
+    uint8_t pairs[HASH_MANY_MAX][HASHSZ*2];
+    const uint8_t* data[HASH_MANY_MAX];
+    size_t lengths[HASH_MANY_MAX];
+    Sha1Hash* hashes[HASH_MANY_MAX];
+    for(uint64_t i=job->from; i<job->till; i+=HASH_MANY_MAX) {
+        int n = 0;
+        for(; n<HASH_MANY_MAX && i+n<job->till; n++) {
+            bin64_t b(job->layer,i+n);
+            memcpy(pairs[n],job->hashes[b.left()].bits,HASHSZ);
+            memcpy(pairs[n]+HASHSZ,job->hashes[b.right()].bits,HASHSZ);
+            data[n] = pairs[n];
+            lengths[n] = HASHSZ*2;
+            hashes[n] = job->hashes + b;
+        }
+        Sha1Hash::HashMany(n,data,lengths,hashes);
+    }
+    job->ok = true;
+    return NULL;
+}
+
+/** Split [0,count) among up to HashTree::THREADS threads, min_share each
+    at least; the calling thread does a share itself. */
+static bool RunHashJobs (void* (*work) (void*), hash_job_t proto,
+                         uint64_t count, uint64_t min_share) {
+    hash_job_t jobs[HASH_MAX_THREADS];
+    int threads = HashTree::THREADS;
+    if (threads<=0) {
+#ifdef _WIN32
+        SYSTEM_INFO si;
+        GetSystemInfo(&si);
+        threads = si.dwNumberOfProcessors;
+#else
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    }
+    if (threads>HASH_MAX_THREADS)
+        threads = HASH_MAX_THREADS;
+    if (threads>count/min_share)
+        threads = count/min_share;
+    if (threads<1)
+        threads = 1;
+#ifdef _WIN32
+    threads = 1; // FIXME: no worker threads on win32 yet
+#else
+    pthread_t tids[HASH_MAX_THREADS];
+#endif
+    for(int t=0; t<threads; t++) {
+        jobs[t] = proto;
+        jobs[t].from = count*t/threads;
+        jobs[t].till = count*(t+1)/threads;
+#ifndef _WIN32
+        if (t && pthread_create(tids+t,NULL,work,jobs+t)) {
+            print_error("cannot start a hashing thread");
+            work(jobs+t);
+            tids[t] = 0;
+        }
+#endif
+    }
+    work(jobs);
+    bool ok = jobs[0].ok;
+    for(int t=1; t<threads; t++) {
+#ifndef _WIN32
+        if (tids[t])
+            pthread_join(tids[t],NULL);
+#endif
+        ok = ok && jobs[t].ok;
+    }
+    return ok;
+}
+
+
 /**     H a s h   t r e e       */
 
+bool HashTree::MAP_DATA = false;
+int HashTree::THREADS = 0;
+bool HashTree::LAZY_RECHECK = false;
+
 
-HashTree::HashTree (const char* filename, const Sha1Hash& root_hash, const char* hash_filename) :
+HashTree::HashTree (const char* filename, const Sha1Hash& root_hash,
+                    const char* hash_filename, size_t chunk_size) :
 root_hash_(root_hash), fd_(0), hash_fd_(0), data_recheck_(true),
 peak_count_(0), hashes_(NULL), size_(0), sizek_(0),
-complete_(0), completek_(0)
+chunk_size_(chunk_size), complete_(0), completek_(0), data_map_(NULL),
+checkpoint_dirty_(false), recheck_offset_(-1), live_(false), window_(0),
+window_layer_(0), kept_from_(0)
 {
+    if (!chunk_size_ || chunk_size_>SWIFT_MAX_CHUNK_SIZE ||
+            (chunk_size_&(chunk_size_-1))) {
+        print_error("chunk size must be a power of 2, 8192 at most");
+        return;
+    }
     fd_ = open(filename,OPENFLAGS,S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
     if (fd_<0) {
         fd_ = 0;
@@ -104,6 +264,7 @@ complete_(0), completek_(0)
         print_error("cannot open hash file");
         return;
     }
+    checkpoint_filename_ = std::string(hfn) + ".ack";
     if (root_hash_==Sha1Hash::ZERO) { // fresh submit, hash it
         assert(file_size(fd_));
         Submit();
@@ -113,38 +274,85 @@ complete_(0), completek_(0)
 }
 
 
+HashTree::HashTree (const Sha1Hash& key, const char* filename,
+                    size_t chunk_size, uint64_t window) :
+root_hash_(key.bits,Sha1Hash::SIZE), fd_(0), hash_fd_(0), data_recheck_(false),
+peak_count_(0), hashes_(NULL), size_(0), sizek_(0),
+chunk_size_(chunk_size), complete_(0), completek_(0), data_map_(NULL),
+checkpoint_dirty_(false), recheck_offset_(-1), live_(true), live_key_(key),
+window_(window), window_layer_(0), kept_from_(0)
+{
+    if (!chunk_size_ || chunk_size_>SWIFT_MAX_CHUNK_SIZE ||
+            (chunk_size_&(chunk_size_-1))) {
+        print_error("chunk size must be a power of 2, 8192 at most");
+        return;
+    }
+    if (window_<64 || (window_&(window_-1)) || window_>(1ULL<<40)) {
+        print_error("live window must be a power of 2, 64 at least");
+        return;
+    }
+    while ((1ULL<<window_layer_)<window_)
+        window_layer_++;
+    hashes_ = (Sha1Hash*) calloc(window_*4,sizeof(Sha1Hash));
+    if (!hashes_) {
+        print_error("cannot allocate the hash ring");
+        return;
+    }
+    ring_block_[0] = 0;
+    ring_block_[1] = 1;
+    tophash_t none = {bin64_t::NONE, Sha1Hash::ZERO};
+    top_.assign(64*4,none);
+    fd_ = open(filename,OPENFLAGS|O_TRUNC,S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+    if (fd_<0) {
+        fd_ = 0;
+        print_error("cannot open the file");
+    }
+}
+
+
 void            HashTree::Submit () {
     size_ = file_size(fd_);
-    sizek_ = (size_ + 1023) >> 10;
+    sizek_ = (size_ + chunk_size_-1) / chunk_size_;
     peak_count_ = bin64_t::peaks(sizek_,peaks_);
     int hashes_size = Sha1Hash::SIZE*sizek_*2;
-    file_resize(hash_fd_,hashes_size);
+    file_resize(hash_fd_,hashes_size+TRAILERSZ);
     hashes_ = (Sha1Hash*) memory_map(hash_fd_,hashes_size);
     if (!hashes_) {
         size_ = sizek_ = complete_ = completek_ = 0;
         print_error("mmap failed");
         return;
     }
-    for (size_t i=0; i<sizek_; i++) {
-        char kilo[1<<10];
-        size_t rd = read(fd_,kilo,1<<10);
-        if (rd<(1<<10) && i!=sizek_-1) {
-            free(hashes_);
-            hashes_=NULL;
-            return;
-        }
-        bin64_t pos(0,i);
-        hashes_[pos] = Sha1Hash(kilo,rd);
-        ack_out_.set(pos);
-        complete_+=rd;
-        completek_++;
+    WriteTrailer();
+    hash_job_t job;
+    job.hashes = hashes_;
+    job.fd = fd_;
+    job.chunk_size = chunk_size_;
+    job.layer = 0;
+    job.leaves = sizek_;
+    if (!RunHashJobs(HashLeaves,job,sizek_,HASH_READ_SIZE/chunk_size_)) {
+        memory_unmap(hash_fd_,hashes_,hashes_size); // closes hash_fd_
+        hashes_ = NULL;
+        hash_fd_ = 0;
+        size_ = sizek_ = 0;
+        print_error("cannot read the file");
+        return;
+    }
+    // peaks go left to right, largest first; so, on every layer, the
+    // bins to derive are the leftmost ones
+    uint64_t width = sizek_;
+    for (int layer=1, p=peak_count_-1; p>=0 && layer<=peaks_[0].layer(); layer++) {
+        while (p>=0 && peaks_[p].layer()<layer)
+            width -= peaks_[p--].width();
+        job.layer = layer;
+        RunHashJobs(HashLayer,job,width>>layer,1024);
     }
     for (int p=0; p<peak_count_; p++) {
-        if (!peaks_[p].is_base())
-            for(bin64_t b=peaks_[p].left_foot().parent(); b.within(peaks_[p]); b=b.next_dfsio(1))
-                hashes_[b] = Sha1Hash(hashes_[b.left()],hashes_[b.right()]);
+        ack_out_.set(peaks_[p]);
         peak_hashes_[p] = hashes_[peaks_[p]];
     }
+    complete_ = size_;
+    completek_ = sizek_;
+    checkpoint_dirty_ = true;
 
     root_hash_ = DeriveRoot();
 
@@ -152,10 +360,14 @@ void            HashTree::Submit () {
 
 
 /** Basically, simulated receiving every single packet, except
- for some optimizations. */
+ for some optimizations. Unless there is a checkpoint to start from. */
 void            HashTree::RecoverProgress () {
+    bool fresh = !file_size(hash_fd_);
+    size_t recorded = ReadTrailer();
+    if (recorded)
+        chunk_size_ = recorded;
     size_t size = file_size(fd_);
-    size_t sizek = (size + 1023) >> 10;
+    size_t sizek = (size + chunk_size_-1) / chunk_size_;
     bin64_t peaks[64];
     int peak_count = bin64_t::peaks(sizek,peaks);
     for(int i=0; i<peak_count; i++) {
@@ -167,30 +379,207 @@ void            HashTree::RecoverProgress () {
     }
     if (!this->size())
         return; // if no valid peak hashes found
+    if (!fresh && RestoreCheckpoint(size))
+        return;
+    checkpoint_dirty_ = true;
     // at this point, we may use mmapd hashes already
-    // so, lets verify hashes and the data we've got
-    char zeros[1<<10];
-    memset(zeros, 0, 1<<10);
-    Sha1Hash kilo_zero(zeros,1<<10);
-    for(int p=0; p<packet_size(); p++) {
-        char buf[1<<10];
-        bin64_t pos(0,p);
-        if (hashes_[pos]==Sha1Hash::ZERO)
-            continue;
-        size_t rd = read(fd_,buf,1<<10);
-        if (rd!=(1<<10) && p!=packet_size()-1)
-            break;
-        if (rd==(1<<10) && !memcmp(buf, zeros, rd) &&
-                hashes_[pos]!=kilo_zero) // FIXME
-            continue;
-        if ( data_recheck_ && !OfferHash(pos, Sha1Hash(buf,rd)) )
-            continue;
-        ack_out_.set(pos);
-        completek_++;
-        complete_+=rd;
-        if (rd!=(1<<10) && p==packet_size()-1)
-            size_ = ((sizek_-1)<<10) + rd;
+    // so, lets verify hashes and the data we've got, many chunks at once
+    char zeros[SWIFT_MAX_CHUNK_SIZE];
+    memset(zeros, 0, chunk_size_);
+    Sha1Hash chunk_zero(zeros,chunk_size_);
+    char* buf = (char*) malloc(HASH_MANY_MAX*chunk_size_);
+    const uint8_t* data[HASH_MANY_MAX];
+    size_t lengths[HASH_MANY_MAX];
+    bin64_t pos[HASH_MANY_MAX];
+    Sha1Hash hashes[HASH_MANY_MAX];
+    Sha1Hash* hash_ptrs[HASH_MANY_MAX];
+    for(int i=0; i<HASH_MANY_MAX; i++) {
+        data[i] = (uint8_t*) buf + i*chunk_size_;
+        hash_ptrs[i] = hashes + i;
+    }
+    bool eof = !buf;
+    for(uint64_t p=0; !eof && p<packet_size(); ) {
+        int n = 0;
+        for(; n<HASH_MANY_MAX && p<packet_size(); p++) {
+            bin64_t b(0,p);
+            if (hashes_[b]==Sha1Hash::ZERO)
+                continue;
+            int rd = pread(fd_,(char*)data[n],chunk_size_,p*chunk_size_);
+            if (rd!=chunk_size_ && p!=packet_size()-1) {
+                eof = true;
+                break;
+            }
+            if (rd==chunk_size_ && !memcmp(data[n], zeros, rd) &&
+                    hashes_[b]!=chunk_zero) // FIXME
+                continue;
+            pos[n] = b;
+            lengths[n++] = rd;
+        }
+        if (data_recheck_)
+            Sha1Hash::HashMany(n,data,lengths,hash_ptrs);
+        for(int i=0; i<n; i++) {
+            if ( data_recheck_ && !OfferHash(pos[i], hashes[i]) )
+                continue;
+            ack_out_.set(pos[i]);
+            completek_++;
+            complete_+=lengths[i];
+            if (lengths[i]!=chunk_size_ && pos[i].base_offset()==packet_size()-1)
+                size_ = (sizek_-1)*chunk_size_ + lengths[i];
+        }
     }
+    free(buf);
+}
+
+
+static void put_uint (uint8_t* to, uint64_t val, int bytes) {
+    for(int i=bytes-1; i>=0; i--, val>>=8)
+        to[i] = val & 0xff;
+}
+
+static uint64_t get_uint (const uint8_t* from, int bytes) {
+    uint64_t val = 0;
+    for(int i=0; i<bytes; i++)
+        val = (val<<8) | from[i];
+    return val;
+}
+
+/** The largest aligned bin starting at from, ending before till. */
+static bin64_t aligned_bin (uint64_t from, uint64_t till) {
+    int layer = 0;
+    while (layer<62 && !(from&(1ULL<<layer)) && from+(2ULL<<layer)<=till)
+        layer++;
+    return bin64_t(layer,from>>layer);
+}
+
+
+bool            HashTree::Checkpoint () {
+    if (!checkpoint_dirty_ || !size_ || live_)
+        return true;
+    size_t map_length = ack_out_.serialize(NULL,0);
+    size_t length = CHECKPOINT_HEADERSZ + map_length + HASHSZ;
+    uint8_t* buf = (uint8_t*) malloc(length);
+    if (!buf)
+        return false;
+    memcpy(buf,CHECKPOINT_MAGIC,4);
+    put_uint(buf+4,CHECKPOINT_VERSION,4);
+    put_uint(buf+8,chunk_size_,4);
+    memcpy(buf+12,root_hash_.bits,HASHSZ);
+    put_uint(buf+32,sizek_,8);
+    put_uint(buf+40,map_length,8);
+    ack_out_.serialize(buf+CHECKPOINT_HEADERSZ,map_length);
+    Sha1Hash check(buf,length-HASHSZ);
+    memcpy(buf+length-HASHSZ,check.bits,HASHSZ);
+#ifndef _WIN32
+    // the data must be on disk before the claim that it is
+    fsync(fd_);
+    fsync(hash_fd_);
+#endif
+    std::string tmp = checkpoint_filename_ + ".tmp";
+    int fd = open(tmp.c_str(),OPENFLAGS|O_TRUNC,S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+    bool ok = fd>=0 && write(fd,buf,length)==length;
+    if (fd>=0)
+        close(fd);
+    free(buf);
+#ifdef _WIN32
+    if (ok)
+        unlink(checkpoint_filename_.c_str()); // rename() does not replace
+#endif
+    if (!ok || rename(tmp.c_str(),checkpoint_filename_.c_str())) {
+        unlink(tmp.c_str());
+        print_error("cannot write the checkpoint");
+        return false;
+    }
+    checkpoint_dirty_ = false;
+    return true;
+}
+
+
+/** The checkpoint must be intact and for this very tree; every complete
+    bin must have its hash in place and the data file must be long enough.
+    Otherwise, the data gets rehashed. */
+bool            HashTree::RestoreCheckpoint (size_t data_size) {
+    int fd = open(checkpoint_filename_.c_str(),READFLAGS,0);
+    if (fd<0)
+        return false;
+    size_t length = file_size(fd);
+    uint8_t* buf = NULL;
+    if (length>=CHECKPOINT_HEADERSZ+HASHSZ)
+        buf = (uint8_t*) malloc(length);
+    bool ok = buf && read(fd,buf,length)==length;
+    close(fd);
+    uint64_t map_length = ok ? get_uint(buf+40,8) : 0;
+    binmap_t map;
+    ok = ok && !memcmp(buf,CHECKPOINT_MAGIC,4) &&
+        get_uint(buf+4,4)==CHECKPOINT_VERSION &&
+        get_uint(buf+8,4)==chunk_size_ &&
+        !memcmp(buf+12,root_hash_.bits,HASHSZ) &&
+        get_uint(buf+32,8)==sizek_ &&
+        length==CHECKPOINT_HEADERSZ+map_length+HASHSZ &&
+        Sha1Hash(buf,length-HASHSZ)==Sha1Hash(false,(char*)buf+length-HASHSZ) &&
+        map.deserialize(buf+CHECKPOINT_HEADERSZ,map_length);
+    int count = 0;
+    uint64_t* stripes = ok ? map.get_stripes(count) : NULL;
+    uint64_t done = 0;
+    for(int r=1; ok && r+1<count; r+=2) {
+        uint64_t from = stripes[r], till = stripes[r+1];
+        ok = till<=sizek_ && data_size>(till-1)*chunk_size_ &&
+             (till<sizek_ || data_size<=till*chunk_size_);
+        for(uint64_t o=from; ok && o<till; o+=aligned_bin(o,till).width())
+            ok = hashes_[aligned_bin(o,till)]!=Sha1Hash::ZERO;
+        done += till-from;
+    }
+    free(stripes);
+    if (ok) {
+        ack_out_.deserialize(buf+CHECKPOINT_HEADERSZ,map_length);
+        completek_ = done;
+        complete_ = done*chunk_size_;
+        if (ack_out_.get(bin64_t(0,sizek_-1))==binmap_t::FILLED) {
+            complete_ -= size_-data_size;
+            size_ = data_size;
+        }
+    }
+    free(buf);
+    if (ok && LAZY_RECHECK)
+        recheck_offset_ = 0;
+    return ok;
+}
+
+
+bool            HashTree::Recheck (int chunks) {
+    char* buf = (char*) malloc(HASH_MANY_MAX*chunk_size_);
+    const uint8_t* data[HASH_MANY_MAX];
+    size_t lengths[HASH_MANY_MAX];
+    bin64_t pos[HASH_MANY_MAX];
+    Sha1Hash hashes[HASH_MANY_MAX];
+    Sha1Hash* hash_ptrs[HASH_MANY_MAX];
+    for(int i=0; i<HASH_MANY_MAX; i++) {
+        data[i] = (uint8_t*) buf + i*chunk_size_;
+        hash_ptrs[i] = hashes + i;
+    }
+    while (buf && chunks>0 && recheck_pending()) {
+        int n = 0;
+        for(; n<HASH_MANY_MAX && chunks>0 && recheck_pending(); chunks--) {
+            bin64_t b(0,recheck_offset_++);
+            if (ack_out_.get(b)!=binmap_t::FILLED)
+                continue;
+            int rd = pread(fd_,(char*)data[n],chunk_size_,b.base_offset()*chunk_size_);
+            pos[n] = b;
+            lengths[n++] = rd>0 ? rd : 0;
+        }
+        Sha1Hash::HashMany(n,data,lengths,hash_ptrs);
+        for(int i=0; i<n; i++) {
+            size_t expected = pos[i].base_offset()==sizek_-1 ?
+                              size_-(sizek_-1)*chunk_size_ : chunk_size_;
+            if (lengths[i]==expected && hashes[i]==hashes_[pos[i]])
+                continue;
+            ack_out_.set(pos[i],binmap_t::EMPTY);
+            completek_--;
+            complete_ -= expected;
+            checkpoint_dirty_ = true;
+        }
+    }
+    free(buf);
+    return recheck_pending();
 }
 
 
@@ -212,14 +601,13 @@ bool            HashTree::OfferPeakHash (bin64_t pos, const Sha1Hash& hash) {
     for(int i=0; i<peak_count_; i++)
         sizek_ += peaks_[i].width();
 
-    // bingo, we now know the file size (rounded up to a KByte)
+    // bingo, we now know the file size (rounded up to a chunk)
 
-    size_ = sizek_<<10;
+    size_ = sizek_*chunk_size_;
     completek_ = complete_ = 0;
-    sizek_ = (size_ + 1023) >> 10;
 
     size_t cur_size = file_size(fd_);
-    if ( cur_size<=(sizek_-1)<<10  || cur_size>sizek_<<10 )
+    if ( cur_size<=(sizek_-1)*chunk_size_  || cur_size>size_ )
         if (file_resize(fd_, size_)) {
             print_error("cannot set file size\n");
             size_=0; // remain in the 0-state
@@ -228,8 +616,8 @@ bool            HashTree::OfferPeakHash (bin64_t pos, const Sha1Hash& hash) {
 
     // mmap the hash file into memory
     size_t expected_size = sizeof(Sha1Hash)*sizek_*2;
-    if ( file_size(hash_fd_) != expected_size )
-        file_resize (hash_fd_, expected_size);
+    if ( file_size(hash_fd_) != expected_size+TRAILERSZ )
+        file_resize (hash_fd_, expected_size+TRAILERSZ);
 
     hashes_ = (Sha1Hash*) memory_map(hash_fd_,expected_size);
     if (!hashes_) {
@@ -237,6 +625,7 @@ bool            HashTree::OfferPeakHash (bin64_t pos, const Sha1Hash& hash) {
         print_error("mmap failed");
         return false;
     }
+    WriteTrailer();
 
     for(int i=0; i<peak_count_; i++)
         hashes_[peaks_[i]] = peak_hashes_[i];
@@ -265,10 +654,220 @@ Sha1Hash        HashTree::DeriveRoot () {
 }
 
 
-/** For live streaming: appends the data, adjusts the tree.
-    @ return the number of fresh (tail) peak hashes */
-int         HashTree::AppendData (char* data, int length) {
-    return 0;
+/** HMAC-SHA1 of the peaks, as (bin, hash) pairs. There is no public key
+    crypto here, so peers share the key with the source: whoever has it
+    can forge peaks too, see OpenLive. */
+static Sha1Hash MacPeaks (const Sha1Hash& key, int count,
+                           const bin64_t* peaks, const Sha1Hash* hashes) {
+    uint8_t pad[64];
+    blk_SHA_CTX ctx;
+    Sha1Hash inner, mac;
+    memset(pad,0x36,sizeof(pad));
+    for(int i=0; i<HASHSZ; i++)
+        pad[i] ^= key.bits[i];
+    blk_SHA1_Init(&ctx);
+    blk_SHA1_Update(&ctx,pad,sizeof(pad));
+    for(int i=0; i<count; i++) {
+        uint8_t bin[4];
+        put_uint(bin,peaks[i].to32(),4);
+        blk_SHA1_Update(&ctx,bin,4);
+        blk_SHA1_Update(&ctx,hashes[i].bits,HASHSZ);
+    }
+    blk_SHA1_Final(inner.bits,&ctx);
+    memset(pad,0x5c,sizeof(pad));
+    for(int i=0; i<HASHSZ; i++)
+        pad[i] ^= key.bits[i];
+    blk_SHA1_Init(&ctx);
+    blk_SHA1_Update(&ctx,pad,sizeof(pad));
+    blk_SHA1_Update(&ctx,inner.bits,HASHSZ);
+    blk_SHA1_Final(mac.bits,&ctx);
+    return mac;
+}
+
+
+/** Below the window layer, a bin is kept in the half of the ring of its
+    aligned window; the bins above are told apart by the last two bits
+    of the offset, as the window takes two pairs of them at most. */
+const Sha1Hash* HashTree::live_hash (bin64_t pos) const {
+    int layer = pos.layer();
+    if (layer<window_layer_) {
+        uint64_t block = pos.base_offset() >> window_layer_;
+        if (ring_block_[block&1]!=block)
+            return NULL;
+        return hashes_ + (pos & (window_*4-1));
+    }
+    const tophash_t& top = top_[(layer-window_layer_)*4 + (pos.offset()&3)];
+    return top.bin==pos ? &top.hash : NULL;
+}
+
+
+Sha1Hash&       HashTree::hash_slot (bin64_t pos) {
+    if (!live_)
+        return hashes_[pos];
+    int layer = pos.layer();
+    if (layer<window_layer_) {
+        uint64_t block = pos.base_offset() >> window_layer_;
+        if (ring_block_[block&1]!=block) {
+            memset(hashes_+(block&1)*window_*2,0,window_*2*sizeof(Sha1Hash));
+            ring_block_[block&1] = block;
+        }
+        return hashes_[pos & (window_*4-1)];
+    }
+    tophash_t& top = top_[(layer-window_layer_)*4 + (pos.offset()&3)];
+    if (top.bin!=pos) {
+        top.bin = pos;
+        top.hash = Sha1Hash::ZERO;
+    }
+    return top.hash;
+}
+
+
+bool            HashTree::in_window (bin64_t pos) const {
+    if (!sizek_)
+        return false;
+    uint64_t first = window_start(), last = sizek_-1;
+    int layer = pos.layer();
+    if (layer<window_layer_) {
+        uint64_t block = pos.base_offset() >> window_layer_;
+        return block==first>>window_layer_ || block==last>>window_layer_;
+    }
+    if (layer>=63)
+        return false;
+    uint64_t pair = pos.offset() >> 1;
+    return pair==(first>>layer)>>1 || pair==(last>>layer)>>1;
+}
+
+
+/** The chunks evicted are at most a window, as the ones before were
+    evicted already. */
+void            HashTree::Evict () {
+    uint64_t first = window_start();
+    if (first<=kept_from_)
+        return;
+    for(uint64_t c=kept_from_; c<first && c<kept_from_+window_; c++)
+        if (ack_out_.get(bin64_t(0,c))==binmap_t::FILLED)
+            completek_--;
+    ack_out_.clear_before(first);
+    complete_ = completek_*chunk_size_;
+    kept_from_ = first;
+}
+
+
+/** Chunks are appended left to right, so a right child completes its
+    parent; only the new bins get hashed, then the peaks are re-keyed.
+    The data goes to the ring, over the chunks that leave the window. */
+int         HashTree::AppendData (const char* data, size_t length) {
+    if (!live_ || !fd_ || !hashes_)
+        return 0;
+    tail_.append(data,length);
+    uint64_t fresh = tail_.size() / chunk_size_;
+    if (!fresh)
+        return 0;
+    const uint8_t* chunks[HASH_MANY_MAX];
+    size_t lengths[HASH_MANY_MAX];
+    Sha1Hash* hashes[HASH_MANY_MAX];
+    for(uint64_t i=0; i<fresh; i+=HASH_MANY_MAX) {
+        int n = 0;
+        for(; n<HASH_MANY_MAX && i+n<fresh; n++) {
+            bin64_t pos(0,sizek_+i+n);
+            chunks[n] = (uint8_t*) tail_.data() + (i+n)*chunk_size_;
+            lengths[n] = chunk_size_;
+            hashes[n] = &hash_slot(pos);
+            if (pwrite(fd_,chunks[n],chunk_size_,data_offset(pos))!=chunk_size_) {
+                print_error("cannot write the data");
+                return 0;
+            }
+        }
+        Sha1Hash::HashMany(n,chunks,lengths,hashes);
+        for(int j=0; j<n; j++) {
+            bin64_t pos(0,sizek_+i+j);
+            ack_out_.set(pos);
+            while (pos.is_right()) {
+                pos = pos.parent();
+                Sha1Hash up(hash(pos.left()),hash(pos.right()));
+                hash_slot(pos) = up;
+            }
+        }
+    }
+    tail_.erase(0,fresh*chunk_size_);
+    bin64_t old_peaks[64];
+    int old_count = peak_count_;
+    memcpy(old_peaks,peaks_,sizeof(bin64_t)*peak_count_);
+    sizek_ += fresh;
+    completek_ += fresh;
+    size_ = sizek_*chunk_size_;
+    complete_ = completek_*chunk_size_;
+    peak_count_ = bin64_t::peaks(sizek_,peaks_);
+    int kept = 0;
+    while (kept<old_count && kept<peak_count_ && old_peaks[kept]==peaks_[kept])
+        kept++;
+    for(int i=kept; i<peak_count_; i++)
+        peak_hashes_[i] = hash(peaks_[i]);
+    peaks_mac_ = MacPeaks(live_key_,peak_count_,peaks_,peak_hashes_);
+    Evict();
+    return peak_count_-kept;
+}
+
+
+/** The peaks must add up to the size; the peaks kept must keep their
+    hashes. Where peaks merged, the hashes above the former peaks are
+    not proven any more, till some data under them is checked. */
+bool            HashTree::OfferKeyedPeaks (int count, const bin64_t* peaks,
+                            const Sha1Hash* hashes, const Sha1Hash& mac) {
+    if (!live_ || count<1 || count>64)
+        return false;
+    uint64_t sizek = 0;
+    for(int i=0; i<count; i++) {
+        if (peaks[i]==bin64_t::NONE || peaks[i]==bin64_t::ALL)
+            return false;
+        sizek += peaks[i].width();
+    }
+    bin64_t must_be[64];
+    if (bin64_t::peaks(sizek,must_be)!=count)
+        return false;
+    for(int i=0; i<count; i++)
+        if (peaks[i]!=must_be[i])
+            return false;
+    if (sizek<sizek_)
+        return false;
+    if (MacPeaks(live_key_,count,peaks,hashes)!=mac)
+        return false;
+    if (sizek==sizek_)
+        return peaks_mac_==mac;
+    for(int i=0, j=0; i<count && j<peak_count_; )
+        if (peaks[i]==peaks_[j]) {
+            if (hashes[i]!=peak_hashes_[j])
+                return false;
+            i++, j++;
+        } else if (peaks[i].base_offset()<peaks_[j].base_offset())
+            i++;
+        else
+            j++;
+    if (!hashes_)
+        return false;
+    bin64_t old_peaks[64];
+    int old_count = peak_count_;
+    memcpy(old_peaks,peaks_,sizeof(bin64_t)*peak_count_);
+    sizek_ = sizek;
+    size_ = sizek_*chunk_size_;
+    peak_count_ = count;
+    for(int j=0; j<old_count; j++) {
+        int i = 0;
+        while (!old_peaks[j].within(peaks[i]))
+            i++;
+        for(bin64_t b=old_peaks[j].parent(); b.layer()<peaks[i].layer(); b=b.parent())
+            if (in_window(b))
+                hash_slot(b) = Sha1Hash::ZERO;
+    }
+    for(int i=0; i<count; i++) {
+        peaks_[i] = peaks[i];
+        peak_hashes_[i] = hashes[i];
+        if (in_window(peaks[i]))
+            hash_slot(peaks[i]) = hashes[i];
+    }
+    peaks_mac_ = mac;
+    Evict();
+    return true;
 }
 
 
@@ -282,34 +881,44 @@ bin64_t         HashTree::peak_for (bin64_t pos) const {
 
 bool            HashTree::OfferHash (bin64_t pos, const Sha1Hash& hash) {
     if (!size_)  // only peak hashes are accepted at this point
-        return OfferPeakHash(pos,hash);
+        return !live_ && OfferPeakHash(pos,hash);
     bin64_t peak = peak_for(pos);
     if (peak==bin64_t::NONE)
         return false;
+    if (live_ && !in_window(pos))
+        return false; // gone or not there yet
     if (peak==pos)
-        return hash == hashes_[pos];
-    if (ack_out_.get(pos.parent())!=binmap_t::EMPTY)
-        return hash==hashes_[pos]; // have this hash already, even accptd data
-    hashes_[pos] = hash;
+        return hash == this->hash(pos);
+    if (ack_out_.get(pos.parent())!=binmap_t::EMPTY &&
+            (!live_ || this->hash(pos)!=Sha1Hash::ZERO))
+        return hash==this->hash(pos); // have this hash already, even accptd data
+    hash_slot(pos) = hash;
     if (!pos.is_base())
         return false; // who cares?
     bin64_t p = pos;
     Sha1Hash uphash = hash;
-    while ( p!=peak && ack_out_.get(p)==binmap_t::EMPTY ) {
-        hashes_[p] = uphash;
+    while ( p!=peak && !is_proven(p) ) {
+        hash_slot(p) = uphash;
         p = p.parent();
-        uphash = Sha1Hash(hashes_[p.left()],hashes_[p.right()]) ;
+        uphash = Sha1Hash(this->hash(p.left()),this->hash(p.right())) ;
     }// walk to the nearest proven hash
-    return uphash==hashes_[p];
+    if (uphash==this->hash(p))
+        return true;
+    if (live_) // not proven after all
+        for(bin64_t q=pos.parent(); q.layer()<p.layer(); q=q.parent())
+            if (ack_out_.get(q)!=binmap_t::EMPTY)
+                hash_slot(q) = Sha1Hash::ZERO;
+    return false;
 }
 
 
-bool            HashTree::OfferData (bin64_t pos, const char* data, size_t length) {
+bool            HashTree::OfferData (bin64_t pos, const char* data, size_t length,
+                                     const Sha1Hash* data_hash) {
     if (!size())
         return false;
-    if (!pos.is_base())
+    if (!pos.is_base() || pos.base_offset()<window_start())
         return false;
-    if (length<1024 && pos!=bin64_t(0,sizek_-1))
+    if (length>chunk_size_ || (length<chunk_size_ && pos!=bin64_t(0,sizek_-1)))
         return false;
     if (ack_out_.get(pos)==binmap_t::FILLED)
         return true; // to set data_in_
@@ -317,19 +926,21 @@ bool            HashTree::OfferData (bin64_t pos, const char* data, size_t lengt
     if (peak==bin64_t::NONE)
         return false;
 
-    Sha1Hash data_hash(data,length);
-    if (!OfferHash(pos, data_hash)) {
+    if (!OfferHash(pos, data_hash ? *data_hash : Sha1Hash(data,length))) {
         //printf("invalid hash for %s: %s\n",pos.str(),data_hash.hex().c_str()); // paranoid
+        if (live_ && pos!=peak && in_window(pos)) // the sibling may be a
+            hash_slot(pos) = Sha1Hash::ZERO; // former peak, do not trust
         return false;
     }
 
     //printf("g %lli %s\n",(uint64_t)pos,hash.hex().c_str());
     ack_out_.set(pos,binmap_t::FILLED);
-    pwrite(fd_,data,length,pos.base_offset()<<10);
+    checkpoint_dirty_ = true;
+    pwrite(fd_,data,length,data_offset(pos));
     complete_ += length;
     completek_++;
-    if (pos.base_offset()==sizek_-1) {
-        size_ = ((sizek_-1)<<10) + length;
+    if (pos.base_offset()==sizek_-1 && !live_) {
+        size_ = (sizek_-1)*chunk_size_ + length;
         if (file_size(fd_)!=size_)
             file_resize(fd_,size_);
     }
@@ -342,11 +953,59 @@ uint64_t      HashTree::seq_complete () {
     if (seqk==sizek_)
         return size_;
     else
-        return seqk<<10;
+        return seqk*chunk_size_;
+}
+
+void            HashTree::WriteTrailer () {
+    uint8_t trailer[TRAILERSZ];
+    memcpy(trailer,TRAILER_MAGIC,4);
+    for(int i=0; i<4; i++)
+        trailer[4+i] = (chunk_size_>>(24-i*8)) & 0xff;
+    if (pwrite(hash_fd_,trailer,TRAILERSZ,sizek_*2*Sha1Hash::SIZE)!=TRAILERSZ)
+        print_error("cannot write the hash file trailer");
 }
 
+
+/** Returns the chunk size recorded in the hash file, 0 if none. Hash files
+    with no trailer are from before chunk sizes were configurable. */
+size_t          HashTree::ReadTrailer () {
+    size_t hsize = file_size(hash_fd_);
+    uint8_t trailer[TRAILERSZ];
+    if (hsize%(2*Sha1Hash::SIZE)!=TRAILERSZ ||
+            pread(hash_fd_,trailer,TRAILERSZ,hsize-TRAILERSZ)!=TRAILERSZ ||
+            memcmp(trailer,TRAILER_MAGIC,4))
+        return 0;
+    size_t chunk_size = 0;
+    for(int i=0; i<4; i++)
+        chunk_size = (chunk_size<<8) | trailer[4+i];
+    if (!chunk_size || chunk_size>SWIFT_MAX_CHUNK_SIZE ||
+            (chunk_size&(chunk_size-1)))
+        return 0;
+    return chunk_size;
+}
+
+
+const uint8_t*  HashTree::map_data () {
+    if (data_map_ || !MAP_DATA || !is_complete() || live_)
+        return data_map_;
+    if (sizeof(void*)<8 && size_>(1<<30))
+        return NULL; // do not exhaust a 32-bit address space
+    data_map_ = (uint8_t*) memory_map(fd_,size_,false);
+    if (!data_map_)
+        print_error("data mmap failed");
+    return data_map_;
+}
+
+
 HashTree::~HashTree () {
-    if (hashes_)
+    Checkpoint();
+    if (data_map_) {
+        memory_unmap(fd_, data_map_, size_); // closes fd_
+        fd_ = 0;
+    }
+    if (live_)
+        free(hashes_);
+    else if (hashes_)
         memory_unmap(hash_fd_, hashes_, sizek_*2*sizeof(Sha1Hash));
     if (fd_)
         close(fd_);
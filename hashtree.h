@@ -12,9 +12,18 @@
 #include "bins.h"
 #include <string.h>
 #include <string>
+#include <vector>
 
 namespace swift {
 
+/** A chunk is the unit of hashing and sending; its size is a power of two,
+    chosen per transfer and kept in the .mhash file. */
+#define SWIFT_DEFAULT_CHUNK_SIZE 1024
+#define SWIFT_MAX_CHUNK_SIZE 8192
+/** Live streams keep that many recent chunks (a power of 2, 64 at least);
+    all peers of a stream use the same window. */
+#define SWIFT_DEFAULT_LIVE_WINDOW 4096
+
 
 /** SHA-1 hash, 20 bytes of data */
 struct Sha1Hash {
@@ -28,6 +37,10 @@ struct Sha1Hash {
     Sha1Hash(const uint8_t* data, size_t length);
     /** Either parse hash from hex representation of read in raw format. */
     Sha1Hash(bool hex, const char* hash);
+    /** Hash many messages at once (multi-buffer SHA1); the results may
+        go anywhere, e.g. right into a hash tree. */
+    static void HashMany (int count, const uint8_t* const* data,
+                          const size_t* lengths, Sha1Hash* const* hashes);
     
     std::string    hex() const;
     bool    operator == (const Sha1Hash& b) const
@@ -67,10 +80,44 @@ class HashTree {
     /** Base size, as derived from the hashes. */
     size_t          size_;
     size_t          sizek_;
+    /** Size of a chunk (a base bin), in bytes. */
+    size_t          chunk_size_;
     /**    Part of the tree currently checked. */
     size_t          complete_;
     size_t          completek_;
     binmap_t            ack_out_;
+    /** Read-only view of the complete data file, see map_data() */
+    uint8_t         *data_map_;
+    /** ack_out_ is checkpointed to this file, next to the hash file. */
+    std::string     checkpoint_filename_;
+    bool            checkpoint_dirty_;
+    /** Next restored chunk to verify, see Recheck(). */
+    uint64_t        recheck_offset_;
+    /** A live stream grows as its source appends data; the peaks are
+        keyed (see OfferKeyedPeaks) and the hashes are kept in memory. */
+    bool            live_;
+    /** The key live peaks are keyed with; the HMAC of the current
+        peaks. */
+    Sha1Hash        live_key_;
+    Sha1Hash        peaks_mac_;
+    /** Live streams keep the last window_ chunks only, so memory and disk
+        use stay flat: the data file is a ring of window_ chunks. Hashes
+        of the bins below window_layer_ are kept for two aligned windows
+        (the ring halves of hashes_, see ring_block_); the bigger ones on
+        the way to the peaks, four per layer (top_). */
+    uint64_t        window_;
+    int             window_layer_;
+    /** The aligned window either half of hashes_ is holding. */
+    uint64_t        ring_block_[2];
+    struct tophash_t {
+        bin64_t     bin;
+        Sha1Hash    hash;
+    };
+    std::vector<tophash_t> top_;
+    /** Live streams: the chunks before this one are evicted. */
+    uint64_t        kept_from_;
+    /** Live streams: the data appended, short of a full chunk. */
+    std::string     tail_;
     
 protected:
     
@@ -78,11 +125,42 @@ protected:
     void            RecoverProgress();
     Sha1Hash        DeriveRoot();
     bool            OfferPeakHash (bin64_t pos, const Sha1Hash& hash);
+    /** The chunk size is kept in a trailer after the hashes. */
+    void            WriteTrailer ();
+    size_t          ReadTrailer ();
+    /** Load ack_out_ from a checkpoint instead of rehashing the data. */
+    bool            RestoreCheckpoint (size_t data_size);
+    /** Where the hash of a bin goes; in a live stream, the place is
+        taken over from the bin that was there (zeroed). */
+    Sha1Hash&       hash_slot (bin64_t pos);
+    /** Live streams: the hash kept for the bin, NULL if none. */
+    const Sha1Hash* live_hash (bin64_t pos) const;
+    /** Live streams: whether the bin is in the window, or a sibling of a
+        bin on the way from the window up; others are not kept. */
+    bool            in_window (bin64_t pos) const;
+    /** Live streams: drop the chunks that left the window. */
+    void            Evict ();
+    /** A hash is proven if it is on the way from some checked data to a
+        peak; live streams forget the ways above the peaks that merged. */
+    bool            is_proven (bin64_t pos) {
+        return ack_out_.get(pos)!=binmap_t::EMPTY &&
+               (!live_ || hash(pos)!=Sha1Hash::ZERO);
+    }
     
 public:
     
+    /** The chunk size applies to fresh submits and retrievals; the one
+        recorded in an existing hash file takes precedence. */
     HashTree (const char* file_name, const Sha1Hash& root=Sha1Hash::ZERO, 
-              const char* hash_filename=NULL);
+              const char* hash_filename=NULL,
+              size_t chunk_size=SWIFT_DEFAULT_CHUNK_SIZE);
+    /** A live stream, appended to by its source or retrieved from it;
+        the peaks carry an HMAC under the key and the root hash (the id of
+        the stream) is the hash of the key. The data file starts empty;
+        only the last window chunks are kept. */
+    HashTree (const Sha1Hash& key, const char* file_name,
+              size_t chunk_size=SWIFT_DEFAULT_CHUNK_SIZE,
+              uint64_t window=SWIFT_DEFAULT_LIVE_WINDOW);
     
     /** Offer a hash; returns true if it verified; false otherwise.
      Once it cannot be verified (no sibling or parent), the hash
@@ -90,11 +168,46 @@ public:
     bool            OfferHash (bin64_t pos, const Sha1Hash& hash);
     /** Offer data; the behavior is the same as with a hash:
      accept or remember or drop. Returns true => ACK is sent. */
-    bool            OfferData (bin64_t bin, const char* data, size_t length);
-    /** For live streaming. Not implemented yet. */
-    int             AppendData (char* data, int length) ;
+    bool            OfferData (bin64_t bin, const char* data, size_t length,
+                               const Sha1Hash* data_hash=NULL);
+    /** Save ack_out_ next to the hash file, so a restart needs no
+        rehashing; done on destruction too. Does nothing if no chunks
+        were added or dropped since the last checkpoint. */
+    bool            Checkpoint ();
+    /** Verify (up to) that many chunks restored from a checkpoint, drop
+        the ones not matching their hashes. Returns false once all restored
+        chunks are verified. See LAZY_RECHECK. */
+    bool            Recheck (int chunks);
+    /** Whether some restored chunks are not verified yet. */
+    bool            recheck_pending () const { return recheck_offset_<sizek_; }
+    /** For live streaming: full chunks of the data go to the tree, the
+        rest waits for more. Returns the number of fresh (tail) peaks. */
+    int             AppendData (const char* data, size_t length) ;
+    /** Take the keyed peaks of a live stream, unless the HMAC does
+        not match or the stream got shorter. Returns true if the peaks
+        are the current ones. */
+    bool            OfferKeyedPeaks (int count, const bin64_t* peaks,
+                                      const Sha1Hash* hashes,
+                                      const Sha1Hash& mac);
+    /** Whether this is a live stream. */
+    bool            is_live () const { return live_; }
+    /** The HMAC of the peaks of a live stream. */
+    const Sha1Hash& peaks_mac () const { return peaks_mac_; }
+    /** The first chunk a live stream keeps; the ones before it are
+        gone from ack_out. */
+    uint64_t        window_start () const
+        { return live_ && sizek_>window_ ? sizek_-window_ : 0; }
+    /** Where the chunk is in the data file. */
+    uint64_t        data_offset (bin64_t pos) const {
+        uint64_t chunk = pos.base_offset();
+        return (live_ ? chunk&(window_-1) : chunk) * chunk_size_;
+    }
     
     int             file_descriptor () const { return fd_; }
+    /** The data file mapped into memory, so that the data may be sent
+        right from the page cache; only done for complete files if MAP_DATA
+        is set and the address space allows. Returns NULL otherwise. */
+    const uint8_t*  map_data ();
     /** Returns the number of peaks (read on peak hashes). */
     int             peak_count () const { return peak_count_; }
     /** Returns the i-th peak's bin number. */
@@ -104,14 +217,21 @@ public:
     /** Return the peak bin the given bin belongs to. */
     bin64_t         peak_for (bin64_t pos) const;
     /** Return a (Merkle) hash for the given bin. */
-    const Sha1Hash& hash (bin64_t pos) const {return hashes_[pos];}
+    const Sha1Hash& hash (bin64_t pos) const {
+        if (!live_)
+            return hashes_[pos];
+        const Sha1Hash* hash = live_hash(pos);
+        return hash ? *hash : Sha1Hash::ZERO;
+    }
     /** Give the root hash, which is effectively an identifier of this file. */
     const Sha1Hash& root_hash () const { return root_hash_; }
     /** Get file size, in bytes. */
     uint64_t        size () const { return size_; }
-    /** Get file size in packets (in kilobytes, rounded up). */
+    /** Get file size in packets (in chunks, rounded up). */
     uint64_t        packet_size () const { return sizek_; }
-    /** Number of bytes retrieved and checked. */
+    /** Get the size of a packet (chunk) in bytes. */
+    size_t          chunk_size () const { return chunk_size_; }
+    /** Number of bytes retrieved and checked (live: in the window). */
     uint64_t        complete () const { return complete_; }
     /** Number of packets retrieved and checked. */
     uint64_t        packets_complete () const { return completek_; }
@@ -119,13 +239,22 @@ public:
         the file, uninterrupted. */
     uint64_t        seq_complete () ;
     /** Whether the file is complete. */
-    bool            is_complete () 
-        { return size_ && complete_==size_; }
+    bool            is_complete () {
+        return size_ && (live_ ? completek_==sizek_-window_start() :
+                                 complete_==size_);
+    }
     /** The binmap of complete packets. */
     binmap_t&           ack_out () { return ack_out_; }
     
     ~HashTree ();
 
+    /** Serve complete files from a memory mapping (see map_data). */
+    static bool     MAP_DATA;
+    /** Number of threads hashing a fresh submit; 0 means one per CPU. */
+    static int      THREADS;
+    /** Whether to verify the data restored from a checkpoint afterwards,
+        bit by bit (see Recheck); otherwise the checkpoint is trusted. */
+    static bool     LAZY_RECHECK;
     
 };
 
@@ -3,6 +3,9 @@
 using namespace swift;
 
 #define HTTPGW_MAX_CLIENT 128
+/** The least bitrate assumed for the picker, bytes per second; the
+    player reads faster while it fills its buffer. */
+#define HTTPGW_MIN_RATE (64<<10)
 
 enum {
     HTTPGW_RANGE=0,
@@ -19,6 +22,7 @@ struct http_gw_t {
     uint64_t tosend;
     int      transfer;
     SOCKET   sink;
+    tint     started; // sending data
     char*    headers[HTTPGW_MAX_HEADER];
 } http_requests[HTTPGW_MAX_CLIENT];
 
@@ -73,6 +77,10 @@ void HttpGwMayWriteCallback (SOCKET sink) {
         dprintf("%s @%i sent %ib\n",tintstr(),req->id,(int)wn);
         req->offset += wn;
         req->tosend -= wn;
+        uint64_t rate = HTTPGW_MIN_RATE;
+        if (NOW>req->started+TINT_SEC)
+            rate = std::max(rate,req->offset*TINT_SEC/(NOW-req->started));
+        swift::Playback(req->transfer,req->offset,rate);
     } else {
         if (req->tosend==0) { // done; wait for new request
             dprintf("%s @%i done\n",tintstr(),req->id);
@@ -91,7 +99,7 @@ void HttpGwMayWriteCallback (SOCKET sink) {
 void HttpGwSwiftProgressCallback (int transfer, bin64_t bin) {
     for (int httpc=0; httpc<http_gw_reqs_open; httpc++)
         if (http_requests[httpc].transfer==transfer)
-            if ( (bin.base_offset()<<10) == http_requests[httpc].offset ) {
+            if ( swift::SeqComplete(transfer) > http_requests[httpc].offset ) {
                 dprintf("%s @%i progress: %s\n",tintstr(),http_requests[httpc].id,bin.str());
                 sckrwecb_t maywrite_callbacks
                         (http_requests[httpc].sink,NULL,
@@ -122,6 +130,8 @@ void HttpGwFirstProgressCallback (int transfer, bin64_t bin) {
                 file_size);
             send(req->sink,response,strlen(response),0);
             req->tosend = file_size;
+            req->started = NOW;
+            swift::Playback(transfer,0,HTTPGW_MIN_RATE);
             dprintf("%s @%i headers_sent size %lli\n",tintstr(),req->id,file_size);
         }
     }
@@ -135,6 +145,7 @@ void HttpGwNewRequestCallback (SOCKET http_conn){
     req->sink = http_conn;
     req->offset = 0;
     req->tosend = 0;
+    req->started = NOW;
     dprintf("%s @%i new http request\n",tintstr(),req->id);
     // read headers - the thrilling part
     // we surely do not support pipelining => one request at a time
@@ -177,8 +188,10 @@ void HttpGwNewRequestCallback (SOCKET http_conn){
     // initiate transmission
     Sha1Hash root_hash = Sha1Hash(true,hash);
     int file = swift::Find(root_hash);
-    if (file==-1)
+    if (file==-1) {
         file = swift::Open(hash,root_hash);
+        swift::UsePiecePicker(file,STREAMING_PICKER);
+    }
     req->transfer = file;
     if (swift::Size(file)) {
         HttpGwFirstProgressCallback(file,bin64_t(0,0));
@@ -8,6 +8,10 @@
  */
 
 #include "swift.h"
+#include "ext/aimd_controller.cpp"
+#include "ext/ledbat_controller.cpp"
+#include "ext/cubic_controller.cpp"
+#include "ext/bbr_controller.cpp"
 
 using namespace swift;
 using namespace std;
@@ -18,8 +22,29 @@ tint Channel::LEDBAT_TARGET = TINT_MSEC*25;
 float Channel::LEDBAT_GAIN = 1.0/LEDBAT_TARGET;
 tint Channel::LEDBAT_DELAY_BIN = TINT_SEC*30;
 tint Channel::MAX_POSSIBLE_RTT = TINT_SEC*10;
+tint Channel::ACK_DELAY = 0;
+int Channel::ACK_DELAY_PACKETS = 8;
+tint Channel::PACING_SLACK = TINT_MSEC;
 const char* Channel::SEND_CONTROL_MODES[] = {"keepalive", "pingpong",
-    "slowstart", "standard_aimd", "ledbat", "closing"};
+    "cwnd", "closing"};
+
+
+CongestionController* swift::NewCongestionController (congestion_t kind) {
+    switch (kind) {
+        case AIMD_CONGESTION:  return new AimdController();
+        case CUBIC_CONGESTION: return new CubicController();
+        case BBR_CONGESTION:   return new BbrController();
+        default:               return new LedbatController();
+    }
+}
+
+
+void    Channel::SetCongestionController (CongestionController* cc) {
+    delete controller_;
+    controller_ = cc;
+    if (send_control_==CWND_CONTROL)
+        controller_->Restart();
+}
 
 
 tint    Channel::NextSendTime () {
@@ -27,9 +52,7 @@ tint    Channel::NextSendTime () {
     switch (send_control_) {
         case KEEP_ALIVE_CONTROL: return KeepAliveNextSendTime();
         case PING_PONG_CONTROL:  return PingPongNextSendTime();
-        case SLOW_START_CONTROL: return SlowStartNextSendTime();
-        case AIMD_CONTROL:       return AimdNextSendTime();
-        case LEDBAT_CONTROL:     return LedbatNextSendTime();
+        case CWND_CONTROL:       return CwndRateNextSendTime();
         case CLOSE_CONTROL:      return TINT_NEVER;
         default:                 assert(false);
     }
@@ -42,20 +65,14 @@ tint    Channel::SwitchSendControl (int control_mode) {
         case KEEP_ALIVE_CONTROL:
             send_interval_ = rtt_avg_; //max(TINT_SEC/10,rtt_avg_);
             dev_avg_ = max(TINT_SEC,rtt_avg_);
-            data_out_cap_ = bin64_t::ALL;
-            cwnd_ = 1;
+            hashes_out_.clear();
             break;
         case PING_PONG_CONTROL:
             dev_avg_ = max(TINT_SEC,rtt_avg_);
-            data_out_cap_ = bin64_t::ALL;
-            cwnd_ = 1;
+            hashes_out_.clear();
             break;
-        case SLOW_START_CONTROL:
-            cwnd_ = 1;
-            break;
-        case AIMD_CONTROL:
-            break;
-        case LEDBAT_CONTROL:
+        case CWND_CONTROL:
+            controller_->Restart();
             break;
         case CLOSE_CONTROL:
             break;
@@ -70,8 +87,10 @@ tint    Channel::KeepAliveNextSendTime () {
     if (sent_since_recv_>=3 && last_recv_time_<NOW-TINT_MIN)
         return SwitchSendControl(CLOSE_CONTROL);
     if (ack_rcvd_recent_)
-        return SwitchSendControl(SLOW_START_CONTROL);
+        return SwitchSendControl(CWND_CONTROL);
     if (data_in_.time!=TINT_NEVER)
+        return AckDueTime();
+    if (hint_due_)
         return NOW;
     send_interval_ <<= 1;
     if (send_interval_>MAX_SEND_INTERVAL)
@@ -83,9 +102,9 @@ tint    Channel::PingPongNextSendTime () { // FIXME INFINITE LOOP
     if (dgrams_sent_>=10)
         return SwitchSendControl(KEEP_ALIVE_CONTROL);
     if (ack_rcvd_recent_)
-        return SwitchSendControl(SLOW_START_CONTROL);
+        return SwitchSendControl(CWND_CONTROL);
     if (data_in_.time!=TINT_NEVER)
-        return NOW;
+        return AckDueTime();
     if (last_recv_time_>last_send_time_)
         return NOW;
     if (!last_send_time_)
@@ -93,81 +112,38 @@ tint    Channel::PingPongNextSendTime () { // FIXME INFINITE LOOP
     return last_send_time_ + ack_timeout(); // timeout
 }
 
+/** The controller has been told of the acks and losses already; the
+    counts are for the keep-alive modes to see the channel woke up. */
 tint    Channel::CwndRateNextSendTime () {
-    if (data_in_.time!=TINT_NEVER)
-        return NOW; // TODO: delayed ACKs
+    ack_rcvd_recent_ = 0;
+    ack_not_rcvd_recent_ = 0;
+    tint ack = data_in_.time!=TINT_NEVER ? AckDueTime() : TINT_NEVER;
+    if (ack<=NOW)
+        return NOW;
     //if (last_recv_time_<NOW-rtt_avg_*4)
     //    return SwitchSendControl(KEEP_ALIVE_CONTROL);
-    send_interval_ = rtt_avg_/cwnd_;
+    send_interval_ = controller_->send_interval(rtt_avg_);
     if (send_interval_>max(rtt_avg_,TINT_SEC)*4)
         return SwitchSendControl(KEEP_ALIVE_CONTROL);
-    if (data_out_.size()<cwnd_) {
+    if (data_out_.size()<cwnd()) {
         dprintf("%s #%u sendctrl next in %llius (cwnd %.2f, data_out %i)\n",
-                tintstr(),id_,send_interval_,cwnd_,(int)data_out_.size());
-        return last_data_out_time_ + send_interval_;
+                tintstr(),id_,send_interval_,cwnd(),(int)data_out_.size());
+        return min(ack,last_data_out_time_ + send_interval_);
     } else {
         assert(data_out_.front().time!=TINT_NEVER);
-        return data_out_.front().time + ack_timeout();
+        return min(ack,data_out_.front().time + ack_timeout());
     }
 }
 
-void    Channel::BackOffOnLosses (float ratio) {
-    ack_rcvd_recent_ = 0;
-    ack_not_rcvd_recent_ =  0;
-    if (last_loss_time_<NOW-rtt_avg_) {
-        cwnd_ *= ratio;
-        last_loss_time_ = NOW;
-        dprintf("%s #%u sendctrl backoff %3.2f\n",tintstr(),id_,cwnd_);
-    }
-}
-
-tint    Channel::SlowStartNextSendTime () {
-    if (ack_not_rcvd_recent_) {
-        BackOffOnLosses();
-        return SwitchSendControl(LEDBAT_CONTROL);//AIMD_CONTROL);
-    } 
-    if (rtt_avg_/cwnd_<TINT_SEC/10) 
-        return SwitchSendControl(LEDBAT_CONTROL);//AIMD_CONTROL);
-    cwnd_+=ack_rcvd_recent_;
-    ack_rcvd_recent_=0;
-    return CwndRateNextSendTime();
-}
-
-tint    Channel::AimdNextSendTime () {
-    if (ack_not_rcvd_recent_)
-        BackOffOnLosses();
-    if (ack_rcvd_recent_) {
-        if (cwnd_>1)
-            cwnd_ += ack_rcvd_recent_/cwnd_;
-        else
-            cwnd_ *= 2;
-    }
-    ack_rcvd_recent_=0;
-    return CwndRateNextSendTime();
-}
 
-tint Channel::LedbatNextSendTime () {
-    tint owd_cur(TINT_NEVER), owd_min(TINT_NEVER);
-    for(int i=0; i<4; i++) {
-        if (owd_min>owd_min_bins_[i])
-            owd_min = owd_min_bins_[i];
-        if (owd_cur>owd_current_[i])
-            owd_cur = owd_current_[i];
-    }
-    if (ack_not_rcvd_recent_)
-        BackOffOnLosses(0.8);
-    ack_rcvd_recent_ = 0;
-    tint queueing_delay = owd_cur - owd_min;
-    tint off_target = LEDBAT_TARGET - queueing_delay;
-    cwnd_ += LEDBAT_GAIN * off_target / cwnd_;
-    if (cwnd_<1)
-        cwnd_ = 1;
-    if (owd_cur==TINT_NEVER || owd_min==TINT_NEVER)
-        cwnd_ = 1;
-    dprintf("%s #%u sendctrl ledbat %lli-%lli => %3.2f\n",
-            tintstr(),id_,owd_cur,owd_min,cwnd_);
-    return CwndRateNextSendTime();
+/** Acks ride on whatever goes out; a datagram just for them is sent
+    once the oldest pending one has waited ACK_DELAY, enough of them are
+    pending, or the data stopped coming for longer than the usual gap
+    between packets (the sender is likely waiting for these very acks). */
+tint    Channel::AckDueTime () {
+    if (!ACK_DELAY || data_in_queue_.empty() ||
+            data_in_queue_.size()>=ACK_DELAY_PACKETS)
+        return NOW;
+    tint due = data_in_queue_.front().time + ACK_DELAY;
+    return max(NOW,min(due,last_data_in_time_ + dip_avg_*2));
 }
-
-
-
@@ -12,6 +12,12 @@
 using namespace swift;
 using namespace std;
 
+/** DATA payload hashed in advance, see RecvDatagram and OnData */
+static const uint8_t* prehashed_data = NULL;
+static size_t prehashed_length = 0;
+static Sha1Hash* prehashed_hash = NULL;
+
+
 /*
  TODO  25 Oct 18:55
  - range: ALL
@@ -29,16 +35,59 @@ void    Channel::AddPeakHashes (Datagram& dgram) {
 }
 
 
+/** Live streams: the peer learns the size from the keyed peaks, sent
+    whenever they change and once in a while till the peer has got the
+    last chunk (the datagram may be lost). */
+void    Channel::AddKeyedPeaks (Datagram& dgram) {
+    uint64_t sizek = file().packet_size();
+    if ( !sizek || (sizek==peaks_out_ &&
+         (peaks_out_time_>NOW-max(TINT_SEC,rtt_avg_*4) ||
+          ack_in_.is_filled(bin64_t(0,sizek-1)))) )
+        return;
+    dgram.Push8(SWIFT_KEYED_HASH);
+    dgram.Push8(file().peak_count());
+    for(int i=0; i<file().peak_count(); i++) {
+        dgram.Push32(file().peak(i).to32());
+        dgram.PushHash(file().peak_hash(i));
+    }
+    dgram.PushHash(file().peaks_mac());
+    peaks_out_ = sizek;
+    peaks_out_time_ = NOW;
+    dprintf("%s #%u +keyed %lli\n",tintstr(),id_,sizek);
+}
+
+
+/** The peer needs the uncles of pos up to the first node it has proven
+    (some data under it is acked) or is about to (some data under it is
+    on the way, along with its uncles). In a live stream, the peer may
+    have data under a node it has not proven yet, if that was above the
+    peaks it knew; so, it has to have all of it. */
 void    Channel::AddUncleHashes (Datagram& dgram, bin64_t pos) {
     bin64_t peak = file().peak_for(pos);
-    while (pos!=peak && ((NOW&3)==3 || !data_out_cap_.within(pos.parent())) &&
-            ack_in_.get(pos.parent())==binmap_t::EMPTY  ) {
+    int count = 0;
+    for(bin64_t p=pos; p!=peak && hashes_out_.is_empty(p.parent()); p=p.parent()) {
+        if (file().is_live() ? ack_in_.is_filled(p.parent()) :
+                               !ack_in_.is_empty(p.parent()))
+            break;
+        count++;
+    }
+    if (!count)
+        return;
+    if (cap_in_ & (1<<SWIFT_UNCLE_HASHES)) {
+        dgram.Push8(SWIFT_UNCLE_HASHES);
+        dgram.Push32(pos.to32());
+        dgram.Push8(count);
+        dprintf("%s #%u +uncles %s %i\n",tintstr(),id_,pos.str(),count);
+        for(int i=0; i<count; i++, pos=pos.parent())
+            dgram.PushHash( file().hash(pos.sibling()) );
+        return;
+    }
+    for(int i=0; i<count; i++, pos=pos.parent()) {
         bin64_t uncle = pos.sibling();
         dgram.Push8(SWIFT_HASH);
         dgram.Push32((uint32_t)uncle);
         dgram.PushHash( file().hash(uncle) );
         dprintf("%s #%u +hash %s\n",tintstr(),id_,uncle.str());
-        pos = pos.parent();
     }
 }
 
@@ -50,7 +99,7 @@ bin64_t           Channel::ImposeHint () {
     ack_in_.twist(twist);
     bin64_t my_pick =
         file().ack_out().find_filtered(ack_in_,bin64_t::ALL,binmap_t::FILLED);
-    while (my_pick.width()>max(1,(int)cwnd_))
+    while (my_pick.width()>max(1,(int)cwnd()))
         my_pick = my_pick.left();
     file().ack_out().twist(0);
     ack_in_.twist(0);
@@ -77,8 +126,9 @@ bin64_t        Channel::DequeueHint () {
         }
         //if (time < NOW-TINT_SEC*3/2 )
         //    continue;  bad idea
-        if (ack_in_.get(hint)!=binmap_t::FILLED)
-            send = hint;
+        if (ack_in_.get(hint)!=binmap_t::FILLED &&
+                (!file().is_live() || file().ack_out().is_filled(hint)))
+            send = hint; // live: not evicted meanwhile
     }
     uint64_t mass = 0;
     for(int i=0; i<hint_in_.size(); i++)
@@ -100,17 +150,19 @@ void    Channel::AddHandshake (Datagram& dgram) {
     int encoded = EncodeID(id_);
     dgram.Push32(encoded);
     dprintf("%s #%u +hs %x\n",tintstr(),id_,encoded);
-    have_out_.clear();
+    ResetHave();
     AddHave(dgram);
 }
 
 
 void    Channel::Send () {
-    Datagram dgram(socket_,peer());
+    Datagram& dgram = Datagram::Outgoing(socket_,peer());
     dgram.Push32(peer_channel_id_);
     bin64_t data = bin64_t::NONE;
     if ( is_established() ) {
         // FIXME: seeder check
+        if (file().is_live())
+            AddKeyedPeaks(dgram);
         AddHave(dgram);
         AddAck(dgram);
         if (!file().is_complete())
@@ -122,14 +174,15 @@ void    Channel::Send () {
         AddHandshake(dgram);
         AddHave(dgram);
         AddAck(dgram);
+        AddMsgTypeRcvd(dgram); // last, as older peers stop parsing at it
     }
+    hint_due_ = false;
     dprintf("%s #%u sent %ib %s:%x\n",
             tintstr(),id_,dgram.size(),peer().str(),peer_channel_id_);
     if (dgram.size()==4) {// only the channel id; bare keep-alive
         data = bin64_t::ALL;
     }
-    if (dgram.Send()==-1)
-        print_error("can't send datagram");
+    dgram.Queue(); // goes out in this tick, see Loop
     last_send_time_ = NOW;
     sent_since_recv_++;
     dgrams_sent_++;
@@ -152,7 +205,11 @@ void    Channel::AddHint (Datagram& dgram) {
     if ( hint_out_size_ < plan_pck ) {
 
         int diff = plan_pck - hint_out_size_; // TODO: aggregate
-        bin64_t hint = transfer().picker().Pick(ack_in_,diff,NOW+plan_for*2);
+        tint arrives = NOW + rtt_avg_ + hint_out_size_*dip_avg_; // queued first
+        bin64_t hint = transfer().picker().Pick(ack_in_,diff,arrives);
+        if (hint==bin64_t::NONE && transfer().picker().AllHinted())
+            hint = transfer().endgame().Pick(ack_in_,file().ack_out(),
+                                             hint_out_,diff);
 
         if (hint!=bin64_t::NONE) {
             dgram.Push8(SWIFT_HINT);
@@ -174,7 +231,7 @@ bin64_t        Channel::AddData (Datagram& dgram) {
 
     bin64_t tosend = bin64_t::NONE;
     tint luft = send_interval_>>4; // may wake up a bit earlier
-    if (data_out_.size()<cwnd_ &&
+    if (data_out_.size()<cwnd() &&
             last_data_out_time_+send_interval_<=NOW+luft) {
         tosend = DequeueHint();
         if (tosend==bin64_t::NONE) {
@@ -184,55 +241,130 @@ bin64_t        Channel::AddData (Datagram& dgram) {
         }
     } else
         dprintf("%s #%u sendctrl wait cwnd %f data_out %i next %s\n",
-                tintstr(),id_,cwnd_,(int)data_out_.size(),tintstr(last_data_out_time_+NOW-send_interval_));
+                tintstr(),id_,cwnd(),(int)data_out_.size(),tintstr(last_data_out_time_+NOW-send_interval_));
 
     if (tosend==bin64_t::NONE)// && (last_data_out_time_>NOW-TINT_SEC || data_out_.empty()))
         return bin64_t::NONE; // once in a while, empty data is sent just to check rtt FIXED
 
-    if (ack_in_.is_empty() && file().size())
+    if (ack_in_.is_empty() && hashes_out_.is_empty() && !file().is_live())
         AddPeakHashes(dgram);
     AddUncleHashes(dgram,tosend);
-    if (!ack_in_.is_empty()) // TODO: cwnd_>1
-        data_out_cap_ = tosend;
+    hashes_out_.set(tosend);
 
     if (dgram.size()>254) {
-        dgram.Send(); // kind of fragmentation
+        dgram.QueueHead(); // kind of fragmentation
         dgram.Push32(peer_channel_id_);
     }
 
     dgram.Push8(SWIFT_DATA);
     dgram.Push32(tosend.to32());
 
-    uint8_t buf[1024];
-    size_t r = pread(file().file_descriptor(),buf,1024,tosend.base_offset()<<10);
-    // TODO: corrupted data, retries, caching
-    if (r<0) {
+    // the payload goes to the datagram as is, and the datagram lies in the
+    // outgoing batch already (see Send): no intermediate buffers
+    size_t chunk = file().chunk_size();
+    uint64_t offset = file().data_offset(tosend);
+    const uint8_t* mapped = file().map_data();
+    if (mapped) {
+        dgram.PushRef(mapped+offset,min((uint64_t)chunk,file().size()-offset));
+    } else if (dgram.PushFile(file().file_descriptor(),chunk,offset)<0) {
+        // TODO: corrupted data, retries, caching
         print_error("error on reading");
         return bin64_t::NONE;
     }
-    assert(dgram.space()>=r+4+1);
-    dgram.Push(buf,r);
 
-    last_data_out_time_ = NOW;
-    data_out_.push_back(tosend);
+    if (send_control_==CWND_CONTROL) // by the schedule, see PACING_SLACK
+        last_data_out_time_ = max(NOW-PACING_SLACK,
+                                  last_data_out_time_+send_interval_);
+    else
+        last_data_out_time_ = NOW;
+    PushDataOut(tosend);
+    controller_->OnSend();
     dprintf("%s #%u +data %s\n",tintstr(),id_,tosend.str());
 
     return tosend;
 }
 
 
+/** With delayed acks, a range ACK covers a run of bins that arrived one
+    after another within an aligned bin of up to 2^ACK_RANGE_LAYER chunks,
+    and carries the arrival time of the last of them. The sender takes
+    its RTT/OWD sample off the latest packet it sent within the range, so
+    the two match; as runs go out in the order of arrival, the sender's
+    loss detection by reordering is not confused either. Only peers that
+    announced SWIFT_RANGE_ACK get those; others are acked bin by bin. */
+#define ACK_RANGE_LAYER 6
+
 void    Channel::AddAck (Datagram& dgram) {
     if (data_in_==tintbin())
         return;
-    dgram.Push8(SWIFT_ACK);
-    dgram.Push32(data_in_.bin.to32()); // FIXME not cover
-    dgram.Push64(data_in_.time); // FIXME 32
-    have_out_.set(data_in_.bin);
-    dprintf("%s #%u +ack %s %s\n",
-        tintstr(),id_,data_in_.bin.str(),tintstr(data_in_.time));
-    if (data_in_.bin.layer()>2)
-        data_in_dbl_ = data_in_.bin;
-    data_in_ = tintbin();
+    if (data_in_queue_.empty()) { // no delay, bad data or hashes
+        dgram.Push8(SWIFT_ACK);
+        dgram.Push32(data_in_.bin.to32());
+        dgram.Push64(data_in_.time);
+        if (data_in_.bin!=bin64_t::NONE)
+            have_out_.set(data_in_.bin);
+        dprintf("%s #%u +ack %s %s\n",
+            tintstr(),id_,data_in_.bin.str(),tintstr(data_in_.time));
+        if (data_in_.bin.layer()>2)
+            data_in_dbl_ = data_in_.bin;
+        data_in_ = tintbin();
+        return;
+    }
+    bool ranges = cap_in_ & (1<<SWIFT_RANGE_ACK);
+    while (!data_in_queue_.empty() && dgram.space()>=1+4+8) {
+        tintbin ack = data_in_queue_.front();
+        data_in_queue_.pop_front();
+        if (ranges) {
+            bin64_t cover = file().ack_out().cover(ack.bin);
+            if (ack.bin.within(cover)) {
+                int layer = min(cover.layer(),ACK_RANGE_LAYER);
+                ack.bin = bin64_t(layer,ack.bin.base_offset()>>layer);
+            }
+            while ( !data_in_queue_.empty() &&
+                    data_in_queue_.front().bin.within(ack.bin) ) {
+                ack.time = data_in_queue_.front().time;
+                data_in_queue_.pop_front();
+            }
+        }
+        dgram.Push8(SWIFT_ACK);
+        dgram.Push32(ack.bin.to32());
+        dgram.Push64(ack.time); // FIXME 32
+        have_out_.set(ack.bin);
+        dprintf("%s #%u +ack %s %s\n",
+            tintstr(),id_,ack.bin.str(),tintstr(ack.time));
+        if (ack.bin.layer()>2)
+            data_in_dbl_ = ack.bin;
+    }
+    if (data_in_queue_.empty())
+        data_in_ = tintbin();
+}
+
+
+void    Channel::ResetHave () {
+    have_out_.clear();
+    have_seq_ = transfer().ack_log_end();
+    have_walk_ = 0;
+    have_walk_end_ = file().packet_size();
+}
+
+
+bin64_t Channel::WalkHave () {
+    binmap_t& ack_out = file().ack_out();
+    while (have_walk_<have_walk_end_) {
+        bin64_t range(0,have_walk_);
+        while ( range.is_left() && range.parent().base_offset()+
+                range.parent().width()<=have_walk_end_ )
+            range = range.parent();
+        bin64_t have = ack_out.find_filtered(have_out_,range,binmap_t::FILLED);
+        if (have==bin64_t::NONE) {
+            have_walk_ += range.width();
+            continue;
+        }
+        have = ack_out.cover(have);
+        have_walk_ = have.base_offset() + have.width();
+        return have;
+    }
+    return bin64_t::NONE;
 }
 
 
@@ -242,16 +374,25 @@ void    Channel::AddHave (Datagram& dgram) {
         dgram.Push32(data_in_dbl_.to32());
         data_in_dbl_=bin64_t::NONE;
     }
-    for(int count=0; count<4; count++) {
-        bin64_t ack = file().ack_out().find_filtered // FIXME: do rotating queue
-            (have_out_, bin64_t::ALL, binmap_t::FILLED);
-        if (ack==bin64_t::NONE)
-            break;
-        ack = file().ack_out().cover(ack);
-        have_out_.set(ack);
+    for(int count=0; count<4; ) {
+        bin64_t have = WalkHave();
+        if (have==bin64_t::NONE) {
+            have = transfer().RevealAck(have_seq_);
+            if (have==bin64_t::NONE)
+                break;
+            if (have==bin64_t::ALL) { // lagged behind, start over
+                have_walk_ = 0;
+                have_walk_end_ = file().packet_size();
+                continue;
+            }
+            if (have_out_.is_filled(have))
+                continue;
+        }
+        have_out_.set(have);
         dgram.Push8(SWIFT_HAVE);
-        dgram.Push32(ack.to32());
-        dprintf("%s #%u +have %s\n",tintstr(),id_,ack.str());
+        dgram.Push32(have.to32());
+        dprintf("%s #%u +have %s\n",tintstr(),id_,have.str());
+        count++;
     }
 }
 
@@ -276,6 +417,9 @@ void    Channel::Recv (Datagram& dgram) {
             case SWIFT_HASH:      OnHash(dgram); break;
             case SWIFT_HINT:      OnHint(dgram); break;
             case SWIFT_PEX_ADD:   OnPex(dgram); break;
+            case SWIFT_UNCLE_HASHES: OnUncleHashes(dgram); break;
+            case SWIFT_KEYED_HASH: OnKeyedHash(dgram); break;
+            case SWIFT_MSGTYPE_RCVD: OnMsgTypeRcvd(dgram); break;
             default:
                 eprintf("%s #%u ?msg id unknown %i\n",tintstr(),id_,(int)type);
                 return;
@@ -295,6 +439,56 @@ void    Channel::OnHash (Datagram& dgram) {
 }
 
 
+void    Channel::OnUncleHashes (Datagram& dgram) {
+    bin64_t pos = dgram.Pull32();
+    int count = dgram.Pull8();
+    if (pos==bin64_t::NONE || count*Sha1Hash::SIZE>dgram.size()) {
+        uint8_t* rest;
+        dgram.Pull(&rest,dgram.size()); // garbage, skip the rest
+        return;
+    }
+    dprintf("%s #%u -uncles %s %i\n",tintstr(),id_,pos.str(),count);
+    for(int i=0; i<count; i++, pos=pos.parent())
+        file().OfferHash(pos.sibling(),dgram.PullHash());
+}
+
+
+void    Channel::OnKeyedHash (Datagram& dgram) {
+    int count = dgram.Pull8();
+    bin64_t peaks[64];
+    Sha1Hash hashes[64];
+    if ( count>64 ||
+         count*(4+Sha1Hash::SIZE)+Sha1Hash::SIZE>dgram.size() ) {
+        uint8_t* rest;
+        dgram.Pull(&rest,dgram.size()); // garbage, skip the rest
+        return;
+    }
+    for(int i=0; i<count; i++) {
+        peaks[i] = dgram.Pull32();
+        hashes[i] = dgram.PullHash();
+    }
+    Sha1Hash mac = dgram.PullHash();
+    uint64_t first = file().window_start();
+    bool ok = file().OfferKeyedPeaks(count,peaks,hashes,mac);
+    if (file().window_start()>first)
+        transfer().OnWindowMoved();
+    dprintf("%s #%u %ckeyed %lli\n",tintstr(),id_,ok?'-':'!',
+            file().packet_size());
+}
+
+
+void    Channel::AddMsgTypeRcvd (Datagram& dgram) {
+    dgram.Push8(SWIFT_MSGTYPE_RCVD);
+    dgram.Push32(transfer().cap_out_);
+}
+
+
+void    Channel::OnMsgTypeRcvd (Datagram& dgram) {
+    cap_in_ = dgram.Pull32();
+    dprintf("%s #%u -msgtypes %x\n",tintstr(),id_,(uint32_t)cap_in_);
+}
+
+
 void    Channel::CleanHintOut (bin64_t pos) {
     int hi = 0;
     while (hi<hint_out_.size() && !pos.within(hint_out_[hi].bin))
@@ -319,8 +513,11 @@ void    Channel::CleanHintOut (bin64_t pos) {
 bin64_t Channel::OnData (Datagram& dgram) {  // TODO: HAVE NONE for corrupted data
     bin64_t pos = dgram.Pull32();
     uint8_t *data;
-    int length = dgram.Pull(&data,1024);
-    bool ok = (pos==bin64_t::NONE) || file().OfferData(pos, (char*)data, length) ;
+    int length = dgram.Pull(&data,file().chunk_size());
+    Sha1Hash* hash = data==prehashed_data && length==prehashed_length ?
+                     prehashed_hash : NULL;
+    bool ok = (pos==bin64_t::NONE) ||
+              file().OfferData(pos, (char*)data, length, hash) ;
     dprintf("%s #%u %cdata %s\n",tintstr(),id_,ok?'-':'!',pos.str());
     data_in_ = tintbin(NOW,bin64_t::NONE);
     if (!ok)
@@ -330,6 +527,9 @@ bin64_t Channel::OnData (Datagram& dgram) {  // TODO: HAVE NONE for corrupted da
         if (cover.layer()>=transfer().cb_agg[i])
             transfer().callbacks[i](transfer().fd(),cover);  // FIXME
     data_in_.bin = pos;
+    if (pos!=bin64_t::NONE && ACK_DELAY)
+        data_in_queue_.push_back(data_in_);
+    transfer().OnDataIn(pos);
     if (pos!=bin64_t::NONE) {
         if (last_data_in_time_) {
             tint dip = NOW - last_data_in_time_;
@@ -338,69 +538,77 @@ bin64_t Channel::OnData (Datagram& dgram) {  // TODO: HAVE NONE for corrupted da
         last_data_in_time_ = NOW;
     }
     CleanHintOut(pos);
+    if (transfer().endgame().active()) { // asked others for it, too
+        for(int i=0; i<transfer().hs_in_.size(); i++) {
+            Channel* c = Channel::channel(transfer().hs_in_[i]);
+            if (c && c!=this && c->transfer_==transfer_)
+                c->CancelHints();
+        }
+        transfer().endgame().OnDataIn(file().ack_out());
+    }
     return pos;
 }
 
 
+void    Channel::CancelHints () {
+    int w = 0;
+    for(int i=0; i<hint_out_.size(); i++)
+        if (file().ack_out().is_filled(hint_out_[i].bin))
+            hint_out_size_ -= hint_out_[i].bin.width();
+        else
+            hint_out_[w++] = hint_out_[i];
+    while (hint_out_.size()>w)
+        hint_out_.pop_back();
+}
+
+
 void    Channel::OnAck (Datagram& dgram) {
     bin64_t ackd_pos = dgram.Pull32();
     tint peer_time = dgram.Pull64(); // FIXME 32
     // FIXME FIXME: wrap around here
-    if (ackd_pos==bin64_t::NONE)
-        return; // likely, brocken packet / insufficient hashes
+    if (ackd_pos==bin64_t::NONE) { // likely, brocken packet / insufficient hashes
+        hashes_out_.clear();
+        return;
+    }
     if (file().size() && ackd_pos.base_offset()>=file().packet_size()) {
         eprintf("invalid ack: %s\n",ackd_pos.str());
         return;
     }
-    ack_in_.set(ackd_pos);
-    int di = 0, ri = 0;
-    // find an entry for the send (data out) event
-    while (  di<data_out_.size() && ( data_out_[di]==tintbin() ||
-           !data_out_[di].bin.within(ackd_pos) )  )
-        di++;
-    // FUTURE: delayed acks
-    // rule out retransmits
-    while (  ri<data_out_tmo_.size() && !data_out_tmo_[ri].bin.within(ackd_pos) )
-        ri++;
+    AckIn(ackd_pos);
+    // find an entry for the send (data out) event; a range ack
+    // carries the timestamp of the latest packet in it
+    int di = FindDataOut(ackd_pos);
+    tintbin sent = di!=-1 ? data_out_[di] : tintbin();
+    int acked = AckDataOut(ackd_pos);
     dprintf("%s #%u %cack %s %lli\n",tintstr(),id_,
-            di==data_out_.size()?'?':'-',ackd_pos.str(),peer_time);
-    if (di!=data_out_.size() && ri==data_out_tmo_.size()) { // not a retransmit
+            di==-1?'?':'-',ackd_pos.str(),peer_time);
+    if (di!=-1 && !IsRetransmit(sent.bin)) { // not a retransmit
             // round trip time calculations
-        tint rtt = NOW-data_out_[di].time;
+        tint rtt = NOW-sent.time;
         rtt_avg_ = (rtt_avg_*7 + rtt) >> 3;
         dev_avg_ = ( dev_avg_*3 + ::abs(rtt-rtt_avg_) ) >> 2;
-        assert(data_out_[di].time!=TINT_NEVER);
-            // one-way delay calculations
-        tint owd = peer_time - data_out_[di].time;
-        owd_cur_bin_ = 0;//(owd_cur_bin_+1) & 3;
-        owd_current_[owd_cur_bin_] = owd;
-        if ( owd_min_bin_start_+TINT_SEC*30 < NOW ) {
-            owd_min_bin_start_ = NOW;
-            owd_min_bin_ = (owd_min_bin_+1) & 3;
-            owd_min_bins_[owd_min_bin_] = TINT_NEVER;
-        }
-        if (owd_min_bins_[owd_min_bin_]>owd)
-            owd_min_bins_[owd_min_bin_] = owd;
+        assert(sent.time!=TINT_NEVER);
+        if (acked)
+            controller_->OnAck(acked,sent.time,rtt,peer_time-sent.time);
         dprintf("%s #%u sendctrl rtt %lli dev %lli based on %s\n",
-                tintstr(),id_,rtt_avg_,dev_avg_,data_out_[di].bin.str());
-        ack_rcvd_recent_++;
-        // early loss detection by packet reordering
+                tintstr(),id_,rtt_avg_,dev_avg_,sent.bin.str());
+        ack_rcvd_recent_ += acked;
+        // early loss detection by packet reordering; the entries before
+        // are all cleared, so they are popped below and visited once
         for (int re=0; re<di-MAX_REORDERING; re++) {
             if (data_out_[re]==tintbin())
                 continue;
             ack_not_rcvd_recent_++;
-            data_out_tmo_.push_back(data_out_[re].bin);
+            controller_->OnLoss();
+            PushDataOutTmo(data_out_[re].bin);
             dprintf("%s #%u Rdata %s\n",tintstr(),id_,data_out_.front().bin.str());
-            data_out_cap_ = bin64_t::ALL;
-            data_out_[re] = tintbin();
+            ClearDataOut(re);
         }
     }
-    if (di!=data_out_.size())
-        data_out_[di]=tintbin();
     // clear zeroed items
     while (!data_out_.empty() && ( data_out_.front()==tintbin() ||
             ack_in_.is_filled(data_out_.front().bin) ) )
-        data_out_.pop_front();
+        PopDataOut();
     assert(data_out_.empty() || data_out_.front().time!=TINT_NEVER);
 }
 
@@ -412,15 +620,120 @@ void Channel::TimeoutDataOut ( ) {
         ( data_out_.front().time<timeout || data_out_.front()==tintbin() ) ) {
         if (data_out_.front()!=tintbin() && ack_in_.is_empty(data_out_.front().bin)) {
             ack_not_rcvd_recent_++;
-            data_out_cap_ = bin64_t::ALL;
-            data_out_tmo_.push_back(data_out_.front().bin);
+            controller_->OnLoss();
+            PushDataOutTmo(data_out_.front().bin);
             dprintf("%s #%u Tdata %s\n",tintstr(),id_,data_out_.front().bin.str());
         }
-        data_out_.pop_front();
+        PopDataOut();
     }
     // clear retransmit queue of older items
     while (!data_out_tmo_.empty() && data_out_tmo_.front().time<NOW-MAX_POSSIBLE_RTT)
-        data_out_tmo_.pop_front();
+        PopDataOutTmo();
+}
+
+
+/** data_out_ and data_out_tmo_ are indexed by bin, so an ack is matched
+    without scanning the window. Data goes out in base bins; a wider ack
+    is checked bin by bin, or by a scan if it is wider than the window. */
+void Channel::PushDataOut (bin64_t pos) {
+    if (data_out_idx_.get(pos,-1)!=-1)
+        data_out_dups_++; // sent again while the first one is out
+    data_out_.push_back(pos);
+    data_out_idx_.set(pos,data_out_.back_seq());
+}
+
+
+void Channel::ClearDataOut (int i) {
+    bin64_t pos = data_out_[i].bin;
+    if (data_out_idx_.get(pos,-1)==data_out_.front_seq()+i)
+        data_out_idx_.remove(pos);
+    else
+        data_out_dups_--;
+    data_out_[i] = tintbin();
+}
+
+
+void Channel::PopDataOut () {
+    if (data_out_.front()!=tintbin())
+        ClearDataOut(0);
+    data_out_.pop_front();
+}
+
+
+void Channel::PushDataOutTmo (bin64_t pos) {
+    hashes_out_.set(pos,binmap_t::EMPTY); // the uncles are likely lost, too
+    data_out_tmo_.push_back(pos);
+    data_out_tmo_idx_.set(pos,data_out_tmo_idx_.get(pos,0)+1);
+}
+
+
+void Channel::PopDataOutTmo () {
+    bin64_t pos = data_out_tmo_.front().bin;
+    uint64_t count = data_out_tmo_idx_.get(pos,0);
+    if (count>1)
+        data_out_tmo_idx_.set(pos,count-1);
+    else
+        data_out_tmo_idx_.remove(pos);
+    data_out_tmo_.pop_front();
+}
+
+
+int Channel::FindDataOut (bin64_t pos) {
+    if (pos.width()>data_out_.size()) {
+        for(int i=data_out_.size()-1; i>=0; i--)
+            if (data_out_[i]!=tintbin() && data_out_[i].bin.within(pos))
+                return i;
+        return -1;
+    }
+    int ret = -1;
+    for(uint64_t b=pos.base_offset(); b<pos.base_offset()+pos.width(); b++) {
+        int i = data_out_.find(data_out_idx_.get(bin64_t(0,b),-1));
+        if (i>ret)
+            ret = i;
+    }
+    return ret;
+}
+
+
+int Channel::AckDataOut (bin64_t pos) {
+    int acked = 0;
+    if (pos.width()>data_out_.size()) {
+        for(int i=0; i<data_out_.size(); i++)
+            if (data_out_[i]!=tintbin() && data_out_[i].bin.within(pos)) {
+                ClearDataOut(i);
+                acked++;
+            }
+        return acked;
+    }
+    for(uint64_t b=pos.base_offset(); b<pos.base_offset()+pos.width(); b++) {
+        int i = data_out_.find(data_out_idx_.get(bin64_t(0,b),-1));
+        if (i==-1)
+            continue;
+        ClearDataOut(i);
+        acked++;
+        // the index has the latest send only; earlier ones would look
+        // lost to OnAck, so they go too (rare, hence a scan)
+        for(int j=0; data_out_dups_ && j<i; j++)
+            if (data_out_[j].bin==bin64_t(0,b)) {
+                ClearDataOut(j);
+                acked++;
+            }
+    }
+    return acked;
+}
+
+
+bool Channel::IsRetransmit (bin64_t pos) {
+    if (pos.width()>data_out_tmo_.size()) {
+        for(int i=0; i<data_out_tmo_.size(); i++)
+            if (data_out_tmo_[i].bin.within(pos))
+                return true;
+        return false;
+    }
+    for(uint64_t b=pos.base_offset(); b<pos.base_offset()+pos.width(); b++)
+        if (data_out_tmo_idx_.get(bin64_t(0,b),0))
+            return true;
+    return false;
 }
 
 
@@ -428,15 +741,54 @@ void Channel::OnHave (Datagram& dgram) {
     bin64_t ackd_pos = dgram.Pull32();
     if (ackd_pos==bin64_t::NONE)
         return; // wow, peer has hashes
-    ack_in_.set(ackd_pos);
+    AckIn(ackd_pos);
+    if (ackd_pos.base_offset()<file().window_start())
+        TrimAckIn();
+    if (!file().is_complete() && !file().ack_out().is_filled(ackd_pos))
+        hint_due_ = true;
     dprintf("%s #%u -have %s\n",tintstr(),id_,ackd_pos.str());
 }
 
 
+void    Channel::AckIn (bin64_t pos) {
+    if (ack_in_.is_filled(pos))
+        return;
+    if (ack_in_.is_empty(pos)) {
+        transfer().picker().Available(pos,1);
+        ack_in_.set(pos);
+        return;
+    }
+    AckIn(pos.left());
+    AckIn(pos.right());
+}
+
+
+void    Channel::TrimAckIn () {
+    ack_in_.clear_before(file().window_start());
+}
+
+
+void    Channel::ReportAckIn (int delta) {
+    int count;
+    uint64_t* stripes = ack_in_.get_stripes(count);
+    for(int i=1; i+1<count; i+=2) // filled ones, aligned bin by bin
+        for(uint64_t at=stripes[i]; at<stripes[i+1]; ) {
+            bin64_t bin(0,at);
+            while (bin.is_left() && bin.parent().base_offset()+
+                   bin.parent().width()<=stripes[i+1])
+                bin = bin.parent();
+            transfer().picker().Available(bin,delta);
+            at += bin.width();
+        }
+    free(stripes);
+}
+
+
 void    Channel::OnHint (Datagram& dgram) {
     bin64_t hint = dgram.Pull32();
-    // FIXME: wake up here
     hint_in_.push_back(hint);
+    if (send_control_==KEEP_ALIVE_CONTROL && !file().ack_out().is_empty(hint))
+        SwitchSendControl(CWND_CONTROL); // wake up
     dprintf("%s #%u -hint %s\n",tintstr(),id_,hint.str());
 }
 
@@ -470,7 +822,7 @@ void    Channel::AddPex (Datagram& dgram) {
     int chid = transfer().RevealChannel(pex_out_);
     if (chid==-1 || chid==id_)
         return;
-    Address a = channels[chid]->peer();
+    Address a = channel(chid)->peer();
     dgram.Push8(SWIFT_PEX_ADD);
     dgram.Push32(a.ipv4());
     dgram.Push16(a.port());
@@ -478,9 +830,69 @@ void    Channel::AddPex (Datagram& dgram) {
 }
 
 
+/** Find the payload of the DATA message, which goes last in a datagram;
+    returns NULL if there is none or the datagram looks unusual. */
+static const uint8_t* DataPayload (const Datagram& dgram, size_t* length) {
+    static const int body_size[SWIFT_MESSAGE_COUNT] =
+        { 4, 4, 12, 4, 24, 6, -1, -1, 4, 4, -1 };
+    const uint8_t* p = *dgram + 4, *end = *dgram + dgram.size();
+    while (p<end && *p<SWIFT_MESSAGE_COUNT) {
+        if (*p==SWIFT_DATA) {
+            p += 1 + body_size[SWIFT_DATA];
+            if (p>=end)
+                return NULL;
+            *length = end-p;
+            return p;
+        }
+        if (*p==SWIFT_UNCLE_HASHES && p+6<=end)
+            p += 1 + 5 + Sha1Hash::SIZE*p[5];
+        else if (*p==SWIFT_KEYED_HASH && p+2<=end)
+            p += 1 + 1 + (4+Sha1Hash::SIZE)*p[1] + Sha1Hash::SIZE;
+        else if (body_size[*p]>=0)
+            p += 1 + body_size[*p];
+        else
+            break;
+    }
+    return NULL;
+}
+
+
 void    Channel::RecvDatagram (SOCKET socket) {
-    Datagram data(socket);
-    data.Recv();
+    static Datagram ring[DGRAM_MAX_BATCH];
+    static Sha1Hash hashes[DGRAM_MAX_BATCH];
+    const uint8_t* payloads[DGRAM_MAX_BATCH];
+    size_t lengths[DGRAM_MAX_BATCH];
+    Sha1Hash* hash_ptrs[DGRAM_MAX_BATCH];
+    int of[DGRAM_MAX_BATCH];
+    int got;
+    do { // the socket is edge-triggered: drain it
+        got = Datagram::RecvBatch(socket,ring,DGRAM_MAX_BATCH);
+        // verification hashes for the whole batch go in one go
+        int payload_count = 0;
+        for(int i=0; i<got; i++) {
+            of[i] = -1;
+            payloads[payload_count] = DataPayload(ring[i],lengths+payload_count);
+            if (payloads[payload_count]) {
+                hash_ptrs[payload_count] = hashes + payload_count;
+                of[i] = payload_count++;
+            }
+        }
+        Sha1Hash::HashMany(payload_count,payloads,lengths,hash_ptrs);
+        for(int i=0; i<got; i++) {
+            Datagram::Time(); // inter-arrival times as if read one by one
+            if (of[i]!=-1) {
+                prehashed_data = payloads[of[i]];
+                prehashed_length = lengths[of[i]];
+                prehashed_hash = hashes + of[i];
+            }
+            DispatchDatagram(ring[i]);
+            prehashed_data = NULL;
+        }
+    } while (got==DGRAM_MAX_BATCH);
+}
+
+
+void    Channel::DispatchDatagram (Datagram& data) {
     const Address& addr = data.address();
 #define return_log(...) { fprintf(stderr,__VA_ARGS__); return; }
     if (data.size()<4)
@@ -504,16 +916,17 @@ void    Channel::RecvDatagram (SOCKET socket) {
         if (!file)
             return_log ("%s #0 hash %s unknown, no such file %s\n",tintstr(),hash.hex().c_str(),addr.str());
         dprintf("%s #0 -hash ALL %s\n",tintstr(),hash.hex().c_str());
-        for(binqueue::iterator i=file->hs_in_.begin(); i!=file->hs_in_.end(); i++)
-            if (channels[*i] && channels[*i]->peer_==data.address() &&
-                channels[*i]->last_recv_time_>NOW-TINT_SEC*2)
+        int at = -1;
+        for(uint32_t id; (id=file->peer_channels_.next(addr,at)); )
+            if (Channel::channel(id)->last_recv_time_>NOW-TINT_SEC*2)
                 return_log("%s #0 have a channel already to %s\n",tintstr(),addr.str());
-        channel = new Channel(file, socket, data.address());
+        channel = new Channel(file, data.socket_fd(), data.address());
     } else {
-        mych = DecodeID(mych);
-        if (mych>=channels.size())
-            return_log("%s invalid channel #%u, %s\n",tintstr(),mych,addr.str());
-        channel = channels[mych];
+        int id = DecodeID(mych);
+        if (id<0)
+            return_log("%s invalid channel %x, %s\n",tintstr(),mych,addr.str());
+        mych = id;
+        channel = Channel::channel(mych);
         if (!channel)
             return_log ("%s #%u is already closed\n",tintstr(),mych,addr.str());
         if (channel->peer() != addr)
@@ -534,33 +947,37 @@ void    Channel::Loop (tint howlong) {
 
         tint send_time(TINT_NEVER);
         Channel* sender(NULL);
-        while (!sender && !send_queue.is_empty()) { // dequeue
-            tintbin next = send_queue.pop();
-            sender = channel((int)next.bin);
-            send_time = next.time;
-            if (sender && sender->next_send_time_!=send_time &&
-                     sender->next_send_time_!=TINT_NEVER )
-                sender = NULL; // it was a stale entry
+        while (!sender && !send_queue.is_empty()) { // peek
+            send_time = send_queue.peek().time;
+            sender = channel((int)send_queue.peek().bin);
+            if (!sender) { // must not happen, channels dequeue on delete
+                send_queue.pop();
+                send_time = TINT_NEVER;
+            }
         }
 
         if ( sender!=NULL && send_time<=NOW ) { // it's time
 
             dprintf("%s #%u sch_send %s\n",tintstr(),sender->id(),
                     tintstr(send_time));
+            send_queue.pop();
             sender->Send();
 
         } else {  // it's too early, wait
 
             tint towait = min(limit,send_time) - NOW;
+            if (towait>0 && (FileTransfer::Checkpoint() ||
+                             FileTransfer::Recheck()))
+                towait = 0; // only check the sockets, then some more
             dprintf("%s #0 waiting %lliusec\n",tintstr(),towait);
             Datagram::Wait(towait);
-            if (sender)  // get back to that later
-                send_queue.push(tintbin(send_time,sender->id()));
 
         }
 
     } while (NOW<limit);
 
+    Datagram::Flush();
+
 }
 
 
@@ -569,11 +986,21 @@ void Channel::Close () {
 }
 
 
+void Channel::Nudge () {
+    if (send_control_==KEEP_ALIVE_CONTROL)
+        send_interval_ = rtt_avg_; // no more backing off
+    if (next_send_time_>NOW) {
+        next_send_time_ = NOW;
+        send_queue.set(id_,NOW);
+    }
+}
+
+
 void Channel::Reschedule () {
     next_send_time_ = NextSendTime();
     if (next_send_time_!=TINT_NEVER) {
         assert(next_send_time_<NOW+TINT_MIN);
-        send_queue.push(tintbin(next_send_time_,id_));
+        send_queue.set(id_,next_send_time_);
         dprintf("%s #%u requeue for %s\n",tintstr(),id_,tintstr(next_send_time_));
     } else {
         dprintf("%s #%u closed\n",tintstr(),id_);
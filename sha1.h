@@ -9,6 +9,8 @@
 #ifndef GIT_SHA1
 #define GIT_SHA1
 
+#include <stddef.h>
+
 typedef struct {
     unsigned long long size;
     unsigned int H[5];
@@ -19,5 +21,16 @@ void blk_SHA1_Init(blk_SHA_CTX *ctx);
 void blk_SHA1_Update(blk_SHA_CTX *ctx, const void *dataIn, unsigned long len);
 void blk_SHA1_Final(unsigned char hashout[20], blk_SHA_CTX *ctx);
 
+/* Multi-buffer SHA1 (see sha1mb.cpp): hash count independent messages
+   at once, in SIMD lanes or with the SHA extensions, as the CPU allows. */
+void blk_SHA1_Multi(int count, const unsigned char* const* data,
+                    const size_t* lengths, unsigned char* const* hashout);
+/* Restrict the multi-buffer code to the named kernel ("avx512", "avx2",
+   "shani", "sse2", "scalar"), or the best ones if NULL; returns 0 if the
+   CPU cannot run it. Not to be called while anything is being hashed. */
+int blk_SHA1_SetKernel(const char* name);
+/* The kernel in use. */
+const char* blk_SHA1_Kernel(void);
+
 #endif
 
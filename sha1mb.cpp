@@ -0,0 +1,367 @@
+/*
+ *  sha1mb.cpp
+ *  multi-buffer SHA1: many independent messages hashed at once
+ *
+ *  Merkle trees are made of many small messages: chunks at the base,
+ *  40-byte pairs of hashes above. So, instead of speeding up one stream,
+ *  messages are hashed side by side, one per SIMD lane (4 with SSE2,
+ *  8 with AVX2, 16 with AVX-512); a message that has no company is hashed
+ *  with the SHA extensions, if any, or by the plain blk_SHA1 code.
+ *  The kernels are picked at runtime according to the CPU.
+ *
+ */
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <arpa/inet.h>
+#include <pthread.h>
+#endif
+#include <string.h>
+
+#include "sha1.h"
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#define SHA1_MB_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#define SHA1_MB_MAX_LANES 16
+
+static const unsigned int sha1_iv[5] =
+    { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0 };
+
+/* Processes blocks*64 bytes of each of the lanes' messages. */
+typedef void (*sha1_lanes_t) (unsigned int (*state)[SHA1_MB_MAX_LANES],
+                              const unsigned char* const* data, size_t blocks);
+/* Processes blocks*64 bytes of a single message. */
+typedef void (*sha1_single_t) (unsigned int state[5],
+                               const unsigned char* data, size_t blocks);
+
+
+static void sha1_single_scalar (unsigned int state[5],
+                                const unsigned char* data, size_t blocks)
+{
+    /* blk_SHA1_Update consumes whole blocks right away */
+    blk_SHA_CTX ctx;
+    memcpy(ctx.H,state,sizeof(ctx.H));
+    ctx.size = 0;
+    blk_SHA1_Update(&ctx,data,blocks*64);
+    memcpy(state,ctx.H,sizeof(ctx.H));
+}
+
+
+#ifdef SHA1_MB_X86
+
+typedef unsigned int v4u __attribute__ ((vector_size (16)));
+typedef unsigned int v8u __attribute__ ((vector_size (32)));
+typedef unsigned int v16u __attribute__ ((vector_size (64)));
+
+#define SHA1_MB_ROL(x,n) (((x)<<(n)) | ((x)>>(32-(n))))
+
+/* The lane-parallel kernel; inlined into per-ISA wrappers below, so
+   the compiler generates the vector code for each instruction set. */
+template<class V, int L>
+static inline __attribute__ ((always_inline))
+void sha1_lanes (unsigned int (*state)[SHA1_MB_MAX_LANES],
+                 const unsigned char* const* data, size_t blocks)
+{
+    V a, b, c, d, e, w[16];
+    for(int l=0; l<L; l++) {
+        a[l] = state[0][l];
+        b[l] = state[1][l];
+        c[l] = state[2][l];
+        d[l] = state[3][l];
+        e[l] = state[4][l];
+    }
+    for(size_t blk=0; blk<blocks; blk++) {
+        for(int t=0; t<16; t++)
+            for(int l=0; l<L; l++) {
+                unsigned int word;
+                memcpy(&word,data[l]+blk*64+t*4,4);
+                w[t][l] = ntohl(word);
+            }
+        V sa = a, sb = b, sc = c, sd = d, se = e;
+        for(int t=0; t<80; t++) {
+            if (t>=16)
+                w[t&15] = SHA1_MB_ROL( w[(t+13)&15] ^ w[(t+8)&15] ^
+                                       w[(t+2)&15] ^ w[t&15], 1 );
+            V f;
+            unsigned int k;
+            if (t<20) {
+                f = ((c^d)&b)^d;
+                k = 0x5a827999;
+            } else if (t<40) {
+                f = b^c^d;
+                k = 0x6ed9eba1;
+            } else if (t<60) {
+                f = (b&c)|(d&(b|c));
+                k = 0x8f1bbcdc;
+            } else {
+                f = b^c^d;
+                k = 0xca62c1d6;
+            }
+            V temp = SHA1_MB_ROL(a,5) + f + e + k + w[t&15];
+            e = d;
+            d = c;
+            c = SHA1_MB_ROL(b,30);
+            b = a;
+            a = temp;
+        }
+        a += sa;
+        b += sb;
+        c += sc;
+        d += sd;
+        e += se;
+    }
+    for(int l=0; l<L; l++) {
+        state[0][l] = a[l];
+        state[1][l] = b[l];
+        state[2][l] = c[l];
+        state[3][l] = d[l];
+        state[4][l] = e[l];
+    }
+}
+
+__attribute__ ((target ("sse2")))
+static void sha1_lanes_sse2 (unsigned int (*state)[SHA1_MB_MAX_LANES],
+                             const unsigned char* const* data, size_t blocks)
+{
+    sha1_lanes<v4u,4>(state,data,blocks);
+}
+
+__attribute__ ((target ("avx2")))
+static void sha1_lanes_avx2 (unsigned int (*state)[SHA1_MB_MAX_LANES],
+                             const unsigned char* const* data, size_t blocks)
+{
+    sha1_lanes<v8u,8>(state,data,blocks);
+}
+
+__attribute__ ((target ("avx512f")))
+static void sha1_lanes_avx512 (unsigned int (*state)[SHA1_MB_MAX_LANES],
+                               const unsigned char* const* data, size_t blocks)
+{
+    sha1_lanes<v16u,16>(state,data,blocks);
+}
+
+
+/* Four rounds with the SHA extensions; the message schedule for the
+   rounds to come is advanced as far as it is needed. */
+#define SHANI_ROUNDS(g, Ein, Eout, func) do { \
+    if ((g)==0) \
+        Ein = _mm_add_epi32(Ein, msg[0]); \
+    else \
+        Ein = _mm_sha1nexte_epu32(Ein, msg[(g)&3]); \
+    Eout = abcd; \
+    if ((g)>=3 && (g)<=18) \
+        msg[((g)+1)&3] = _mm_sha1msg2_epu32(msg[((g)+1)&3], msg[(g)&3]); \
+    abcd = _mm_sha1rnds4_epu32(abcd, Ein, func); \
+    if ((g)>=1 && (g)<=16) \
+        msg[((g)+3)&3] = _mm_sha1msg1_epu32(msg[((g)+3)&3], msg[(g)&3]); \
+    if ((g)>=2 && (g)<=17) \
+        msg[((g)+2)&3] = _mm_xor_si128(msg[((g)+2)&3], msg[(g)&3]); \
+} while (0)
+
+/* 20 rounds with the same function; the E registers take turns */
+#define SHANI_ROUNDS20(g, func, Ea, Eb) do { \
+    SHANI_ROUNDS((g), Ea, Eb, func); \
+    SHANI_ROUNDS((g)+1, Eb, Ea, func); \
+    SHANI_ROUNDS((g)+2, Ea, Eb, func); \
+    SHANI_ROUNDS((g)+3, Eb, Ea, func); \
+    SHANI_ROUNDS((g)+4, Ea, Eb, func); \
+} while (0)
+
+__attribute__ ((target ("sha,ssse3,sse4.1")))
+static void sha1_single_shani (unsigned int state[5],
+                               const unsigned char* data, size_t blocks)
+{
+    const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL,
+                                        0x08090a0b0c0d0e0fULL);
+    __m128i abcd = _mm_loadu_si128((const __m128i*) state);
+    __m128i e0 = _mm_set_epi32(state[4], 0, 0, 0), e1;
+    __m128i msg[4];
+    abcd = _mm_shuffle_epi32(abcd, 0x1B);
+    for(size_t blk=0; blk<blocks; blk++, data+=64) {
+        __m128i abcd_save = abcd, e0_save = e0;
+        for(int i=0; i<4; i++)
+            msg[i] = _mm_shuffle_epi8(
+                _mm_loadu_si128((const __m128i*)(data+i*16)), mask);
+        SHANI_ROUNDS20(0, 0, e0, e1);
+        SHANI_ROUNDS20(5, 1, e1, e0);
+        SHANI_ROUNDS20(10, 2, e0, e1);
+        SHANI_ROUNDS20(15, 3, e1, e0);
+        e0 = _mm_sha1nexte_epu32(e0, e0_save);
+        abcd = _mm_add_epi32(abcd, abcd_save);
+    }
+    abcd = _mm_shuffle_epi32(abcd, 0x1B);
+    _mm_storeu_si128((__m128i*) state, abcd);
+    state[4] = _mm_extract_epi32(e0, 3);
+}
+
+#endif // SHA1_MB_X86
+
+
+/* The kernels, best first. */
+static const struct {
+    const char*     name;
+    sha1_lanes_t    lanes;
+    int             lane_count;
+    sha1_single_t   single;
+} sha1_kernels[] = {
+#ifdef SHA1_MB_X86
+    { "avx512", sha1_lanes_avx512, 16, NULL },
+    { "avx2", sha1_lanes_avx2, 8, NULL },
+    { "shani", NULL, 1, sha1_single_shani },
+    { "sse2", sha1_lanes_sse2, 4, NULL },
+#endif
+    { "scalar", NULL, 1, sha1_single_scalar }
+};
+
+#define SHA1_KERNEL_COUNT ((int)(sizeof(sha1_kernels)/sizeof(sha1_kernels[0])))
+
+static int sha1_supported (const char* name)
+{
+#ifdef SHA1_MB_X86
+    unsigned int eax, ebx, ecx, edx;
+    if (!strcmp(name,"avx512"))
+        return __builtin_cpu_supports("avx512f");
+    if (!strcmp(name,"avx2"))
+        return __builtin_cpu_supports("avx2");
+    if (!strcmp(name,"sse2"))
+        return __builtin_cpu_supports("sse2");
+    if (!strcmp(name,"shani"))
+        return __get_cpuid_count(7,0,&eax,&ebx,&ecx,&edx) &&
+               (ebx & (1<<29)) && __builtin_cpu_supports("sse4.1");
+#endif
+    return !strcmp(name,"scalar");
+}
+
+static int sha1_lanes_kernel = -1, sha1_single_kernel = -1;
+
+int blk_SHA1_SetKernel(const char* name)
+{
+    int lanes = -1, single = -1;
+    for (int k=0; k<SHA1_KERNEL_COUNT; k++) {
+        if (name && strcmp(name,sha1_kernels[k].name))
+            continue;
+        if (!sha1_supported(sha1_kernels[k].name))
+            continue;
+        if (sha1_kernels[k].lanes && lanes==-1)
+            lanes = k;
+        if (sha1_kernels[k].single && single==-1)
+            single = k;
+    }
+    if (lanes==-1 && single==-1)
+        return 0;
+    if (single==-1) /* leftovers of a lanes-only kernel */
+        single = SHA1_KERNEL_COUNT-1;
+    sha1_lanes_kernel = lanes;
+    sha1_single_kernel = single;
+    return 1;
+}
+
+static void sha1_default_kernel (void)
+{
+    if (sha1_single_kernel==-1) /* unless set before the first hash */
+        blk_SHA1_SetKernel(NULL);
+}
+
+/* The best kernels are picked once, on the first use; hashing threads
+   (see HashTree::Submit) may make that use at the same time. */
+static void sha1_pick_kernel (void)
+{
+#ifdef _WIN32
+    sha1_default_kernel(); /* no hashing threads there */
+#else
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once,sha1_default_kernel);
+#endif
+}
+
+const char* blk_SHA1_Kernel(void)
+{
+    sha1_pick_kernel();
+    return sha1_lanes_kernel!=-1 ? sha1_kernels[sha1_lanes_kernel].name :
+                                   sha1_kernels[sha1_single_kernel].name;
+}
+
+
+/* The final one or two blocks: the tail of the message, padding, length. */
+static size_t sha1_tail (unsigned char tail[128], const unsigned char* data,
+                         size_t length)
+{
+    size_t rest = length & 63, blocks = rest<56 ? 1 : 2;
+    memset(tail,0,blocks*64);
+    memcpy(tail,data+length-rest,rest);
+    tail[rest] = 0x80;
+    unsigned long long bits = (unsigned long long)length << 3;
+    for (int i=0; i<8; i++)
+        tail[blocks*64-1-i] = (unsigned char)(bits >> (i*8));
+    return blocks;
+}
+
+static void sha1_out (unsigned char* hashout, const unsigned int* h, int stride)
+{
+    for (int i=0; i<5; i++) {
+        unsigned int be = htonl(h[i*stride]);
+        memcpy(hashout+i*4,&be,4);
+    }
+}
+
+static void sha1_one (const unsigned char* data, size_t length,
+                      unsigned char* hashout, sha1_single_t single)
+{
+    unsigned int state[5];
+    unsigned char tail[128];
+    memcpy(state,sha1_iv,sizeof(state));
+    single(state,data,length>>6);
+    single(state,tail,sha1_tail(tail,data,length));
+    sha1_out(hashout,state,1);
+}
+
+void blk_SHA1_Multi(int count, const unsigned char* const* data,
+                    const size_t* lengths, unsigned char* const* hashout)
+{
+    sha1_pick_kernel();
+    sha1_single_t single = sha1_kernels[sha1_single_kernel].single;
+    if (sha1_lanes_kernel==-1) {
+        for (int i=0; i<count; i++)
+            sha1_one(data[i],lengths[i],hashout[i],single);
+        return;
+    }
+    sha1_lanes_t lanes = sha1_kernels[sha1_lanes_kernel].lanes;
+    int lane_count = sha1_kernels[sha1_lanes_kernel].lane_count;
+    unsigned int state[5][SHA1_MB_MAX_LANES];
+    unsigned char tails[SHA1_MB_MAX_LANES][128];
+    const unsigned char* ptrs[SHA1_MB_MAX_LANES];
+    int i = 0;
+    while (i<count) {
+        /* lanes go in lockstep: messages must have as many blocks */
+        size_t full = lengths[i]>>6, tail = (lengths[i]&63)<56 ? 1 : 2;
+        int n = 1;
+        while ( n<lane_count && i+n<count && lengths[i+n]>>6==full &&
+                ((lengths[i+n]&63)<56 ? 1 : 2)==tail )
+            n++;
+        if (n==1 || n*4<=lane_count) {
+            /* too few to bother the lanes */
+            for (int j=0; j<n; j++)
+                sha1_one(data[i+j],lengths[i+j],hashout[i+j],single);
+            i += n;
+            continue;
+        }
+        for (int l=0; l<lane_count; l++) {
+            int m = i + (l<n ? l : 0); /* idle lanes redo the first one */
+            for (int s=0; s<5; s++)
+                state[s][l] = sha1_iv[s];
+            ptrs[l] = data[m];
+            sha1_tail(tails[l],data[m],lengths[m]);
+        }
+        lanes(state,ptrs,full);
+        for (int l=0; l<lane_count; l++)
+            ptrs[l] = tails[l];
+        lanes(state,ptrs,tail);
+        for (int j=0; j<n; j++)
+            sha1_out(hashout[i+j],&state[0][j],SHA1_MB_MAX_LANES);
+        i += n;
+    }
+}
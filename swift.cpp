@@ -30,6 +30,11 @@ int main (int argc, char** argv) {
         {"progress",no_argument, 0, 'p'},
         {"http",    optional_argument, 0, 'g'},
         {"wait",    optional_argument, 0, 'w'},
+        {"mmap",    no_argument, 0, 'm'},
+        {"chunk",   required_argument, 0, 'c'},
+        {"recheck", no_argument, 0, 'r'},
+        {"ack-delay",required_argument, 0, 'a'},
+        {"cc",      required_argument, 0, 'C'},
         {0, 0, 0, 0}
     };
 
@@ -40,11 +45,14 @@ int main (int argc, char** argv) {
     Address tracker;
     Address http_gw;
     tint wait_time = 0;
+    size_t chunk_size = SWIFT_DEFAULT_CHUNK_SIZE;
+    congestion_t congestion = LEDBAT_CONGESTION;
+    const char* congestion_names[] = {"ledbat", "aimd", "cubic", "bbr"};
     
     LibraryInit();
     
     int c;
-    while ( -1 != (c = getopt_long (argc, argv, ":h:f:dl:t:Dpg::w::", long_options, 0)) ) {
+    while ( -1 != (c = getopt_long (argc, argv, ":h:f:dl:t:Dpg::w::mc:ra:C:", long_options, 0)) ) {
         
         switch (c) {
             case 'h':
@@ -78,6 +86,33 @@ int main (int argc, char** argv) {
             case 'p':
                 report_progress = true;
                 break;
+            case 'm':
+                HashTree::MAP_DATA = true;
+                break;
+            case 'r':
+                HashTree::LAZY_RECHECK = true;
+                break;
+            case 'a': {
+                int ms;
+                if (sscanf(optarg,"%i",&ms)!=1 || ms<0)
+                    quit("ack delay is in milliseconds, e.g. 10\n");
+                Channel::ACK_DELAY = ms*TINT_MSEC;
+                break;
+            }
+            case 'C': {
+                int k = 0;
+                while (k<4 && strcmp(optarg,congestion_names[k]))
+                    k++;
+                if (k==4)
+                    quit("congestion control is one of ledbat, aimd, cubic, bbr\n");
+                congestion = (congestion_t)k;
+                break;
+            }
+            case 'c':
+                if (sscanf(optarg,"%zu",&chunk_size)!=1 || !chunk_size ||
+                        (chunk_size&(chunk_size-1)) || chunk_size>SWIFT_MAX_CHUNK_SIZE)
+                    quit("chunk size must be a power of 2, %i at most\n",SWIFT_MAX_CHUNK_SIZE);
+                break;
             case 'g':
                 http_gw = optarg ? Address(optarg) : Address(Address::LOCALHOST,8080);
                 if (wait_time==-1)
@@ -129,9 +164,10 @@ int main (int argc, char** argv) {
 
     int file = -1;
     if (filename) {
-        file = Open(filename,root_hash);
+        file = Open(filename,root_hash,chunk_size);
         if (file<=0)
             quit("cannot open file %s",filename);
+        UseCongestionControl(file,congestion);
         printf("Root hash: %s\n", RootMerkleHash(file).hex().c_str());
     }
 
@@ -145,6 +181,11 @@ int main (int argc, char** argv) {
         fprintf(stderr,"  -p, --progress\treport transfer progress\n");
         fprintf(stderr,"  -g, --http\t[ip:|host:]port to bind HTTP gateway to (default localhost:8080)\n");
         fprintf(stderr,"  -w, --wait\tlimit running time, e.g. 1[DHMs] (default: infinite with -l, -g)\n");
+        fprintf(stderr,"  -m, --mmap\tserve complete files from a memory mapping\n");
+        fprintf(stderr,"  -r, --recheck\tverify data restored from a checkpoint in the background\n");
+        fprintf(stderr,"  -a, --ack-delay\tdelay acks up to this many ms to send fewer of them (default: 0)\n");
+        fprintf(stderr,"  -c, --chunk\tchunk (packet) size in bytes, e.g. 4096 (default: 1024)\n");
+        fprintf(stderr,"  -C, --cc\tcongestion control: ledbat, aimd, cubic or bbr (default: ledbat)\n");
         return 1;
     }
 
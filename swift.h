@@ -105,6 +105,182 @@ namespace swift {
         }
     };
 
+    /** An indexed min-heap of tintbins, at most one entry per (small, non-
+        negative) number in the bin field. An entry is moved in place when
+        its time changes, so the heap never holds stale entries. */
+    class tbidxheap {
+        std::vector<tintbin> data_;
+        std::vector<int> pos_; // number -> index in data_, or -1
+        void place (int i, const tintbin& tb) {
+            data_[i] = tb;
+            pos_[(int)tb.bin] = i;
+        }
+        void sift_up (int i) {
+            tintbin tb = data_[i];
+            while (i>0 && tb.time<data_[(i-1)>>1].time) {
+                place(i,data_[(i-1)>>1]);
+                i = (i-1)>>1;
+            }
+            place(i,tb);
+        }
+        void sift_down (int i) {
+            tintbin tb = data_[i];
+            int n = data_.size();
+            while (2*i+1<n) {
+                int c = 2*i+1;
+                if (c+1<n && data_[c+1].time<data_[c].time)
+                    c++;
+                if (!(data_[c].time<tb.time))
+                    break;
+                place(i,data_[c]);
+                i = c;
+            }
+            place(i,tb);
+        }
+    public:
+        int size () const { return data_.size(); }
+        bool is_empty () const { return data_.empty(); }
+        bool contains (int num) const {
+            return num<pos_.size() && pos_[num]!=-1;
+        }
+        /** The time scheduled for num, TINT_NEVER if none. */
+        tint time (int num) const {
+            return contains(num) ? data_[pos_[num]].time : TINT_NEVER;
+        }
+        /** Schedule num at the given time, replacing its previous entry. */
+        void set (int num, tint time) {
+            if (num>=pos_.size())
+                pos_.resize(num+1,-1);
+            tintbin tb(time,bin64_t((uint64_t)num));
+            int i = pos_[num];
+            if (i==-1) {
+                data_.push_back(tb);
+                sift_up(data_.size()-1);
+            } else if (time<data_[i].time) {
+                data_[i] = tb;
+                sift_up(i);
+            } else {
+                data_[i] = tb;
+                sift_down(i);
+            }
+        }
+        void remove (int num) {
+            if (!contains(num))
+                return;
+            int i = pos_[num];
+            pos_[num] = -1;
+            tintbin last = data_.back();
+            data_.pop_back();
+            if (i==data_.size())
+                return;
+            place(i,last);
+            if (i>0 && last.time<data_[(i-1)>>1].time)
+                sift_up(i);
+            else
+                sift_down(i);
+        }
+        tintbin pop () {
+            tintbin ret = data_.front();
+            remove((int)ret.bin);
+            return ret;
+        }
+        const tintbin& peek () const {
+            return data_.front();
+        }
+    };
+
+    /** An open addressing multimap from peer addresses to channel ids
+        (linear probing, at most half full). Channel id 0 is never used,
+        so it marks empty slots. */
+    class addrindex {
+        struct slot_t {
+            uint32_t    ipv4;
+            uint16_t    port;
+            uint32_t    id;
+        };
+        std::vector<slot_t> slots_;
+        int         count_;
+        uint32_t    home (uint32_t ipv4, uint16_t port) const;
+    public:
+        addrindex () : slots_(16), count_(0) {}
+        int size () const { return count_; }
+        void add (const Address& addr, uint32_t id);
+        void remove (const Address& addr, uint32_t id);
+        /** Iterate channel ids for the address; start with pos=-1,
+            0 means there are no more. */
+        uint32_t next (const Address& addr, int& pos) const;
+    };
+
+    /** A ring buffer of tintbins, used as a deque: once the capacity (a
+        power of two) has grown to the window, nothing is allocated. The
+        entries are numbered in the order of push_back (seq), so an index
+        may refer to an entry while it stays in. */
+    class tbring {
+        tintbin*    data_;
+        uint32_t    mask_, head_, size_;
+        uint64_t    seq_; // of the front entry
+        void        grow ();
+        tbring (const tbring&);
+        tbring& operator = (const tbring&);
+    public:
+        tbring () : data_(new tintbin[16]), mask_(15), head_(0), size_(0),
+            seq_(0) {}
+        ~tbring () { delete [] data_; }
+        int size () const { return size_; }
+        bool empty () const { return !size_; }
+        tintbin& operator [] (int i) { return data_[(head_+i)&mask_]; }
+        const tintbin& operator [] (int i) const
+            { return data_[(head_+i)&mask_]; }
+        tintbin& front () { return data_[head_]; }
+        void push_back (const tintbin& tb) {
+            if (size_>mask_)
+                grow();
+            data_[(head_+size_++)&mask_] = tb;
+        }
+        void push_front (const tintbin& tb) {
+            if (size_>mask_)
+                grow();
+            head_ = (head_-1) & mask_;
+            size_++;
+            seq_--;
+            data_[head_] = tb;
+        }
+        void pop_front () {
+            head_ = (head_+1) & mask_;
+            size_--;
+            seq_++;
+        }
+        void pop_back () { size_--; }
+        uint64_t front_seq () const { return seq_; }
+        uint64_t back_seq () const { return seq_+size_-1; }
+        /** Position of the entry numbered seq, -1 if it is gone. */
+        int find (uint64_t seq) const
+            { return seq-seq_<size_ ? (int)(seq-seq_) : -1; }
+    };
+
+    /** An open addressing map from bins to numbers (linear probing, at
+        most half full), e.g. to the seq of an entry in a tbring. */
+    class binindex {
+        struct slot_t {
+            bin64_t     bin;
+            uint64_t    val;
+        };
+        std::vector<slot_t> slots_;
+        int         count_;
+        uint32_t    home (bin64_t bin) const {
+            uint64_t h = (uint64_t)bin * 0x9E3779B97F4A7C15ULL;
+            return (uint32_t)(h>>32) & (slots_.size()-1);
+        }
+    public:
+        binindex () : count_(0) { clear(); }
+        int size () const { return count_; }
+        void clear ();
+        /** The number for the bin, or def if there is none. */
+        uint64_t get (bin64_t bin, uint64_t def) const;
+        void set (bin64_t bin, uint64_t val);
+        void remove (bin64_t bin);
+    };
+
     /** swift protocol message types; these are used on the wire. */
     typedef enum {
         SWIFT_HANDSHAKE = 0,
@@ -114,17 +290,56 @@ namespace swift {
         SWIFT_HASH = 4,
         SWIFT_PEX_ADD = 5,
         SWIFT_PEX_RM = 6,
-        SWIFT_SIGNED_HASH = 7,
+        SWIFT_KEYED_HASH = 7, // the draft's signed peaks; an HMAC here
         SWIFT_HINT = 8,
         SWIFT_MSGTYPE_RCVD = 9,
-        SWIFT_MESSAGE_COUNT = 10
+        SWIFT_UNCLE_HASHES = 10,
+        SWIFT_MESSAGE_COUNT = 11
     } messageid_t;
 
+    /** Capabilities other than message types, announced along with those
+        in SWIFT_MSGTYPE_RCVD. */
+    typedef enum {
+        SWIFT_RANGE_ACK = 16    // an ACK may cover a range of bins
+    } capability_t;
+
     class PiecePicker;
     class CongestionController;
     class PeerSelector;
     typedef void (*ProgressCallback) (int transfer, bin64_t bin);
 
+    /** Congestion control strategies, see UseCongestionControl. */
+    typedef enum {
+        LEDBAT_CONGESTION = 0,
+        AIMD_CONGESTION = 1,
+        CUBIC_CONGESTION = 2,
+        BBR_CONGESTION = 3
+    } congestion_t;
+
+
+    /** The end-game of a transfer: once the picker has hinted every
+        missing chunk, channels ask their peers for the bins other peers
+        were asked for, so the last ones do not wait for the slowest
+        peer. A bin is asked for once more per round; rounds start again
+        every ROUND. */
+    class EndGame {
+        binmap_t    asked_;
+        tint        round_;
+    public:
+        EndGame () : round_(TINT_NEVER) {}
+        /** Whether channels go into the end-game at all. */
+        static bool ENABLED;
+        static tint ROUND;
+        /** A bin the peer offers, we have not got and did not ask for
+            yet in this round, nor asked this peer for (mine); NONE if
+            there is none. */
+        bin64_t     Pick (binmap_t& offer, binmap_t& have, const tbring& mine,
+                          uint64_t max_width);
+        /** The end-game is over once all we asked for has come. */
+        void        OnDataIn (binmap_t& have);
+        bool        active () const { return round_!=TINT_NEVER; }
+    };
+
 
     /** A class representing single file transfer. */
     class    FileTransfer {
@@ -134,8 +349,15 @@ namespace swift {
         /** A constructor. Open/submit/retrieve a file.
          *  @param file_name    the name of the file
          *  @param root_hash    the root hash of the file; zero hash if the file
-                                is newly submitted */
-        FileTransfer(const char *file_name, const Sha1Hash& root_hash=Sha1Hash::ZERO);
+                                is newly submitted
+         *  @param chunk_size   the size of a packet, a power of 2 */
+        FileTransfer(const char *file_name, const Sha1Hash& root_hash=Sha1Hash::ZERO,
+                     size_t chunk_size=SWIFT_DEFAULT_CHUNK_SIZE);
+        /** Open a live stream, see HashTree; the source appends to it
+            with LiveWrite. */
+        FileTransfer(const Sha1Hash& key, const char *file_name,
+                     size_t chunk_size=SWIFT_DEFAULT_CHUNK_SIZE,
+                     uint64_t window=SWIFT_DEFAULT_LIVE_WINDOW);
 
         /**    Close everything. */
         ~FileTransfer();
@@ -143,13 +365,24 @@ namespace swift {
 
         /** While we need to feed ACKs to every peer, we try (1) avoid
             unnecessary duplication and (2) keep minimum state. Thus,
-            we use a rotating queue of bin completion events. */
-        //bin64_t         RevealAck (uint64_t& offset);
+            we use a rotating queue of bin completion events. Returns the
+            next event from the offset on and moves the offset past it;
+            NONE if there are no new events, ALL if some were dropped. */
+        bin64_t         RevealAck (uint64_t& offset);
+        /** The offset of the next completion event. */
+        uint64_t        ack_log_end () const { return ack_log_.back_seq()+1; }
         /** Rotating queue read for channels of this transmission. */
         int             RevealChannel (int& i);
 
         /** Find transfer by the root hash. */
         static FileTransfer* Find (const Sha1Hash& hash);
+        /** Verify a slice of the data restored from checkpoints, if any;
+            returns false if there is nothing to verify. */
+        static bool     Recheck ();
+        /** Write out a checkpoint that is due, if any (fsync takes a
+            while, so not on the receive path, see OnDataIn); returns
+            false if there is none. */
+        static bool     Checkpoint ();
         /** Find transfer by the file descriptor. */
         static FileTransfer* file (int fd) {
             return fd<files.size() ? files[fd] : NULL;
@@ -159,6 +392,15 @@ namespace swift {
         binmap_t&           ack_out ()  { return file_.ack_out(); }
         /** Piece picking strategy used by this transfer. */
         PiecePicker&    picker () { return *picker_; }
+        /** Switch to another piece picking strategy (the transfer takes
+            ownership); it is told what every peer has. */
+        void            SetPicker (PiecePicker* picker);
+        /** Tell the picker what every peer of this transfer has. */
+        void            ReportAvailability ();
+        /** For the channels, once the picker has hinted everything. */
+        EndGame&        endgame () { return endgame_; }
+        /** The congestion control new channels of the transfer use. */
+        congestion_t    congestion () const { return congestion_; }
         /** The number of channels working for this transfer. */
         int             channel_count () const { return hs_in_.size(); }
         /** Hash tree checked file; all the hashes and data are kept here. */
@@ -168,24 +410,58 @@ namespace swift {
         /** Root SHA1 hash of the transfer (and the data file). */
         const Sha1Hash& root_hash () const { return file_.root_hash(); }
 
+        /** How often the progress is checkpointed, see HashTree. */
+        static tint     CHECKPOINT_INTERVAL;
+
     private:
 
         static std::vector<FileTransfer*> files;
+        /** The rest of the constructors. */
+        void            Init ();
+        /** Index of the transfers by root hash: open addressing with linear
+            probing, at most half full; empty slots have a NULL transfer. */
+        struct hashslot_t {
+            Sha1Hash        hash;
+            FileTransfer*   transfer;
+            hashslot_t() : transfer(NULL) {}
+        };
+        static std::vector<hashslot_t> hash_index;
+        static int      hash_index_count;
+        static void     IndexAdd (FileTransfer* trans);
+        static void     IndexRemove (FileTransfer* trans);
+        /** Drop the i-th entry of hs_in_, O(1): the front takes its
+            place, so a RevealChannel offset stays valid. */
+        void            RemoveChannel (int i);
+        /** The number of transfers with data to recheck. */
+        static int      rechecks;
+        /** The number of transfers with a checkpoint due. */
+        static int      checkpoints;
 
         HashTree        file_;
 
         /** Piece picker strategy. */
         PiecePicker*    picker_;
+        EndGame         endgame_;
+        congestion_t    congestion_;
+        /** Bins completed lately, in order, as covers; an entry taken
+            into a later cover is NONE. See RevealAck. */
+        tbring          ack_log_;
+        /** Cover -> seq of its ack_log_ entry. */
+        binindex        ack_log_idx_;
 
         /** Channels working for this transfer. */
         binqueue        hs_in_;
+        /** The same, by peer address. */
+        addrindex       peer_channels_;
         int             hs_in_offset_;
         std::deque<Address> pex_in_;
 
-        /** Messages we are accepting.    */
+        /** Messages and capabilities we are accepting. */
         uint64_t        cap_out_;
 
         tint            init_time_;
+        tint            checkpoint_time_;
+        bool            checkpoint_due_;
 
         #define SWFT_MAX_TRANSFER_CB 8
         ProgressCallback callbacks[SWFT_MAX_TRANSFER_CB];
@@ -195,17 +471,22 @@ namespace swift {
     public:
         void            OnDataIn (bin64_t pos);
         void            OnPexIn (const Address& addr);
+        /** Live streams: the window moved on, see TrimAckIn. */
+        void            OnWindowMoved ();
 
         friend class Channel;
         friend uint64_t  Size (int fdes);
         friend bool      IsComplete (int fdes);
         friend uint64_t  Complete (int fdes);
         friend uint64_t  SeqComplete (int fdes);
-        friend int     Open (const char* filename, const Sha1Hash& hash) ;
+        friend int     Open (const char* filename, const Sha1Hash& hash,
+                             size_t chunk_size) ;
         friend void    Close (int fd) ;
         friend void AddProgressCallback (int transfer,ProgressCallback cb,uint8_t agg);
         friend void RemoveProgressCallback (int transfer,ProgressCallback cb);
         friend void ExternallyRetrieved (int transfer,bin64_t piece);
+        friend int  LiveWrite (int transfer, const void* data, size_t length);
+        friend void UseCongestionControl (int transfer, congestion_t kind);
     };
 
 
@@ -219,13 +500,56 @@ namespace swift {
         /** The piece picking method itself.
          *  @param  offered     the daata acknowledged by the peer
          *  @param  max_width   maximum number of packets to ask for
-         *  @param  expires     (not used currently) when to consider request expired
+         *  @param  expires     when the peer is expected to deliver the data
          *  @return             the bin number to request */
         virtual bin64_t Pick (binmap_t& offered, uint64_t max_width, tint expires) = 0;
         virtual void LimitRange (bin64_t range) = 0;
+        /** Some peer got the bin (delta 1) or is gone with it (-1); for
+            the pickers that care how many peers have what. */
+        virtual void Available (bin64_t bin, int delta) {}
+        /** The player is at offset (bytes), playing bytes_per_sec; for
+            the pickers that care about deadlines. */
+        virtual void Playback (uint64_t offset, uint64_t bytes_per_sec) {}
+        /** Whether every chunk missing is hinted already; see EndGame. */
+        virtual bool AllHinted () { return false; }
         virtual ~PiecePicker() {}
     };
 
+    /** Piece picking strategies, see UsePiecePicker. */
+    typedef enum {
+        SEQUENTIAL_PICKER = 0,
+        RAREST_FIRST_PICKER = 1,
+        STREAMING_PICKER = 2
+    } picker_t;
+
+
+    /** CongestionController decides how much data a channel keeps in
+        flight (the window, in packets) and how far apart the packets go
+        out; the channel tells it of every ack and loss. The classic ones
+        (AIMD, LEDBAT) grow the window by a packet or so per round trip;
+        CUBIC and BBR are for fat long pipes. */
+    class CongestionController {
+    public:
+        /** Data starts going out, first time or after a pause. */
+        virtual void    Restart () = 0;
+        /** A data packet is going out now. */
+        virtual void    OnSend () {}
+        /** That many packets got acked, the latest of them sent at sent;
+            its round trip time and one-way delay (by the peer's clock). */
+        virtual void    OnAck (int acked, tint sent, tint rtt, tint owd) = 0;
+        /** A packet is lost (timed out or overtaken). */
+        virtual void    OnLoss () = 0;
+        /** The number of packets in flight allowed. */
+        virtual float   cwnd () const = 0;
+        /** The time between data packets; the window is spread over the
+            round trip time, unless the controller paces by itself. */
+        virtual tint    send_interval (tint rtt) const { return rtt/cwnd(); }
+        virtual ~CongestionController() {}
+    };
+
+    /** A new controller of the kind. */
+    CongestionController* NewCongestionController (congestion_t kind);
+
 
     class PeerSelector {
     public:
@@ -251,19 +575,23 @@ namespace swift {
     public:
         Channel    (FileTransfer* file, int socket=INVALID_SOCKET, Address peer=Address());
         ~Channel();
+        /** Channels are allocated from slabs, see channel.cpp */
+        static void* operator new (size_t size);
+        static void  operator delete (void* p, size_t size);
 
+        /** Data goes out under CWND_CONTROL, paced by the congestion
+            controller; the rest is keeping the channel alive. */
         typedef enum {
             KEEP_ALIVE_CONTROL,
             PING_PONG_CONTROL,
-            SLOW_START_CONTROL,
-            AIMD_CONTROL,
-            LEDBAT_CONTROL,
+            CWND_CONTROL,
             CLOSE_CONTROL
         } send_control_t;
 
         static const char* SEND_CONTROL_MODES[];
 
         static void RecvDatagram (SOCKET socket);
+        static void DispatchDatagram (Datagram& dgram);
         static void Loop (tint till);
 
         void        Recv (Datagram& dgram);
@@ -276,25 +604,48 @@ namespace swift {
         void        OnHint (Datagram& dgram);
         void        OnHash (Datagram& dgram);
         void        OnPex (Datagram& dgram);
+        void        OnUncleHashes (Datagram& dgram);
+        void        OnKeyedHash (Datagram& dgram);
+        /** The peer has pos; the picker is told of the part that is new. */
+        void        AckIn (bin64_t pos);
+        /** Tell the picker the peer has (1) or no longer has (-1) all
+            of ack_in_. */
+        void        ReportAckIn (int delta);
+        /** Live streams: forget what the peer has before the window. */
+        void        TrimAckIn ();
+        void        OnMsgTypeRcvd (Datagram& dgram);
         void        OnHandshake (Datagram& dgram);
         void        AddHandshake (Datagram& dgram);
         bin64_t     AddData (Datagram& dgram);
         void        AddAck (Datagram& dgram);
         void        AddHave (Datagram& dgram);
+        /** Start announcing all we have, as for a new peer. */
+        void        ResetHave ();
+        /** The next bin we have, left to right, in the rest of the range. */
+        bin64_t     WalkHave ();
         void        AddHint (Datagram& dgram);
+        /** Forget the hints for data we got elsewhere. */
+        void        CancelHints ();
         void        AddUncleHashes (Datagram& dgram, bin64_t pos);
         void        AddPeakHashes (Datagram& dgram);
+        /** Live streams: the keyed peaks, whenever they change. */
+        void        AddKeyedPeaks (Datagram& dgram);
         void        AddPex (Datagram& dgram);
+        void        AddMsgTypeRcvd (Datagram& dgram);
 
-        void        BackOffOnLosses (float ratio=0.5);
         tint        SwitchSendControl (int control_mode);
         tint        NextSendTime ();
         tint        KeepAliveNextSendTime ();
         tint        PingPongNextSendTime ();
         tint        CwndRateNextSendTime ();
-        tint        SlowStartNextSendTime ();
-        tint        AimdNextSendTime ();
-        tint        LedbatNextSendTime ();
+        tint        AckDueTime ();
+        /** Switch to another congestion controller (the channel takes
+            ownership). */
+        void        SetCongestionController (CongestionController* cc);
+        /** The number of packets in flight allowed. */
+        float       cwnd () const {
+            return send_control_==CWND_CONTROL ? controller_->cwnd() : 1;
+        }
 
         static int  MAX_REORDERING;
         static tint TIMEOUT;
@@ -305,9 +656,21 @@ namespace swift {
         static tint LEDBAT_DELAY_BIN;
         static bool SELF_CONN_OK;
         static tint MAX_POSSIBLE_RTT;
+        /** Delayed acks: data is acked within ACK_DELAY or once
+            ACK_DELAY_PACKETS are pending, adjacent bins in one range ACK
+            if the peer takes those; 0 acks every datagram right away. */
+        static tint ACK_DELAY;
+        static int  ACK_DELAY_PACKETS;
+        /** Data goes out by the pacing schedule; a packet sent late (the
+            poller wakes up a millisecond late at worst) is made up for by
+            the ones after it, for PACING_SLACK at most. */
+        static tint PACING_SLACK;
         static FILE* debug_file;
 
         const std::string id_string () const;
+        /** There is news for the peer; send now, not at the next
+            keep-alive. */
+        void        Nudge ();
         /** A channel is "established" if had already sent and received packets. */
         bool        is_established () { return peer_channel_id_ && own_id_mentioned_; }
         FileTransfer& transfer() { return *transfer_; }
@@ -323,12 +686,17 @@ namespace swift {
         static int  DecodeID(int scrambled);
         static int  EncodeID(int unscrambled);
         static Channel* channel(int i) {
-            return i<channels.size()?channels[i]:NULL;
+            return i<channels.size()?channels[i].channel:NULL;
         }
+        /** A channel of the transfer to the address. */
+        static Channel* Find (const Address& addr, FileTransfer* trans);
+        /** Bits of a channel id that index the channel table; the rest
+            is the generation of the table slot. */
+        static const int ID_BITS = 20;
         static void CloseTransfer (FileTransfer* trans);
 
     protected:
-        /** Channel id: index in the channel array. */
+        /** Channel id: index in the channel table. */
         uint32_t    id_;
         /**    Socket address of the peer. */
         Address     peer_;
@@ -336,6 +704,8 @@ namespace swift {
         SOCKET      socket_;
         /**    Descriptor of the file in question. */
         FileTransfer*    transfer_;
+        /** Where the channel is in transfer_->hs_in_, plus hs_in_offset_. */
+        int         hs_in_pos_;
         /**    Peer channel id; zero if we are trying to open a channel. */
         uint32_t    peer_channel_id_;
         bool        own_id_mentioned_;
@@ -344,19 +714,41 @@ namespace swift {
         /**    Last data received; needs to be acked immediately. */
         tintbin     data_in_;
         bin64_t     data_in_dbl_;
+        /** All data received and not acked yet, in the order of arrival. */
+        tbring      data_in_queue_;
         /** The history of data sent and still unacknowledged. */
-        tbqueue     data_out_;
+        tbring      data_out_;
+        /** Bin -> seq of its data_out_ entry, to match acks; the
+            latest one, if the bin was sent again. */
+        binindex    data_out_idx_;
+        /** The number of data_out_ entries the index does not point at. */
+        int         data_out_dups_;
         /** Timeouted data (potentially to be retransmitted). */
-        tbqueue     data_out_tmo_;
-        bin64_t     data_out_cap_;
-        /** Index in the history array. */
+        tbring      data_out_tmo_;
+        /** Bin -> the number of its data_out_tmo_ entries. */
+        binindex    data_out_tmo_idx_;
+        /** Data sent along with the hashes to check it, and not lost so
+            far: the peer has, or is about to have, the hashes on the way
+            from these bins up to the peaks. */
+        binmap_t    hashes_out_;
+        /** Live streams: the size (in chunks) the peer was last told
+            of in keyed peaks, and when. */
+        uint64_t    peaks_out_;
+        tint        peaks_out_time_;
+        /** The peer offered data we lack; a hint is due. */
+        bool        hint_due_;
+        /** Everything the peer was told we have. */
         binmap_t        have_out_;
+        /** The next completion event to announce, see RevealAck. */
+        uint64_t        have_seq_;
+        /** Announcing all we have: the rest of the range to look at. */
+        uint64_t        have_walk_, have_walk_end_;
         /**    Transmit schedule: in most cases filled with the peer's hints */
-        tbqueue     hint_in_;
+        tbring      hint_in_;
         /** Hints sent (to detect and reschedule ignored hints). */
-        tbqueue     hint_out_;
+        tbring      hint_out_;
         uint64_t    hint_out_size_;
-        /** Types of messages the peer accepts. */
+        /** Types of messages (and capabilities) the peer accepts. */
         uint64_t    cap_in_;
         /** For repeats. */
         //tint        last_send_time, last_recv_time;
@@ -368,13 +760,12 @@ namespace swift {
         tint        last_recv_time_;
         tint        last_data_out_time_;
         tint        last_data_in_time_;
-        tint        last_loss_time_;
         tint        next_send_time_;
-        /** Congestion window; TODO: int, bytes. */
-        float       cwnd_;
+        /** Sets the window and the pacing, see CongestionController. */
+        CongestionController* controller_;
         /** Data sending interval. */
         tint        send_interval_;
-        /** The congestion control strategy. */
+        /** The send control mode, see send_control_t. */
         int         send_control_;
         /** Datagrams (not data) sent since last recv.    */
         int         sent_since_recv_;
@@ -382,23 +773,28 @@ namespace swift {
         int         ack_rcvd_recent_;
         /** Recent non-acknowlegements (losses) of data previously sent.    */
         int         ack_not_rcvd_recent_;
-        /** LEDBAT one-way delay machinery */
-        tint        owd_min_bins_[4];
-        int         owd_min_bin_;
-        tint        owd_min_bin_start_;
-        tint        owd_current_[4];
-        int         owd_cur_bin_;
         /** Stats */
         int         dgrams_sent_;
         int         dgrams_rcvd_;
 
         int         PeerBPS() const {
-            return TINT_SEC / dip_avg_ * 1024;
+            return TINT_SEC / dip_avg_ * transfer_->file().chunk_size();
         }
         /** Get a request for one packet from the queue of peer's requests. */
         bin64_t     DequeueHint();
         bin64_t     ImposeHint();
         void        TimeoutDataOut ();
+        void        PushDataOut (bin64_t pos);
+        void        PopDataOut ();
+        void        ClearDataOut (int i);
+        void        PushDataOutTmo (bin64_t pos);
+        void        PopDataOutTmo ();
+        /** The position of the latest data_out_ entry within the bin, -1
+            if none. */
+        int         FindDataOut (bin64_t pos);
+        /** Clear all data_out_ entries within the bin; returns how many. */
+        int         AckDataOut (bin64_t pos);
+        bool        IsRetransmit (bin64_t pos);
         void        CleanStaleHintOut();
         void        CleanHintOut(bin64_t pos);
         void        Reschedule();
@@ -406,16 +802,30 @@ namespace swift {
         static PeerSelector* peer_selector;
 
         static tint     last_tick;
-        static tbheap   send_queue;
+        /** Send times, exactly one entry per channel. */
+        static tbidxheap send_queue;
 
         static Address  tracker;
-        static std::vector<Channel*> channels;
+        /** An entry of the channel table. A slot is reused once its
+            channel is closed, so the generation is part of the id
+            sent to the peer; free slots are chained by next_free. */
+        struct slot_t {
+            Channel*    channel;
+            uint32_t    generation;
+            uint32_t    next_free;
+            slot_t() : channel(NULL), generation(0), next_free(0) {}
+        };
+        static std::vector<slot_t> channels;
+        static uint32_t free_head, free_tail;
 
         friend int      Listen (Address addr);
         friend void     Shutdown (int sock_des);
         friend void     AddPeer (Address address, const Sha1Hash& root);
         friend void     SetTracker(const Address& tracker);
-        friend int      Open (const char*, const Sha1Hash&) ; // FIXME
+        friend class    FileTransfer;
+        friend int      Open (const char*, const Sha1Hash&, size_t) ; // FIXME
+        friend int      OpenLive (const char*, const Sha1Hash&, size_t,
+                                  uint64_t) ;
 
     };
 
@@ -431,8 +841,24 @@ namespace swift {
     void    Shutdown (int sock_des=-1);
 
     /** Open a file, start a transmission; fill it with content for a given root hash;
-        in case the hash is omitted, the file is a fresh submit. */
-    int     Open (const char* filename, const Sha1Hash& hash=Sha1Hash::ZERO) ;
+        in case the hash is omitted, the file is a fresh submit. All peers must
+        use the same chunk size for the same root hash. */
+    int     Open (const char* filename, const Sha1Hash& hash=Sha1Hash::ZERO,
+                  size_t chunk_size=SWIFT_DEFAULT_CHUNK_SIZE) ;
+    /** Open a live stream: its source appends to it with LiveWrite, the
+        other peers retrieve it as it goes. Peak hashes carry an HMAC
+        under the key, which every peer has; the stream is identified by
+        the hash of the key (see RootMerkleHash). As any peer with the
+        key can forge peaks, this is a mode for trusted peers only; it
+        is no signature. Only the last window chunks are kept, on disk
+        and in memory; all peers must use the same window. */
+    int     OpenLive (const char* filename, const Sha1Hash& key,
+                      size_t chunk_size=SWIFT_DEFAULT_CHUNK_SIZE,
+                      uint64_t window=SWIFT_DEFAULT_LIVE_WINDOW) ;
+    /** Append data to a live stream we are the source of; full chunks
+        are announced to the peers right away, the rest waits for more.
+        Returns the number of chunks added. */
+    int     LiveWrite (int transfer, const void* data, size_t length) ;
     /** Get the root hash for the transmission. */
     const Sha1Hash& RootMerkleHash (int file) ;
     /** Close a file and a transmission. */
@@ -444,9 +870,11 @@ namespace swift {
 
     void    SetTracker(const Address& tracker);
 
-    /** Returns size of the file in bytes, 0 if unknown. Might be rounded up to a kilobyte
+    /** Returns size of the file in bytes, 0 if unknown. Might be rounded up to a chunk
         before the transmission is complete. */
     uint64_t  Size (int fdes);
+    /** Returns the size of a chunk (packet) of the transmission in bytes. */
+    size_t    ChunkSize (int fdes);
     /** Returns the amount of retrieved and verified data, in bytes.
         A 100% complete transmission has Size()==Complete(). */
     uint64_t  Complete (int fdes);
@@ -460,6 +888,14 @@ namespace swift {
     void AddProgressCallback (int transfer,ProgressCallback cb,uint8_t agg);
     void RemoveProgressCallback (int transfer,ProgressCallback cb);
     void ExternallyRetrieved (int transfer,bin64_t piece);
+    /** Choose the piece picking strategy for the transfer. */
+    void UsePiecePicker (int transfer, picker_t picker);
+    /** Choose the congestion control for the channels of the transfer,
+        the current ones included. */
+    void UseCongestionControl (int transfer, congestion_t kind);
+    /** Tell the picker where playback is and how fast it goes; see
+        STREAMING_PICKER. */
+    void Playback (int transfer, uint64_t offset, uint64_t bytes_per_sec);
 
     //uint32_t Width (const tbinvec& v);
 
@@ -0,0 +1,108 @@
+/*
+ *  binsbench.cpp
+ *  binmap operations on random, sparse and nearly full maps
+ *
+ *  Copyright 2009 Delft University of Technology. All rights reserved.
+ *
+ */
+#include <gtest/gtest.h>
+#include "bins.h"
+#include "compat.h"
+
+using namespace swift;
+
+
+/** Random: every base bin of a 2^16 range is filled with p=0.5;
+    sparse: 256 filled bins in 2^20; full: 2^20 with 256 holes. */
+void make_map (binmap_t& map, const char* kind, unsigned seed) {
+    srand(seed);
+    if (!strcmp(kind,"random")) {
+        for(int i=0; i<(1<<16); i++)
+            if (rand()&1)
+                map.set(bin64_t(0,i));
+    } else if (!strcmp(kind,"sparse")) {
+        for(int i=0; i<256; i++)
+            map.set(bin64_t(0,rand()%(1<<20)));
+    } else {
+        map.set(bin64_t(20,0));
+        for(int i=0; i<256; i++)
+            map.set(bin64_t(0,rand()%(1<<20)),binmap_t::EMPTY);
+    }
+}
+
+
+void report (const char* kind, const char* op, int count, tint took) {
+    printf("%s\t%s\t%lli ops/s\n",kind,op,
+           took ? (long long)count*TINT_SEC/took : 0LL);
+}
+
+
+const char* kinds[] = {"random","sparse","full"};
+
+
+/** Looking for data a peer has not got, as in HAVE/ACK and picking. */
+TEST(BinsBench,FindFiltered) {
+    for(int k=0; k<3; k++) {
+        binmap_t data, filter;
+        make_map(data,kinds[k],1);
+        make_map(filter,kinds[k],1);
+        filter.set(bin64_t(0,(1<<16)-3),binmap_t::EMPTY);
+        data.set(bin64_t(0,(1<<16)-3));
+        const int count = 10000;
+        bin64_t found;
+        tint start = usec_time();
+        for(int i=0; i<count; i++)
+            found = data.find_filtered(filter,bin64_t::ALL,binmap_t::FILLED);
+        report(kinds[k],"find_filtered (one diff)",count,usec_time()-start);
+        EXPECT_EQ(bin64_t(0,(1<<16)-3),found);
+        binmap_t other;
+        make_map(other,kinds[k],2);
+        start = usec_time();
+        for(int i=0; i<count; i++)
+            found = other.find_filtered(data,bin64_t::ALL,binmap_t::FILLED);
+        report(kinds[k],"find_filtered (other map)",count,usec_time()-start);
+        if (found!=bin64_t::NONE) {
+            EXPECT_TRUE(other.is_filled(found));
+            EXPECT_TRUE(data.is_empty(found));
+        }
+    }
+}
+
+
+/** Copying progress into the picker's map, whole or a bin at a time. */
+TEST(BinsBench,RangeOp) {
+    for(int k=0; k<3; k++) {
+        binmap_t data, mask;
+        make_map(data,kinds[k],1);
+        make_map(mask,kinds[k],2);
+        const int count = 1000;
+        tint start = usec_time();
+        for(int i=0; i<count; i++)
+            data.range_copy(mask,bin64_t::ALL);
+        report(kinds[k],"range_copy (all)",count,usec_time()-start);
+        EXPECT_EQ(mask.mass(),data.mass());
+        start = usec_time();
+        for(int i=0; i<count*10; i++)
+            data.range_copy(mask,bin64_t(10,i&63));
+        report(kinds[k],"range_copy (2^10)",count*10,usec_time()-start);
+        binmap_t orred;
+        make_map(orred,kinds[k],1);
+        start = usec_time();
+        for(int i=0; i<count; i++)
+            orred.range_or(mask,bin64_t::ALL);
+        report(kinds[k],"range_or (all)",count,usec_time()-start);
+        EXPECT_TRUE(orred.mass()>=mask.mass());
+        start = usec_time();
+        for(int i=0; i<count; i++)
+            orred.remove(mask);
+        report(kinds[k],"remove",count,usec_time()-start);
+        orred.range_and(mask,bin64_t::ALL);
+        EXPECT_EQ(0,orred.mass());
+    }
+}
+
+
+int main (int argc, char** argv) {
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -8,6 +8,7 @@
  */
 #include <time.h>
 #include <set>
+#include <vector>
 #include <gtest/gtest.h>
 #include "bins.h"
 
@@ -507,6 +508,150 @@ TEST(BinsTest,Performance) {
 	printf("bins: %f (%i), set: %f (%i)\n",b_time,b_size,s_time,s_size);
 }*/
 
+/** Random sets and clears, bins of up to 2^8 in a 2^12 range. */
+void random_ops (binmap_t& a, binmap_t& b, int count) {
+    for(int i=0; i<count; i++) {
+        int layer = rand()%9;
+        bin64_t bin(layer,rand()%(1<<(12-layer)));
+        binmap_t::fill_t val = rand()%3 ? binmap_t::FILLED : binmap_t::EMPTY;
+        a.set(bin,val);
+        b.set(bin,val);
+    }
+}
+
+void expect_same (binmap_t& a, binmap_t& b) {
+    for(int i=0; i<(1<<13); i++)
+        ASSERT_EQ(a.get(bin64_t(0,i)),b.get(bin64_t(0,i)));
+    for(int layer=1; layer<14; layer++)
+        for(int i=0; i<(1<<(13-layer)); i++)
+            ASSERT_EQ(a.is_empty(bin64_t(layer,i)),b.is_empty(bin64_t(layer,i)));
+    EXPECT_EQ(a.mass(),b.mass());
+    int ca, cb;
+    uint64_t *sa = a.get_stripes(ca), *sb = b.get_stripes(cb);
+    ASSERT_EQ(ca,cb);
+    for(int i=0; i<ca; i++)
+        EXPECT_EQ(sa[i],sb[i]);
+    free(sa);
+    free(sb);
+}
+
+TEST(BinsTest,SerializeRoundTrip) {
+    srand(20091006);
+    std::vector<uint8_t> buf, rebuf;
+    for(int round=0; round<100; round++) {
+        binmap_t orig, copy, shadow;
+        random_ops(orig,shadow,rand()%(round*4+1));
+        if (round%5==4) {
+            uint64_t mask = rand() & 0x7ff;
+            orig.twist(mask);
+            shadow.twist(mask);
+        }
+        buf.resize(orig.serialize(NULL,0));
+        ASSERT_EQ(buf.size(),orig.serialize(&buf[0],buf.size()));
+        ASSERT_TRUE(copy.deserialize(&buf[0],buf.size()));
+        EXPECT_EQ(orig.size(),copy.size());
+        rebuf.resize(copy.serialize(NULL,0));
+        copy.serialize(&rebuf[0],rebuf.size());
+        EXPECT_TRUE(buf==rebuf);
+        expect_same(orig,copy);
+        // the loaded one must keep working, cells allocated and freed
+        random_ops(copy,shadow,200);
+        expect_same(shadow,copy);
+    }
+}
+
+TEST(BinsTest,SerializeMalformed) {
+    srand(20091007);
+    binmap_t orig, shadow;
+    random_ops(orig,shadow,300);
+    std::vector<uint8_t> buf(orig.serialize(NULL,0));
+    orig.serialize(&buf[0],buf.size());
+    for(size_t len=0; len<buf.size(); len++) {
+        binmap_t b;
+        b.set(bin64_t(3,1));
+        EXPECT_FALSE(b.deserialize(&buf[0],len));
+        EXPECT_EQ(8,b.mass()); // intact
+    }
+    for(int i=0; i<2000; i++) { // garbage must not take it down
+        std::vector<uint8_t> bad(buf);
+        bad[rand()%bad.size()] ^= 1<<(rand()%8);
+        binmap_t b;
+        if (b.deserialize(&bad[0],bad.size())) {
+            b.mass();
+            b.set(bin64_t(5,rand()%100));
+            b.find(bin64_t(12,0));
+        }
+    }
+}
+
+
+/** Range ops and filtered search must agree with a plain bitmap. */
+TEST(BinsTest,RangeOpRandom) {
+    srand(20091008);
+    for(int round=0; round<100; round++) {
+        binmap_t a, b, junk;
+        random_ops(a,junk,rand()%300);
+        random_ops(b,junk,rand()%300);
+        uint64_t twist = round%3 ? 0 : rand() & 0x3ff;
+        int layer = rand()%14;
+        bin64_t range(layer,rand()%(1<<(13-layer)));
+        bool before[1<<13], mask[1<<13];
+        for(int i=0; i<(1<<13); i++) {
+            before[i] = a.get(bin64_t(0,i))==binmap_t::FILLED;
+            mask[i] = b.get(bin64_t(0,i))==binmap_t::FILLED;
+        }
+        for(int seek=0; seek<2; seek++) {
+            binmap_t::fill_t val = seek ? binmap_t::FILLED : binmap_t::EMPTY;
+            a.twist(twist);
+            b.twist(twist);
+            bin64_t found = a.find_filtered(b,range,val);
+            a.twist(0);
+            b.twist(0);
+            if (found!=bin64_t::NONE)
+                found = found.twisted(twist);
+            bin64_t region = range.twisted(twist);
+            int first = -1;
+            for(uint64_t i=region.base_offset(); first<0 && i<region.base_offset()+region.width(); i++)
+                if (before[i]==(bool)seek && !mask[i])
+                    first = i;
+            EXPECT_EQ(first<0,found==bin64_t::NONE);
+            if (found!=bin64_t::NONE)
+                EXPECT_TRUE(found.within(region));
+            if (!twist && first>=0)
+                EXPECT_EQ(first,found.base_offset());
+            if (found!=bin64_t::NONE) {
+                EXPECT_EQ(val,a.get(found));
+                EXPECT_TRUE(b.is_empty(found));
+            }
+        }
+        binmap_t::bin_op_t op = (binmap_t::bin_op_t) (rand()%4);
+        a.range_op(b,range,op);
+        // stays compact: no joinable cells are left, see the format
+        std::vector<uint8_t> buf(a.serialize(NULL,0));
+        a.serialize(&buf[0],buf.size());
+        uint32_t cells = buf[16]<<24 | buf[17]<<16 | buf[18]<<8 | buf[19];
+        const uint8_t *vals = &buf[20], *flags = vals + cells*4;
+        for(uint32_t c=1; c<cells; c++) {
+            if ( (flags[c/4]>>(c%4*2)) & 3 )
+                continue; // deep
+            uint32_t cell = vals[c*4]<<8 | vals[c*4+1] | vals[c*4+2]<<24 | vals[c*4+3]<<16;
+            EXPECT_NE(0,(cell^(cell>>1))&0x55555555) << "joinable cell " << c;
+        }
+        for(int i=0; i<(1<<13); i++) {
+            bool want = before[i];
+            if (bin64_t(0,i).within(range))
+                switch (op) {
+                    case binmap_t::OR_OP:     want = before[i] || mask[i]; break;
+                    case binmap_t::AND_OP:    want = before[i] && mask[i]; break;
+                    case binmap_t::REMOVE_OP: want = before[i] && !mask[i]; break;
+                    case binmap_t::COPY_OP:   want = mask[i]; break;
+                }
+            ASSERT_EQ(want,a.get(bin64_t(0,i))==binmap_t::FILLED);
+        }
+    }
+}
+
+
 int main (int argc, char** argv) {
 	testing::InitGoogleTest(&argc, argv);
 	return RUN_ALL_TESTS();
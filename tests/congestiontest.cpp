@@ -0,0 +1,175 @@
+/*
+ *  congestiontest.cpp
+ *  congestion controllers over a simulated bottleneck
+ *
+ *  Copyright 2009 Delft University of Technology. All rights reserved.
+ *
+ */
+#include <gtest/gtest.h>
+#include <queue>
+#include "swift.h"
+
+using namespace swift;
+
+
+const int CHUNK = 8192;
+const char* NAMES[] = {"ledbat", "aimd", "cubic", "bbr"};
+
+
+struct link_t {
+    double      mbit;
+    tint        rtt;
+    double      loss;
+};
+
+
+struct result_t {
+    double      mbit, lost;
+    tint        queueing;
+};
+
+
+/** An ack (or the news of a loss) coming back to the sender. */
+struct event_t {
+    tint        time, sent, owd;
+    bool        lost;
+    bool operator < (const event_t& b) const { return time>b.time; }
+};
+
+
+/** One channel sending CHUNK packets over a link of the rate and the
+    round trip time, with a drop-tail queue of one bandwidth-delay
+    product (16 packets at least) and random losses on top. It sends as
+    Channel::CwndRateNextSendTime does: while fewer than cwnd packets are
+    in flight, one per send_interval of the smoothed round trip time. A
+    loss is found out about a round trip after the packet went out, as
+    the packets behind it get acked. NOW is the simulated clock. */
+result_t Simulate (congestion_t kind, const link_t& link, tint duration) {
+    srand(1);
+    tint now = NOW;
+    CongestionController* cc = NewCongestionController(kind);
+    cc->Restart();
+    double pkt_time = CHUNK*8/link.mbit; // usec
+    int queue_max = std::max(16,(int)(link.rtt/pkt_time));
+    std::priority_queue<event_t> events;
+    double link_free = NOW, queued = 0;
+    tint end = NOW + duration, last_send = 0, rtt_avg = TINT_SEC;
+    int inflight = 0;
+    uint64_t sent = 0, acked = 0, lost = 0;
+    while (NOW<end) {
+        tint next_send = TINT_NEVER;
+        if (inflight<cc->cwnd())
+            next_send = std::max(NOW,last_send+cc->send_interval(rtt_avg));
+        if (!events.empty() && events.top().time<=next_send) {
+            event_t ev = events.top();
+            events.pop();
+            NOW = ev.time;
+            inflight--;
+            if (ev.lost) {
+                lost++;
+                cc->OnLoss();
+            } else {
+                acked++;
+                tint rtt = NOW - ev.sent;
+                rtt_avg = (rtt_avg*7 + rtt) >> 3;
+                cc->OnAck(1,ev.sent,rtt,ev.owd);
+            }
+            continue;
+        }
+        NOW = last_send = next_send;
+        sent++;
+        inflight++;
+        cc->OnSend();
+        double start = std::max((double)NOW,link_free);
+        event_t ev = {0,NOW,0,false};
+        if ((start-NOW)/pkt_time>=queue_max) { // tail drop
+            ev.lost = true;
+            ev.time = NOW + link.rtt + (tint)(queue_max*pkt_time);
+        } else {
+            queued += start - NOW;
+            link_free = start + pkt_time;
+            ev.lost = rand() < link.loss*RAND_MAX;
+            ev.time = (tint)link_free + link.rtt;
+            ev.owd = (tint)link_free + link.rtt/2 - NOW;
+        }
+        events.push(ev);
+    }
+    delete cc;
+    NOW = now;
+    result_t ret;
+    ret.mbit = (double)acked*CHUNK*8/duration;
+    ret.lost = sent ? (double)lost/sent : 0;
+    ret.queueing = sent ? (tint)(queued/sent) : 0;
+    return ret;
+}
+
+
+/** Set from the command line: rtt_ms loss_percent mbit [seconds]. */
+link_t custom = {0, 0, 0};
+tint custom_duration = 10*TINT_SEC;
+
+
+void Report (const link_t& link, result_t* res) {
+    printf("%.0f Mbit/s, rtt %lli ms, loss %g%%:\n",link.mbit,
+           link.rtt/TINT_MSEC,link.loss*100);
+    for(int k=0; k<4; k++)
+        printf("  %-6s %8.1f Mbit/s (%3.0f%%) lost %.3f%% queueing %lli us\n",
+               NAMES[k],res[k].mbit,res[k].mbit*100/link.mbit,
+               res[k].lost*100,res[k].queueing);
+}
+
+
+TEST(CongestionTest,Custom) {
+    if (!custom.mbit)
+        return;
+    result_t res[4];
+    for(int k=0; k<4; k++)
+        res[k] = Simulate((congestion_t)k,custom,custom_duration);
+    Report(custom,res);
+}
+
+
+/** On a fat long pipe LEDBAT leaves slow start at once and grows by a
+    packet or so per round trip; AIMD (Reno) and CUBIC fill a clean one,
+    but random losses keep them far below the rate, Reno more so. BBR
+    does not take random losses for congestion. */
+TEST(CongestionTest,FatPipes) {
+    if (custom.mbit)
+        return;
+    link_t links[] = {
+        {100, 20*TINT_MSEC, 0},
+        {1000, 50*TINT_MSEC, 0},
+        {10000, 100*TINT_MSEC, 0},
+        {10000, 100*TINT_MSEC, 0.0001},
+        {1000, 150*TINT_MSEC, 0.001},
+    };
+    for(int l=0; l<sizeof(links)/sizeof(link_t); l++) {
+        result_t res[4];
+        for(int k=0; k<4; k++)
+            res[k] = Simulate((congestion_t)k,links[l],10*TINT_SEC);
+        Report(links[l],res);
+        double bdp = links[l].mbit * links[l].rtt / (CHUNK*8);
+        if (bdp<500)
+            continue;
+        EXPECT_GT(res[CUBIC_CONGESTION].mbit,res[LEDBAT_CONGESTION].mbit*2);
+        EXPECT_GT(res[BBR_CONGESTION].mbit,res[LEDBAT_CONGESTION].mbit*2);
+        EXPECT_GT(res[BBR_CONGESTION].mbit,links[l].mbit*0.7);
+        if (!links[l].loss)
+            continue;
+        EXPECT_GT(res[CUBIC_CONGESTION].mbit,res[AIMD_CONGESTION].mbit);
+        EXPECT_GT(res[BBR_CONGESTION].mbit,res[CUBIC_CONGESTION].mbit*2);
+    }
+}
+
+
+int main (int argc, char** argv) {
+    testing::InitGoogleTest(&argc, argv);
+    if (argc>=4) {
+        custom.rtt = atof(argv[1]) * TINT_MSEC;
+        custom.loss = atof(argv[2]) / 100;
+        custom.mbit = atof(argv[3]);
+        if (argc>=5)
+            custom_duration = atof(argv[4]) * TINT_SEC;
+    }
+    return RUN_ALL_TESTS();
+}
@@ -11,6 +11,10 @@
 //#include <glog/logging.h>
 #include "swift.h"
 #include <time.h>
+#include <algorithm>
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
 
 
 using namespace swift;
@@ -51,6 +55,211 @@ TEST(Connection,CwndTest) {
 
 }
 
+#ifndef _WIN32
+/** Loopback transfer of the same 4MB file with 1/4/8KB chunks. */
+TEST(Connection,ChunkSizeSweep) {
+
+    const int size = 4<<20;
+    FILE* f = fopen("sweep","wb");
+    ASSERT_TRUE(f!=NULL);
+    for(int i=0; i<size/4; i++)
+        fwrite(&i,4,1,f);
+    fclose(f);
+    Channel::SELF_CONN_OK = true;
+    FILE* debug_file = Channel::debug_file;
+    Channel::debug_file = NULL;
+
+    size_t chunks[3] = {1024, 4096, 8192};
+    for(int c=0; c<3; c++) {
+        unlink("sweep.mhash");
+        unlink("sweep-copy");
+        unlink("sweep-copy.mhash");
+        int sock = swift::Listen(7002);
+        ASSERT_TRUE(sock>=0);
+        swift::SetTracker(Address("127.0.0.1",7002));
+        int file = swift::Open("sweep",Sha1Hash::ZERO,chunks[c]);
+        ASSERT_EQ(chunks[c],swift::ChunkSize(file));
+        struct rusage ru0, ru1;
+        getrusage(RUSAGE_SELF,&ru0);
+        tint start = usec_time();
+        int copy = swift::Open("sweep-copy",RootMerkleHash(file),chunks[c]);
+        int count = 0;
+        while (swift::SeqComplete(copy)!=size && count++<60)
+            swift::Loop(TINT_SEC);
+        tint took = usec_time() - start;
+        getrusage(RUSAGE_SELF,&ru1);
+        ASSERT_EQ(size,swift::SeqComplete(copy));
+        tint cpu = (ru1.ru_utime.tv_sec-ru0.ru_utime.tv_sec+
+                    ru1.ru_stime.tv_sec-ru0.ru_stime.tv_sec)*TINT_SEC +
+                   ru1.ru_utime.tv_usec-ru0.ru_utime.tv_usec+
+                   ru1.ru_stime.tv_usec-ru0.ru_stime.tv_usec;
+        printf("chunk %zu\t%lli KB/s\t%lli CPU usec per MB\n",chunks[c],
+               (long long)size*TINT_SEC/took>>10, (long long)cpu/(size>>20));
+        swift::Close(file);
+        swift::Close(copy);
+        swift::Shutdown(sock);
+    }
+    Channel::debug_file = debug_file;
+
+}
+
+/** Loopback transfer with acks sent right away and delayed. */
+TEST(Connection,DelayedAcks) {
+
+    const int size = 4<<20;
+    FILE* f = fopen("acks","wb");
+    ASSERT_TRUE(f!=NULL);
+    for(int i=0; i<size/4; i++)
+        fwrite(&i,4,1,f);
+    fclose(f);
+    Channel::SELF_CONN_OK = true;
+    FILE* debug_file = Channel::debug_file;
+    Channel::debug_file = NULL;
+
+    tint delays[2] = {0, 10*TINT_MSEC};
+    for(int d=0; d<2; d++) {
+        unlink("acks.mhash");
+        unlink("acks-copy");
+        unlink("acks-copy.mhash");
+        Channel::ACK_DELAY = delays[d];
+        int sock = swift::Listen(7003);
+        ASSERT_TRUE(sock>=0);
+        swift::SetTracker(Address("127.0.0.1",7003));
+        int file = swift::Open("acks");
+        struct rusage ru0, ru1;
+        getrusage(RUSAGE_SELF,&ru0);
+        uint64_t dgrams = Datagram::dgrams_up;
+        tint start = usec_time();
+        int copy = swift::Open("acks-copy",RootMerkleHash(file));
+        int count = 0;
+        while (swift::SeqComplete(copy)!=size && count++<6000)
+            swift::Loop(TINT_MSEC*10);
+        tint took = usec_time() - start;
+        getrusage(RUSAGE_SELF,&ru1);
+        ASSERT_EQ(size,swift::SeqComplete(copy));
+        tint cpu = (ru1.ru_utime.tv_sec-ru0.ru_utime.tv_sec+
+                    ru1.ru_stime.tv_sec-ru0.ru_stime.tv_sec)*TINT_SEC +
+                   ru1.ru_utime.tv_usec-ru0.ru_utime.tv_usec+
+                   ru1.ru_stime.tv_usec-ru0.ru_stime.tv_usec;
+        printf("ack delay %lli ms\t%lli KB/s\t%lli datagrams\t"
+               "%lli CPU usec per MB\n",(long long)delays[d]/TINT_MSEC,
+               (long long)size*TINT_SEC/took>>10,
+               (long long)(Datagram::dgrams_up-dgrams),
+               (long long)cpu/(size>>20));
+        swift::Close(file);
+        swift::Close(copy);
+        swift::Shutdown(sock);
+    }
+    Channel::ACK_DELAY = 0;
+    Channel::debug_file = debug_file;
+
+}
+
+/** Loopback transfer with every congestion controller at the seeder. */
+TEST(Connection,CongestionControllers) {
+
+    const int size = 4<<20;
+    FILE* f = fopen("cc","wb");
+    ASSERT_TRUE(f!=NULL);
+    for(int i=0; i<size/4; i++)
+        fwrite(&i,4,1,f);
+    fclose(f);
+    Channel::SELF_CONN_OK = true;
+    FILE* debug_file = Channel::debug_file;
+    Channel::debug_file = NULL;
+
+    const char* names[4] = {"ledbat", "aimd", "cubic", "bbr"};
+    for(int k=0; k<4; k++) {
+        unlink("cc.mhash");
+        unlink("cc-copy");
+        unlink("cc-copy.mhash");
+        int sock = swift::Listen(7005);
+        ASSERT_TRUE(sock>=0);
+        swift::SetTracker(Address("127.0.0.1",7005));
+        int file = swift::Open("cc");
+        swift::UseCongestionControl(file,(congestion_t)k);
+        tint start = usec_time();
+        int copy = swift::Open("cc-copy",RootMerkleHash(file));
+        int count = 0;
+        while (swift::SeqComplete(copy)!=size && count++<60)
+            swift::Loop(TINT_SEC);
+        tint took = usec_time() - start;
+        ASSERT_EQ(size,swift::SeqComplete(copy));
+        printf("%s\t%lli KB/s\n",names[k],(long long)size*TINT_SEC/took>>10);
+        swift::Close(file);
+        swift::Close(copy);
+        swift::Shutdown(sock);
+    }
+    Channel::debug_file = debug_file;
+
+}
+
+const int LIVE_CHUNKS = 1000;
+tint live_written[LIVE_CHUNKS], live_arrived[LIVE_CHUNKS];
+
+void live_progress (int transfer, bin64_t bin) {
+    for(uint64_t c=bin.base_offset(); c<bin.base_offset()+bin.width() &&
+                                      c<LIVE_CHUNKS; c++)
+        if (!live_arrived[c])
+            live_arrived[c] = NOW;
+}
+
+/** A live stream over loopback, a chunk appended every 5ms: the time
+    from LiveWrite at the source to the chunk checked at the copy. */
+TEST(Connection,LiveLatency) {
+
+    Channel::SELF_CONN_OK = true;
+    FILE* debug_file = Channel::debug_file;
+    Channel::debug_file = NULL;
+    int sock = swift::Listen(7004);
+    ASSERT_TRUE(sock>=0);
+    Sha1Hash key("live test key");
+    int source = swift::OpenLive("live",key);
+    ASSERT_TRUE(source>=0);
+    swift::SetTracker(Address("127.0.0.1",7004));
+    int copy = swift::OpenLive("live-copy",key);
+    ASSERT_TRUE(copy>=0);
+    EXPECT_TRUE(RootMerkleHash(source)==RootMerkleHash(copy));
+    swift::AddProgressCallback(copy,&live_progress,0);
+
+    char chunk[1024];
+    for(int c=0; c<LIVE_CHUNKS; c++) {
+        memset(chunk,c,sizeof(chunk));
+        live_written[c] = Datagram::Time();
+        ASSERT_EQ(1,swift::LiveWrite(source,chunk,sizeof(chunk)));
+        swift::Loop(5*TINT_MSEC);
+        for(int wait=0; !c && !live_arrived[0] && wait<1000; wait++)
+            swift::Loop(10*TINT_MSEC); // the channel is set up
+    }
+    for(int wait=0; !live_arrived[LIVE_CHUNKS-1] && wait<500; wait++)
+        swift::Loop(10*TINT_MSEC);
+
+    std::vector<tint> latency;
+    for(int c=1; c<LIVE_CHUNKS; c++)
+        if (live_arrived[c])
+            latency.push_back(live_arrived[c]-live_written[c]);
+    ASSERT_EQ(LIVE_CHUNKS-1,latency.size());
+    EXPECT_EQ(LIVE_CHUNKS*sizeof(chunk),swift::Complete(copy));
+    std::sort(latency.begin(),latency.end());
+    tint sum = 0;
+    for(int i=0; i<latency.size(); i++)
+        sum += latency[i];
+    printf("live latency: %lli usec on average, %lli 95th percentile, "
+           "%lli max\n",(long long)sum/latency.size(),
+           (long long)latency[latency.size()*95/100],
+           (long long)latency.back());
+    EXPECT_LT(latency[latency.size()*95/100],TINT_SEC);
+
+    swift::Close(source);
+    swift::Close(copy);
+    swift::Shutdown(sock);
+    unlink("live");
+    unlink("live-copy");
+    Channel::debug_file = debug_file;
+
+}
+#endif
+
 
 int main (int argc, char** argv) {
 
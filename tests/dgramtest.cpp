@@ -10,6 +10,11 @@
 //#include <glog/logging.h>
 #include "datagram.h"
 #include "swift.h" // Arno: for LibraryInit
+#include <fcntl.h>
+#include <math.h>
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
 
 using namespace swift;
 
@@ -103,6 +108,347 @@ TEST(Datagram,TwoPortTest) {
 	Datagram::Close(sock2);
 }
 
+
+int wait_cost_rcvd = 0;
+
+void WaitCostRead (SOCKET sock) {
+    Datagram d(sock);
+    while (d.Recv()>=0)
+        wait_cost_rcvd++;
+}
+
+/** Wakeup cost against the number of registered (mostly idle) sockets. */
+TEST(Datagram,WaitCost) {
+    const int counts[] = {4, 64, 256, 768};
+    Poller* pollers[2] = { Poller::Select(), Poller::Epoll() };
+    for(int c=0; c<4; c++) {
+        std::vector<SOCKET> socks;
+        std::vector<Address> addrs;
+        for(int i=0; i<counts[c]; i++) {
+            SOCKET s = socket(AF_INET, SOCK_DGRAM, 0);
+            ASSERT_TRUE(s>=0);
+            make_socket_nonblocking(s);
+            Address a("127.0.0.1",0);
+            ASSERT_EQ(0,bind(s,(sockaddr*)&a.addr,sizeof(struct sockaddr_in)));
+            socklen_t len = sizeof(struct sockaddr_in);
+            getsockname(s,(sockaddr*)&a.addr,&len);
+            socks.push_back(s);
+            addrs.push_back(a);
+        }
+        for(int p=0; p<2; p++) {
+            if (!pollers[p])
+                continue;
+            for(int i=0; i<socks.size(); i++)
+                ASSERT_TRUE(pollers[p]->Add(sckrwecb_t(socks[i],WaitCostRead),true));
+            const int rounds = 2000;
+            wait_cost_rcvd = 0;
+            tint spent = 0;
+            for(int r=0; r<rounds; r++) {
+                int i = rand()%socks.size();
+                Datagram d(socks[0],addrs[i]);
+                d.Push32(r);
+                d.Send();
+                tint start = usec_time();
+                pollers[p]->Wait(TINT_SEC);
+                spent += usec_time() - start;
+            }
+            EXPECT_EQ(rounds,wait_cost_rcvd);
+            printf("%s\t%i sockets\t%lli usec per wakeup\n",
+                   pollers[p]->name(),(int)socks.size(),spent/rounds);
+            for(int i=0; i<socks.size(); i++)
+                pollers[p]->Remove(socks[i]);
+        }
+        for(int i=0; i<socks.size(); i++)
+            close_socket(socks[i]);
+    }
+    delete pollers[0];
+    delete pollers[1];
+}
+
+/** Loopback receive rate: one recvfrom per datagram vs. batched receive. */
+TEST(Datagram,RecvBatch) {
+    SOCKET sock1 = Datagram::Bind("127.0.0.1:10003");
+    SOCKET sock2 = Datagram::Bind("127.0.0.1:10004");
+    ASSERT_TRUE(sock1>0);
+    ASSERT_TRUE(sock2>0);
+    static Datagram ring[DGRAM_MAX_BATCH];
+    const int burst = 256, rounds = 40;
+    for(int batched=0; batched<2; batched++) {
+        uint64_t dgrams = Datagram::dgrams_down, bytes = Datagram::bytes_down;
+        tint spent = 0;
+        int rcvd = 0;
+        for(int r=0; r<rounds; r++) {
+            for(int i=0; i<burst; i++) {
+                Datagram d(sock1,Address("127.0.0.1:10004"));
+                d.Push32(i);
+                uint8_t payload[1024];
+                memset(payload,i,1024);
+                d.Push(payload,1024);
+                d.Send();
+            }
+            tint start = usec_time();
+            int got;
+            if (batched) {
+                while ((got=Datagram::RecvBatch(sock2,ring,DGRAM_MAX_BATCH))>0)
+                    for(int i=0; i<got; i++, rcvd++)
+                        ASSERT_EQ(rcvd%burst,ring[i].Pull32());
+            } else {
+                Datagram d(sock2);
+                while (d.Recv()>=0) {
+                    ASSERT_EQ(rcvd%burst,d.Pull32());
+                    rcvd++;
+                }
+            }
+            spent += usec_time() - start;
+        }
+        EXPECT_EQ(burst*rounds,rcvd);
+        EXPECT_EQ(rcvd,Datagram::dgrams_down-dgrams);
+        EXPECT_EQ(rcvd*1028,Datagram::bytes_down-bytes);
+        printf("%s\t%lli packets/sec\n", batched ? "recvmmsg" : "recvfrom",
+               (long long)rcvd*TINT_SEC/(spent?spent:1));
+    }
+    Datagram::Close(sock1);
+    Datagram::Close(sock2);
+}
+
+/** Loopback send rate: one sendto per datagram vs. a queued batch. */
+TEST(Datagram,SendBatch) {
+    SOCKET sock1 = Datagram::Bind("127.0.0.1:10005");
+    SOCKET sock2 = Datagram::Bind("127.0.0.1:10006");
+    ASSERT_TRUE(sock1>0);
+    ASSERT_TRUE(sock2>0);
+    const int burst = 256, rounds = 40;
+    const char* modes[3] = {"sendto", "sendmmsg", "in place"};
+    for(int m=0; m<3; m++) {
+        uint64_t dgrams = Datagram::dgrams_up, bytes = Datagram::bytes_up;
+        tint spent = 0;
+        int rcvd = 0;
+        for(int r=0; r<rounds; r++) {
+            tint start = usec_time();
+            for(int i=0; i<burst; i++) {
+                Address to("127.0.0.1:10006");
+                Datagram own(sock1,to);
+                Datagram& d = m==2 ? Datagram::Outgoing(sock1,to) : own;
+                d.Push32(i);
+                uint8_t payload[1024];
+                memset(payload,i,1024);
+                d.Push(payload,1024);
+                if (m)
+                    ASSERT_EQ(1028,d.Queue());
+                else
+                    d.Send();
+            }
+            Datagram::Flush();
+            spent += usec_time() - start;
+            Datagram d(sock2);
+            while (d.Recv()>=0) { // order is preserved
+                ASSERT_EQ(rcvd%burst,d.Pull32());
+                rcvd++;
+            }
+        }
+        EXPECT_EQ(burst*rounds,rcvd);
+        EXPECT_EQ(rcvd,Datagram::dgrams_up-dgrams);
+        EXPECT_EQ(rcvd*1028,Datagram::bytes_up-bytes);
+        printf("%s\t%lli packets/sec\n", modes[m],
+               (long long)rcvd*TINT_SEC/(spent?spent:1));
+    }
+    Datagram::Close(sock1);
+    Datagram::Close(sock2);
+}
+
+/** Datagrams built in the batch, split with QueueHead, and copied in
+    go out in the order they were queued, over several full batches. */
+TEST(Datagram,QueueInPlace) {
+    SOCKET sock1 = Datagram::Bind("127.0.0.1:10009");
+    SOCKET sock2 = Datagram::Bind("127.0.0.1:10010");
+    ASSERT_TRUE(sock1>0);
+    ASSERT_TRUE(sock2>0);
+    Address to("127.0.0.1:10010");
+    const int count = DGRAM_MAX_BATCH*3;
+    for(int i=0; i<count; i+=4) {
+        Datagram& d = Datagram::Outgoing(sock1,to);
+        d.Push32(i);
+        EXPECT_EQ(4,d.QueueHead());
+        d.Push32(i+1);
+        EXPECT_EQ(4,d.Queue());
+        Datagram& e = Datagram::Outgoing(sock1,to);
+        e.Push32(i+2);
+        EXPECT_EQ(4,e.Queue());
+        Datagram own(sock1,to);
+        own.Push32(i+3);
+        EXPECT_EQ(4,own.Queue());
+        EXPECT_EQ(0,own.size());
+    }
+    Datagram::Flush();
+    Datagram r(sock2);
+    for(int i=0; i<count; i++) {
+        ASSERT_EQ(4,r.Recv());
+        EXPECT_EQ(i,r.Pull32());
+    }
+    Datagram::Close(sock1);
+    Datagram::Close(sock2);
+}
+
+#ifndef _WIN32
+tint cpu_time () {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF,&ru);
+    return (ru.ru_utime.tv_sec+ru.ru_stime.tv_sec)*TINT_SEC +
+           ru.ru_utime.tv_usec+ru.ru_stime.tv_usec;
+}
+
+/** DATA payloads served per CPU-second: a bounce buffer (the old way),
+    pread right into a datagram built in the batch, a memory mapped file. */
+TEST(Datagram,ServeRate) {
+    const int kilos = 1<<14;
+    int fd = open("serve_test",O_RDWR|O_CREAT|O_TRUNC,S_IRUSR|S_IWUSR);
+    ASSERT_TRUE(fd>0);
+    uint8_t kilo[1024];
+    for(int i=0; i<kilos; i++) {
+        memset(kilo,i&0xff,1024);
+        kilo[0] = i>>8;
+        ASSERT_EQ(1024,write(fd,kilo,1024));
+    }
+    uint8_t* map = (uint8_t*) memory_map(fd,kilos<<10);
+    ASSERT_TRUE(map!=NULL);
+    SOCKET sock1 = Datagram::Bind("127.0.0.1:10007");
+    SOCKET sock2 = Datagram::Bind("127.0.0.1:10008");
+    const char* modes[3] = {"bounce","pread","mmap"};
+    for(int m=0; m<3; m++) {
+        for(int check=1; check>=0; check--) {
+            int count = check ? 8 : kilos*4;
+            tint start = cpu_time();
+            for(int i=0; i<count; i++) {
+                int k = i%kilos;
+                Address to("127.0.0.1:10008");
+                Datagram own(sock1,to);
+                Datagram& d = m==1 ? Datagram::Outgoing(sock1,to) : own;
+                d.Push32(0);
+                d.Push8(1);
+                d.Push32(k);
+                if (m==0) {
+                    uint8_t buf[1024];
+                    d.Push(buf,pread(fd,buf,1024,k<<10));
+                } else if (m==1)
+                    d.PushFile(fd,1024,k<<10);
+                else
+                    d.PushRef(map+(k<<10),1024);
+                d.Queue();
+            }
+            Datagram::Flush();
+            tint spent = cpu_time() - start;
+            Datagram r(sock2);
+            int rcvd = 0;
+            while (r.Recv()>=0)
+                if (check) {
+                    EXPECT_EQ(1024+9,r.size());
+                    EXPECT_EQ(0,r.Pull32());
+                    EXPECT_EQ(1,r.Pull8());
+                    int k = r.Pull32();
+                    EXPECT_EQ(0,memcmp(map+(k<<10),*r,1024));
+                    rcvd++;
+                }
+            if (check)
+                EXPECT_EQ(count,rcvd);
+            else
+                printf("%s\t%lli MB per CPU-second\n",modes[m],
+                       (long long)count*TINT_SEC/(spent?spent:1)>>10);
+        }
+    }
+    Datagram::Close(sock1);
+    Datagram::Close(sock2);
+    memory_unmap(fd,map,kilos<<10); // closes fd
+    unlink("serve_test");
+}
+
+int pacing_rcvd = 0;
+
+void PacingRead (SOCKET sock) {
+    Datagram d(sock);
+    while (d.Recv()>=0)
+        pacing_rcvd++;
+}
+
+/** Paced sending the way Channel::Loop does it: packets are due one gap
+    apart, a late one is made up for within Channel::PACING_SLACK, the
+    poller sleeps till the next is due. The link is shaped in the model:
+    it takes 9/10 of a gap per packet and queues 4 at most, the rest is
+    dropped. Loopback delivers within sendto, so send times are arrival
+    times. A millisecond poller makes a burst every millisecond. */
+TEST(Datagram,Pacing) {
+    const int count = 2000, queue = 4;
+    const tint gaps[2] = {100, 500};
+    SOCKET from = socket(AF_INET, SOCK_DGRAM, 0), to = socket(AF_INET, SOCK_DGRAM, 0);
+    ASSERT_TRUE(from>=0 && to>=0);
+    make_socket_nonblocking(to);
+    Address addr("127.0.0.1",0);
+    ASSERT_EQ(0,bind(to,(sockaddr*)&addr.addr,sizeof(struct sockaddr_in)));
+    socklen_t len = sizeof(struct sockaddr_in);
+    getsockname(to,(sockaddr*)&addr.addr,&len);
+    Poller* pollers[3] = { Poller::Select(), Poller::Epoll(false), Poller::Epoll() };
+    for(int g=0; g<2; g++) {
+        double stddev[3], drops[3];
+        for(int p=0; p<3; p++) {
+            stddev[p] = drops[p] = -1;
+            if (!pollers[p])
+                continue;
+            ASSERT_TRUE(pollers[p]->Add(sckrwecb_t(to,PacingRead),true));
+            pacing_rcvd = 0;
+            std::vector<tint> sent;
+            tint due = usec_time();
+            for(int i=0; i<count; i++) {
+                while (Datagram::Time()<due)
+                    pollers[p]->Wait(due-NOW);
+                Datagram d(from,addr);
+                d.Push32(i);
+                uint8_t payload[1024];
+                memset(payload,i,1024);
+                d.Push(payload,1024);
+                d.Send();
+                sent.push_back(NOW);
+                due = std::max(NOW-Channel::PACING_SLACK,due+gaps[g]);
+            }
+            while (pacing_rcvd<count && pollers[p]->Wait(TINT_SEC/10)>0);
+            EXPECT_EQ(count,pacing_rcvd);
+            pollers[p]->Remove(to);
+            double sum = 0, sum2 = 0;
+            tint max_gap = 0;
+            std::deque<tint> shaper; // departures
+            int dropped = 0;
+            for(int i=1; i<count; i++) {
+                tint gap = sent[i] - sent[i-1];
+                sum += gap;
+                sum2 += (double)gap*gap;
+                max_gap = std::max(max_gap,gap);
+                while (!shaper.empty() && shaper.front()<=sent[i])
+                    shaper.pop_front();
+                if (shaper.size()>queue) {
+                    dropped++;
+                    continue;
+                }
+                tint start = shaper.empty() ? sent[i] : shaper.back();
+                shaper.push_back(start+gaps[g]*9/10);
+            }
+            double mean = sum/(count-1);
+            stddev[p] = sqrt(sum2/(count-1)-mean*mean);
+            drops[p] = 100.0*dropped/count;
+            printf("%s\tgap %lli us: mean %.1f stddev %.1f max %lli, "
+                   "shaper drops %.2f%%\n",pollers[p]->name(),gaps[g],mean,
+                   stddev[p],max_gap,drops[p]);
+        }
+        // at 500us both are within noise; a millisecond poller bursts
+        // ten packets at a 100us gap
+        if (gaps[g]==100 && stddev[1]>=0 && stddev[2]>=0)
+            EXPECT_LT(stddev[2],stddev[1]/2);
+    }
+    for(int p=0; p<3; p++)
+        delete pollers[p];
+    close_socket(from);
+    close_socket(to);
+}
+#endif
+
+
 int main (int argc, char** argv) {
 
 	swift::LibraryInit();
@@ -10,6 +10,9 @@
 #include "bin64.h"
 #include <gtest/gtest.h>
 #include "hashtree.h"
+#include "sha1.h"
+#include "compat.h"
+#include <deque>
 
 using namespace swift;
 
@@ -48,6 +51,455 @@ TEST(Sha1HashTest,SubmitTest) {
 }
 
 
+TEST(Sha1HashTest,ChunkSizeTest) {
+    uint8_t data[10000];
+    for(int i=0; i<10000; i++)
+        data[i] = i*7;
+    int f = open("chunky",O_RDWR|O_CREAT|O_TRUNC,S_IRUSR|S_IWUSR);
+    ASSERT_EQ(10000,write(f,data,10000));
+    close(f);
+    unlink("chunky.mhash");
+    Sha1Hash root;
+    {
+        HashTree tree("chunky",Sha1Hash::ZERO,NULL,4096);
+        EXPECT_EQ(4096,tree.chunk_size());
+        EXPECT_EQ(3,tree.packet_size());
+        EXPECT_TRUE(tree.hash(bin64_t(0,2))==Sha1Hash(data+8192,10000-8192));
+        root = tree.root_hash();
+    }
+    {   // the chunk size is recovered from the .mhash
+        HashTree tree("chunky",root);
+        EXPECT_EQ(4096,tree.chunk_size());
+        EXPECT_TRUE(tree.is_complete());
+        EXPECT_EQ(10000,tree.size());
+    }
+    unlink("chunky-copy");
+    unlink("chunky-copy.mhash");
+    HashTree source("chunky",root), copy("chunky-copy",root,NULL,4096);
+    for(int p=0; p<source.peak_count(); p++)
+        copy.OfferHash(source.peak(p),source.peak_hash(p));
+    ASSERT_EQ(3,copy.packet_size());
+    copy.OfferHash(bin64_t(0,0),source.hash(bin64_t(0,0)));
+    copy.OfferHash(bin64_t(0,1),source.hash(bin64_t(0,1)));
+    EXPECT_FALSE(copy.OfferData(bin64_t(0,0),(char*)data,1024));
+    EXPECT_TRUE(copy.OfferData(bin64_t(0,0),(char*)data,4096));
+    EXPECT_TRUE(copy.OfferData(bin64_t(0,1),(char*)data+4096,4096));
+    EXPECT_TRUE(copy.OfferData(bin64_t(0,2),(char*)data+8192,10000-8192));
+    EXPECT_TRUE(copy.is_complete());
+    EXPECT_EQ(10000,copy.size());
+    unlink("chunky-copy");
+    unlink("chunky-copy.mhash");
+}
+
+
+const char* sha1_kernels[] = {"avx512","avx2","shani","sse2","scalar"};
+
+
+/** Every multi-buffer kernel must agree with the plain SHA1 code. */
+TEST(Sha1HashTest,MultiBufferTest) {
+    const size_t lengths[] = {0,1,40,55,56,63,64,65,119,120,1000,1024,4099};
+    const int nlen = sizeof(lengths)/sizeof(size_t);
+    unsigned char data[40][4099];
+    for(int i=0; i<40; i++)
+        for(int j=0; j<4099; j++)
+            data[i][j] = i*31+j*7+(j>>8);
+    for(int k=0; k<5; k++) {
+        if (!blk_SHA1_SetKernel(sha1_kernels[k]))
+            continue;
+        EXPECT_STREQ(sha1_kernels[k],blk_SHA1_Kernel());
+        for(int count=1; count<=40; count+=3)
+            for(int mix=0; mix<=nlen; mix++) { // all of one length, or mixed
+                const unsigned char* ptrs[40];
+                size_t lens[40];
+                unsigned char out[40][20];
+                unsigned char* outs[40];
+                for(int i=0; i<count; i++) {
+                    ptrs[i] = data[i];
+                    lens[i] = lengths[mix<nlen ? mix : (i*7)%nlen];
+                    outs[i] = out[i];
+                }
+                blk_SHA1_Multi(count,ptrs,lens,outs);
+                for(int i=0; i<count; i++) {
+                    Sha1Hash plain(ptrs[i],lens[i]);
+                    ASSERT_EQ(0,memcmp(plain.bits,out[i],20))
+                        << sha1_kernels[k] << " count " << count
+                        << " length " << lens[i];
+                }
+            }
+    }
+    blk_SHA1_SetKernel(NULL);
+}
+
+
+/** Leaves (1KB) and parents (40 bytes) hashed per second, per kernel. */
+TEST(Sha1HashTest,MultiBufferBenchmark) {
+    static unsigned char data[64][1024];
+    unsigned char out[64][20];
+    const unsigned char* ptrs[64];
+    unsigned char* outs[64];
+    for(int i=0; i<64; i++) {
+        memset(data[i],i,1024);
+        ptrs[i] = data[i];
+        outs[i] = out[i];
+    }
+    for(int k=0; k<5; k++) {
+        if (!blk_SHA1_SetKernel(sha1_kernels[k]))
+            continue;
+        for(size_t len=1024; len>=40; len = len==1024 ? 40 : 0) {
+            size_t lens[64];
+            for(int i=0; i<64; i++)
+                lens[i] = len;
+            int rounds = len==1024 ? 400 : 4000;
+            tint start = usec_time();
+            for(int r=0; r<rounds; r++)
+                blk_SHA1_Multi(64,ptrs,lens,outs);
+            tint took = usec_time() - start;
+            printf("%s\t%i-byte messages\t%lli per sec\n",sha1_kernels[k],
+                   (int)len,(long long)rounds*64*TINT_SEC/(took?took:1));
+        }
+    }
+    blk_SHA1_SetKernel(NULL);
+    printf("default kernel: %s\n",blk_SHA1_Kernel());
+}
+
+
+std::string file_contents (const char* filename) {
+    std::string ret;
+    char buf[4096];
+    int fd = open(filename,O_RDONLY), rd;
+    while ( (rd=read(fd,buf,4096)) > 0 )
+        ret.append(buf,rd);
+    close(fd);
+    return ret;
+}
+
+
+/** The tree is built in parallel; must be the same as built one by one. */
+TEST(Sha1HashTest,ParallelSubmitTest) {
+    const size_t sizes[4] = { 1, 1024*3+17, (5000<<10)+300, 7777<<10 };
+    for(int s=0; s<4; s++) {
+        uint32_t word = s;
+        FILE* f = fopen("parallel","wb");
+        for(size_t i=0; i<sizes[s]; i+=4, word=word*1103515245+12345)
+            fwrite(&word,1,sizes[s]-i<4?sizes[s]-i:4,f);
+        fclose(f);
+        std::string mhash[2];
+        for(int t=0; t<2; t++) {
+            HashTree::THREADS = t ? 4 : 1;
+            unlink("parallel.mhash");
+            {
+                HashTree tree("parallel");
+                EXPECT_TRUE(tree.is_complete());
+                EXPECT_EQ(sizes[s],tree.size());
+                // the plain way, one leaf and one bin at a time
+                uint8_t chunk[1024];
+                int fd = open("parallel",O_RDONLY);
+                for(uint64_t i=0; i<tree.packet_size(); i++) {
+                    int rd = read(fd,chunk,1024);
+                    ASSERT_TRUE(tree.hash(bin64_t(0,i))==Sha1Hash(chunk,rd));
+                }
+                close(fd);
+                for(int p=0; p<tree.peak_count(); p++)
+                    for(bin64_t b=tree.peak(p).left_foot().parent();
+                            b.within(tree.peak(p)); b=b.next_dfsio(1))
+                        ASSERT_TRUE(tree.hash(b)==
+                                Sha1Hash(tree.hash(b.left()),tree.hash(b.right())));
+            }
+            mhash[t] = file_contents("parallel.mhash");
+        }
+        EXPECT_TRUE(mhash[0]==mhash[1]);
+    }
+    HashTree::THREADS = 0;
+    unlink("parallel");
+    unlink("parallel.mhash");
+}
+
+
+/** Submit throughput on 1 to N threads. */
+TEST(Sha1HashTest,ParallelSubmitBenchmark) {
+    const int size = 64<<20;
+    char block[1<<16];
+    for(int i=0; i<sizeof(block); i++)
+        block[i] = i*13;
+    FILE* f = fopen("parallel","wb");
+    for(int i=0; i<size; i+=sizeof(block)) {
+        block[0] = i;
+        fwrite(block,1,sizeof(block),f);
+    }
+    fclose(f);
+    int cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    for(int t=1; t<=cpus || t<=4; t*=2) {
+        HashTree::THREADS = t;
+        unlink("parallel.mhash");
+        tint start = usec_time();
+        HashTree tree("parallel");
+        tint took = usec_time() - start;
+        EXPECT_TRUE(tree.is_complete());
+        printf("%i threads (%i cpus)\t%lli MB/s\n",t,cpus,
+               (long long)size*TINT_SEC/took>>20);
+    }
+    HashTree::THREADS = 0;
+    unlink("parallel");
+    unlink("parallel.mhash");
+}
+
+
+void overwrite (const char* filename, uint64_t offset, char c, size_t length) {
+    char buf[1<<16];
+    memset(buf,c,sizeof(buf));
+    int fd = open(filename,O_RDWR);
+    for(size_t done=0; done<length; done+=sizeof(buf))
+        pwrite(fd,buf,length-done<sizeof(buf)?length-done:sizeof(buf),offset+done);
+    close(fd);
+}
+
+
+/** Progress is restored from the checkpoint, not by rehashing. */
+TEST(Sha1HashTest,CheckpointTest) {
+    FILE* f = fopen("resume","wb");
+    for(int i=0; i<1000*1024+300; i++)
+        fputc(i*i>>3,f);
+    fclose(f);
+    unlink("resume.mhash");
+    Sha1Hash root = HashTree("resume").root_hash();
+    // a partial copy: the hashes are there, some data is missing
+    f = fopen("resume-part.mhash","wb");
+    std::string mhash = file_contents("resume.mhash");
+    fwrite(mhash.data(),1,mhash.size(),f);
+    fclose(f);
+    f = fopen("resume-part","wb");
+    std::string data = file_contents("resume");
+    fwrite(data.data(),1,data.size(),f);
+    fclose(f);
+    overwrite("resume-part",100*1024,0,200*1024);
+    overwrite("resume-part",512*1024,0,1024);
+    unlink("resume-part.mhash.ack");
+    uint64_t complete;
+    {
+        HashTree part("resume-part",root);
+        complete = part.complete();
+        EXPECT_EQ(799*1024+300,complete);
+        EXPECT_EQ(1000*1024+300,part.size());
+    }
+    overwrite("resume-part",5*1024,'x',1);
+    {   // trusted, so the corrupted chunk goes unnoticed
+        HashTree part("resume-part",root);
+        EXPECT_EQ(complete,part.complete());
+        EXPECT_EQ(800,part.packets_complete());
+        EXPECT_EQ(1000*1024+300,part.size());
+        EXPECT_FALSE(part.recheck_pending());
+        EXPECT_EQ(binmap_t::EMPTY,part.ack_out().get(bin64_t(0,100)));
+        EXPECT_EQ(binmap_t::FILLED,part.ack_out().get(bin64_t(0,300)));
+        EXPECT_EQ(binmap_t::FILLED,part.ack_out().get(bin64_t(0,1000)));
+    }
+    HashTree::LAZY_RECHECK = true;
+    {
+        HashTree part("resume-part",root);
+        EXPECT_EQ(complete,part.complete());
+        EXPECT_TRUE(part.recheck_pending());
+        int slices = 0;
+        while (part.Recheck(100))
+            slices++;
+        EXPECT_EQ(10,slices);
+        EXPECT_EQ(complete-1024,part.complete());
+        EXPECT_EQ(binmap_t::EMPTY,part.ack_out().get(bin64_t(0,5)));
+    }
+    HashTree::LAZY_RECHECK = false;
+    overwrite("resume-part",5*1024,data[5*1024],1);
+    {   // the checkpoint was updated
+        HashTree part("resume-part",root);
+        EXPECT_EQ(complete-1024,part.complete());
+    }
+    {   // a broken checkpoint is ignored, the data is rehashed
+        FILE* ack = fopen("resume-part.mhash.ack","rb+");
+        fseek(ack,60,SEEK_SET);
+        fputc(0x55,ack);
+        fclose(ack);
+        HashTree part("resume-part",root);
+        EXPECT_EQ(complete,part.complete());
+    }
+    {   // so is a checkpoint for another tree
+        HashTree::LAZY_RECHECK = true;
+        HashTree other("resume-part",Sha1Hash(true,hash123));
+        EXPECT_EQ(0,other.complete());
+        EXPECT_FALSE(other.recheck_pending());
+        HashTree::LAZY_RECHECK = false;
+    }
+    const char* files[] = {"resume","resume-part"};
+    for(int i=0; i<2; i++) {
+        unlink(files[i]);
+        unlink((std::string(files[i])+".mhash").c_str());
+        unlink((std::string(files[i])+".mhash.ack").c_str());
+    }
+}
+
+
+/** Startup time for a large, half-complete file, with and without
+    a checkpoint. */
+TEST(Sha1HashTest,CheckpointBenchmark) {
+    const int size = 128<<20;
+    char block[1<<16];
+    for(int i=0; i<sizeof(block); i++)
+        block[i] = i*13;
+    FILE* f = fopen("resume-big","wb");
+    for(int i=0; i<size; i+=sizeof(block)) {
+        block[0] = i;
+        fwrite(block,1,sizeof(block),f);
+    }
+    fclose(f);
+    unlink("resume-big.mhash");
+    Sha1Hash root = HashTree("resume-big").root_hash();
+    for(int i=0; i<size; i+=2<<20)
+        overwrite("resume-big",i,0,1<<20);
+    unlink("resume-big.mhash.ack");
+    const char* how[3] = {"rehash","checkpoint","checkpoint+recheck"};
+    uint64_t complete[3];
+    for(int i=0; i<3; i++) {
+        HashTree::LAZY_RECHECK = i==2;
+        tint start = usec_time();
+        HashTree tree("resume-big",root);
+        tint took = usec_time() - start;
+        complete[i] = tree.complete();
+        printf("%s\t%lli ms to open %i MB, %lli MB complete\n",how[i],
+               (long long)took/1000,size>>20,(long long)complete[i]>>20);
+        if (i==2) {
+            start = usec_time();
+            while (tree.Recheck(1<<10));
+            printf("recheck\t%lli ms in the background\n",
+                   (long long)(usec_time()-start)/1000);
+            EXPECT_EQ(complete[0],tree.complete());
+        }
+    }
+    EXPECT_EQ(size/2,complete[0]);
+    EXPECT_EQ(complete[0],complete[1]);
+    EXPECT_EQ(complete[0],complete[2]);
+    HashTree::LAZY_RECHECK = false;
+    unlink("resume-big");
+    unlink("resume-big.mhash");
+    unlink("resume-big.mhash.ack");
+}
+
+
+/** Hand a chunk of a live stream over, with the uncles up to its peak. */
+bool deliver (HashTree& from, HashTree& to, bin64_t pos, bool corrupt=false) {
+    char data[1024];
+    if (pread(from.file_descriptor(),data,1024,from.data_offset(pos))!=1024)
+        return false;
+    data[0] ^= corrupt;
+    for(bin64_t p=pos; p!=from.peak_for(pos); p=p.parent())
+        to.OfferHash(p.sibling(),from.hash(p.sibling()));
+    return to.OfferData(pos,data,1024);
+}
+
+
+/** The source appends 700 bytes at a time; the copy takes the keyed
+    peaks as they change and gets every chunk three chunks late, so the
+    peaks mostly merge meanwhile. */
+TEST(Sha1HashTest,LiveAppendTest) {
+    Sha1Hash key("live key");
+    HashTree source(key,"live-src"), copy(key,"live-copy");
+    EXPECT_EQ(Sha1Hash(key.bits,Sha1Hash::SIZE),source.root_hash());
+    EXPECT_EQ(source.root_hash(),copy.root_hash());
+    EXPECT_FALSE(copy.OfferHash(bin64_t(0,0),Sha1Hash("no peaks yet")));
+    char buf[700];
+    srand(7);
+    std::deque<bin64_t> late;
+    int old_count = 0;
+    bin64_t old_peaks[64];
+    Sha1Hash old_hashes[64], old_mac;
+    for(int i=0; i<3000; i++) {
+        for(int j=0; j<sizeof(buf); j++)
+            buf[j] = rand();
+        uint64_t had = source.packet_size();
+        int fresh = source.AppendData(buf,sizeof(buf));
+        EXPECT_EQ((i+1)*sizeof(buf)/1024,source.packet_size());
+        if (source.packet_size()==had) {
+            EXPECT_EQ(0,fresh);
+            continue;
+        }
+        EXPECT_LT(0,fresh);
+        int count = source.peak_count();
+        bin64_t peaks[64];
+        Sha1Hash hashes[64];
+        for(int p=0; p<count; p++) {
+            peaks[p] = source.peak(p);
+            hashes[p] = source.peak_hash(p);
+        }
+        EXPECT_FALSE(copy.OfferKeyedPeaks(count,peaks,hashes,Sha1Hash("forged")));
+        ASSERT_TRUE(copy.OfferKeyedPeaks(count,peaks,hashes,
+                                          source.peaks_mac()));
+        EXPECT_EQ(source.size(),copy.size());
+        if (had==5) {
+            old_count = count;
+            memcpy(old_peaks,peaks,sizeof(peaks));
+            memcpy(old_hashes,hashes,sizeof(hashes));
+            old_mac = source.peaks_mac();
+        }
+        late.push_back(bin64_t(0,had));
+        if (late.size()>3) {
+            EXPECT_FALSE(deliver(source,copy,late.front(),true));
+            EXPECT_TRUE(deliver(source,copy,late.front()));
+            late.pop_front();
+        }
+    }
+    for(; !late.empty(); late.pop_front())
+        EXPECT_TRUE(deliver(source,copy,late.front()));
+    EXPECT_TRUE(copy.is_complete());
+    EXPECT_EQ(source.size(),copy.complete());
+    EXPECT_EQ(source.size(),file_size(copy.file_descriptor()));
+    // keyed, but older
+    EXPECT_FALSE(copy.OfferKeyedPeaks(old_count,old_peaks,old_hashes,old_mac));
+    unlink("live-src");
+    unlink("live-copy");
+}
+
+
+
+/** A window of 64 chunks: the copy gets the chunks in random order, up
+    to 80 chunks late, so some leave the window before they arrive; those
+    are refused, the rest check out. */
+TEST(Sha1HashTest,LiveWindowTest) {
+    Sha1Hash key("live window");
+    HashTree source(key,"live-src",1024,64), copy(key,"live-copy",1024,64);
+    char buf[1024];
+    srand(11);
+    std::vector<bin64_t> late;
+    int refused = 0;
+    for(int i=0; i<3000; i++) {
+        for(int j=0; j<sizeof(buf); j++)
+            buf[j] = rand();
+        source.AppendData(buf,sizeof(buf));
+        int count = source.peak_count();
+        bin64_t peaks[64];
+        Sha1Hash hashes[64];
+        for(int p=0; p<count; p++) {
+            peaks[p] = source.peak(p);
+            hashes[p] = source.peak_hash(p);
+        }
+        ASSERT_TRUE(copy.OfferKeyedPeaks(count,peaks,hashes,
+                                          source.peaks_mac()));
+        late.push_back(bin64_t(0,i));
+        while (late.size()>rand()%80) {
+            int at = rand() % late.size();
+            bin64_t pos = late[at];
+            late[at] = late.back();
+            late.pop_back();
+            bool kept = pos.base_offset()>=copy.window_start();
+            EXPECT_EQ(kept,source.ack_out().is_filled(pos));
+            EXPECT_FALSE(deliver(source,copy,pos,true));
+            EXPECT_EQ(kept,deliver(source,copy,pos));
+            refused += !kept;
+        }
+    }
+    EXPECT_LT(0,refused);
+    EXPECT_EQ(64*1024,file_size(source.file_descriptor()));
+    EXPECT_EQ(64*1024,file_size(copy.file_descriptor()));
+    EXPECT_TRUE(copy.ack_out().is_empty(bin64_t(0,3000-65)));
+    EXPECT_LE(copy.packets_complete(),64);
+    unlink("live-src");
+    unlink("live-copy");
+}
+
 /*TEST(Sha1HashTest,HashFileTest) {
 	uint8_t a [1024], b[1024], c[1024];
 	memset(a,'a',1024);
@@ -0,0 +1,376 @@
+/*
+ *  pickertest.cpp
+ *  piece pickers in a simulated swarm
+ *
+ *  Copyright 2009 Delft University of Technology. All rights reserved.
+ *
+ */
+#include <gtest/gtest.h>
+#include "swift.h"
+#include "compat.h"
+
+using namespace swift;
+
+
+const int CHUNKS = 512, LEECHERS = 24, REQUESTS = 2, SLOW = 8;
+
+
+struct request_t {
+    int         peer;
+    bin64_t     bin;
+};
+
+
+struct swarm_t {
+    double      average, tail;
+    int         last, seeded, cancelled;
+};
+
+
+/** One seeder, LEECHERS leechers, all connected; a tick is 10ms. Every
+    peer uploads one chunk per tick, but every third leecher uploads one
+    per SLOW ticks. A leecher keeps up to REQUESTS requests outstanding
+    with every peer, tries a few random peers a tick and tells everyone
+    of every chunk it gets (as HAVE does); requests for chunks the
+    requester already has are dropped by the sender (cancelled). The
+    tail is the average time from 95% to 100% done. */
+swarm_t Swarm (picker_t kind) {
+    srand(1);
+    char name[32];
+    FileTransfer* seed = new FileTransfer("pickersrc");
+    std::vector<FileTransfer*> peers(1,seed);
+    for(int i=0; i<LEECHERS; i++) {
+        sprintf(name,"pickerdl%i",i);
+        unlink(name);
+        strcat(name,".mhash");
+        unlink(name);
+        name[strlen(name)-6] = 0;
+        FileTransfer* leech = new FileTransfer(name,seed->root_hash());
+        for(int p=0; p<seed->file().peak_count(); p++)
+            leech->file().OfferHash(seed->file().peak(p),
+                                    seed->file().peak_hash(p));
+        EXPECT_EQ(seed->file().size(),leech->file().size());
+        UsePiecePicker(leech->fd(),kind);
+        for(int p=0; p<seed->file().peak_count(); p++)
+            leech->picker().Available(seed->file().peak(p),1);
+        peers.push_back(leech);
+    }
+    std::vector< std::deque<request_t> > queue(peers.size());
+    static tbring asked[LEECHERS+1][LEECHERS+1]; // by leecher, peer
+    std::vector<int> got(peers.size(),0), done(peers.size(),0),
+                     almost(peers.size(),0);
+    int left = LEECHERS, tick = 0;
+    swarm_t ret = {0,0,0,0,0};
+    tint now = NOW;
+    while (left && tick<CHUNKS*LEECHERS) {
+        tick++;
+        NOW += 10*TINT_MSEC;
+        for(int l=1; l<peers.size(); l++)
+            for(int t=0; !done[l] && t<4; t++) {
+                int p = rand() % peers.size();
+                if (p==l || asked[l][p].size()>=REQUESTS)
+                    continue;
+                bin64_t hint = peers[l]->picker().Pick
+                    (peers[p]->ack_out(),1,NOW+TINT_SEC);
+                if (hint==bin64_t::NONE && peers[l]->picker().AllHinted())
+                    hint = peers[l]->endgame().Pick(peers[p]->ack_out(),
+                            peers[l]->ack_out(),asked[l][p],1);
+                if (hint==bin64_t::NONE)
+                    continue;
+                request_t req = {l,hint};
+                queue[p].push_back(req);
+                asked[l][p].push_back(tintbin(NOW,hint));
+            }
+        for(int p=0; p<peers.size(); p++) {
+            while (!queue[p].empty() && !peers[queue[p].front().peer]->
+                    ack_out().is_empty(queue[p].front().bin)) {
+                asked[queue[p].front().peer][p].pop_front();
+                queue[p].pop_front();
+                ret.cancelled++;
+            }
+            if (queue[p].empty() || (p%3==1 && tick%SLOW))
+                continue;
+            request_t req = queue[p].front();
+            queue[p].pop_front();
+            asked[req.peer][p].pop_front();
+            if (!p)
+                ret.seeded++;
+            FileTransfer* to = peers[req.peer];
+            to->ack_out().set(req.bin);
+            for(int l=1; l<peers.size(); l++)
+                if (l!=req.peer)
+                    peers[l]->picker().Available(req.bin,1);
+            if (++got[req.peer]==CHUNKS*95/100)
+                almost[req.peer] = tick;
+            if (got[req.peer]==CHUNKS) {
+                done[req.peer] = tick;
+                ret.average += tick;
+                ret.tail += tick - almost[req.peer];
+                ret.last = tick;
+                left--;
+            }
+        }
+    }
+    EXPECT_EQ(0,left);
+    NOW = now;
+    for(int l=0; l<peers.size(); l++)
+        for(int p=0; p<peers.size(); p++)
+            while (!asked[l][p].empty())
+                asked[l][p].pop_front();
+    for(int i=0; i<peers.size(); i++)
+        delete peers[i];
+    ret.average /= LEECHERS;
+    ret.tail /= LEECHERS;
+    return ret;
+}
+
+
+void report (const char* what, const swarm_t& s) {
+    printf("%s: %.1f ticks on average, last %i, tail %.1f, seeder sent %i, "
+           "cancelled %i\n",what,s.average,s.last,s.tail,s.seeded,s.cancelled);
+}
+
+
+const int STREAM_CHUNKS = 4096, STREAM_PEERS = 6, PERIOD = 2, RATE = 5,
+          PREBUF = 50, REBUF = 20;
+const int DELAY[STREAM_PEERS] = {2, 3, 60, 80, 100, 120};
+
+
+struct stream_t {
+    int         rebuffers, stalled, started;
+};
+
+
+/** A viewer fed by STREAM_PEERS seeders, two close and the rest far:
+    every peer sends one chunk per PERIOD ticks, which arrives DELAY[p]
+    ticks later. Like AddHint, the viewer keeps about a
+    second of data asked from every peer; the expected delivery is the
+    delay plus the queue. Playback takes RATE chunks per two ticks once
+    PREBUF chunks are in; if a chunk is missing, it stalls (rebuffers)
+    till REBUF more are in. The player tells the picker where it is,
+    as the HTTP gateway does. The two close ones may lack some chunks
+    (hole), which only the far ones can send then. */
+stream_t Stream (picker_t kind, bin64_t hole=bin64_t::NONE) {
+    srand(1);
+    FileTransfer* seed = new FileTransfer("streamsrc");
+    unlink("streamdl");
+    unlink("streamdl.mhash");
+    FileTransfer* view = new FileTransfer("streamdl",seed->root_hash());
+    for(int p=0; p<seed->file().peak_count(); p++)
+        view->file().OfferHash(seed->file().peak(p),seed->file().peak_hash(p));
+    UsePiecePicker(view->fd(),kind);
+    binmap_t offer[STREAM_PEERS];
+    std::deque<bin64_t> queue[STREAM_PEERS];
+    for(int p=0; p<STREAM_PEERS; p++)
+        offer[p].range_copy(seed->ack_out(),bin64_t::ALL);
+    if (hole!=bin64_t::NONE)
+        for(int p=0; p<2; p++)
+            offer[p].set(hole,binmap_t::EMPTY);
+    std::deque< std::pair<int,bin64_t> > flight;
+    binmap_t& have = view->ack_out();
+    stream_t ret = {0,0,0};
+    int tick = 0, pos2 = 0, need = PREBUF; // pos2: chunks played, twice
+    tint now = NOW;
+    while (pos2/2<STREAM_CHUNKS && tick<STREAM_CHUNKS*100) {
+        tick++;
+        NOW += 10*TINT_MSEC;
+        view->picker().Playback((uint64_t)pos2/2*view->file().chunk_size(),
+                                RATE*50*view->file().chunk_size());
+        for(int p=0; p<STREAM_PEERS; p++)
+            while (queue[p].size()*PERIOD<100) {
+                tint arrives = NOW +
+                    (DELAY[p]+queue[p].size()*PERIOD)*10*TINT_MSEC;
+                bin64_t hint = view->picker().Pick(offer[p],1,arrives);
+                if (hint==bin64_t::NONE)
+                    break;
+                queue[p].push_back(hint);
+            }
+        for(int p=0; p<STREAM_PEERS; p++)
+            if (!queue[p].empty() && !(tick%PERIOD)) {
+                flight.push_back(std::make_pair(tick+DELAY[p],queue[p].front()));
+                queue[p].pop_front();
+            }
+        for(int i=0; i<flight.size(); i++)
+            if (flight[i].first==tick)
+                have.set(flight[i].second);
+        while (!flight.empty() && flight.front().first<=tick) // nearly
+            flight.pop_front();
+        int at = pos2/2;
+        if (need) { // buffering
+            int upto = std::min(STREAM_CHUNKS,at+need);
+            bool ready = true;
+            for(int c=at; c<upto && ready; c++)
+                ready = have.is_filled(bin64_t(0,c));
+            if (!ready) {
+                ret.stalled += ret.started!=0;
+                continue;
+            }
+            need = 0;
+            if (!ret.started)
+                ret.started = tick;
+        }
+        for(int c=at; c<std::min(STREAM_CHUNKS,(pos2+RATE)/2+1) && !need; c++)
+            if (!have.is_filled(bin64_t(0,c))) {
+                ret.rebuffers++;
+                need = REBUF;
+                pos2 = c*2;
+            }
+        if (!need)
+            pos2 += RATE;
+    }
+    EXPECT_GE(pos2/2,STREAM_CHUNKS);
+    NOW = now;
+    delete view;
+    delete seed;
+    return ret;
+}
+
+
+TEST(PickerTest,StreamPlayback) {
+    stream_t seq = Stream(SEQUENTIAL_PICKER);
+    stream_t stream = Stream(STREAMING_PICKER);
+    printf("sequential: started at %i, %i rebuffers, stalled %i ticks\n",
+           seq.started,seq.rebuffers,seq.stalled);
+    printf("streaming: started at %i, %i rebuffers, stalled %i ticks\n",
+           stream.started,stream.rebuffers,stream.stalled);
+    EXPECT_LT(stream.rebuffers,seq.rebuffers);
+    EXPECT_LT(stream.stalled,seq.stalled);
+    // urgent chunks are left to the fast, which lack chunks 128-255
+    stream_t hole = Stream(STREAMING_PICKER,bin64_t(7,1));
+    printf("streaming, fast ones lack some: started at %i, %i rebuffers, "
+           "stalled %i ticks\n",hole.started,hole.rebuffers,hole.stalled);
+    EXPECT_LT(hole.stalled,seq.stalled*2);
+}
+
+
+TEST(PickerTest,SwarmCompletion) {
+    swarm_t seq = Swarm(SEQUENTIAL_PICKER);
+    swarm_t rarest = Swarm(RAREST_FIRST_PICKER);
+    report("sequential",seq);
+    report("rarest first",rarest);
+    EXPECT_LT(rarest.last,seq.last);
+    EXPECT_LT(rarest.seeded,seq.seeded);
+    // the last chunks, requested from the slow peers, asked elsewhere too
+    EndGame::ENABLED = false;
+    swarm_t no_endgame = Swarm(RAREST_FIRST_PICKER);
+    EndGame::ENABLED = true;
+    report("no end-game",no_endgame);
+    EXPECT_LT(rarest.tail,no_endgame.tail);
+    EXPECT_LE(rarest.last,no_endgame.last);
+}
+
+
+/** A channel's own outstanding hints do not keep the others off them;
+    the end-game is over once all it asked for is in. */
+TEST(PickerTest,EndGameOwnHints) {
+    EndGame endgame;
+    binmap_t offer, have;
+    offer.set(bin64_t(0,0));
+    offer.set(bin64_t(0,1));
+    tbring slow, fast;
+    slow.push_back(tintbin(NOW,bin64_t(0,0)));
+    EXPECT_EQ(bin64_t(0,1),endgame.Pick(offer,have,slow,1));
+    EXPECT_TRUE(endgame.active());
+    EXPECT_EQ(bin64_t(0,0),endgame.Pick(offer,have,fast,1));
+    EXPECT_EQ(bin64_t::NONE,endgame.Pick(offer,have,fast,1));
+    have.set(bin64_t(0,0));
+    endgame.OnDataIn(have);
+    EXPECT_TRUE(endgame.active());
+    have.set(bin64_t(0,1));
+    endgame.OnDataIn(have);
+    EXPECT_FALSE(endgame.active());
+}
+
+
+class HintChannel : public Channel {
+public:
+    HintChannel (FileTransfer* trans) :
+        Channel(trans,INVALID_SOCKET,Address(0x7f000001,7777)) {}
+    void Hint (bin64_t pos) {
+        hint_out_.push_back(tintbin(NOW,pos));
+        hint_out_size_ += pos.width();
+    }
+    void Cancel () { CancelHints(); }
+    int Hints () const { return hint_out_.size(); }
+    uint64_t HintSize () const { return hint_out_size_; }
+};
+
+
+/** Hints for data that came from elsewhere are all dropped, adjacent
+    ones too, and stop counting towards the hinted size. */
+TEST(PickerTest,CancelHints) {
+    FileTransfer* seed = new FileTransfer("pickersrc");
+    unlink("pickerdl0");
+    unlink("pickerdl0.mhash");
+    FileTransfer* leech = new FileTransfer("pickerdl0",seed->root_hash());
+    HintChannel* ch = new HintChannel(leech);
+    ch->Hint(bin64_t(0,0));
+    ch->Hint(bin64_t(1,1));
+    ch->Hint(bin64_t(0,4));
+    ch->Hint(bin64_t(0,5));
+    ch->Hint(bin64_t(2,2));
+    leech->ack_out().set(bin64_t(1,1));
+    leech->ack_out().set(bin64_t(0,4));
+    leech->ack_out().set(bin64_t(0,5));
+    ch->Cancel();
+    EXPECT_EQ(2,ch->Hints());
+    EXPECT_EQ(1+4,ch->HintSize());
+    delete ch;
+    delete leech;
+    delete seed;
+}
+
+
+/** A file of random data, chunks long. */
+bool MakeSource (const char* name, int chunks) {
+    int f = open(name,O_RDWR|O_CREAT|O_TRUNC,S_IRUSR|S_IWUSR);
+    if (f<0)
+        return false;
+    char buf[1024];
+    srand(0);
+    for(int i=0; i<chunks; i++) {
+        for(int j=0; j<sizeof(buf); j++)
+            buf[j] = rand();
+        write(f,buf,sizeof(buf));
+    }
+    close(f);
+    char mhash[32];
+    sprintf(mhash,"%s.mhash",name);
+    unlink(mhash);
+    return true;
+}
+
+
+void RemoveFiles () {
+    char name[32];
+    for(int i=0; i<LEECHERS; i++) {
+        sprintf(name,"pickerdl%i",i);
+        unlink(name);
+        strcat(name,".mhash");
+        unlink(name);
+        strcat(name,".ack");
+        unlink(name);
+    }
+    const char* more[] = {"pickersrc", "streamsrc", "streamdl"};
+    for(int i=0; i<3; i++) {
+        strcpy(name,more[i]);
+        unlink(name);
+        strcat(name,".mhash");
+        unlink(name);
+        strcat(name,".ack");
+        unlink(name);
+    }
+}
+
+
+int main (int argc, char** argv) {
+    testing::InitGoogleTest(&argc, argv);
+    if (!MakeSource("pickersrc",CHUNKS) ||
+        !MakeSource("streamsrc",STREAM_CHUNKS)) {
+        print_error("cannot write the source files");
+        return 1;
+    }
+    int ret = RUN_ALL_TESTS();
+    RemoveFiles();
+    return ret;
+}
@@ -7,6 +7,11 @@
  *
  */
 //#include <gtest/gtest.h>
+#include <map>
+#include <set>
+#ifdef __linux__
+#include <malloc.h>
+#endif
 //#include <glog/logging.h>
 #include "swift.h"
 #include "compat.h"
@@ -33,6 +38,95 @@ TEST(TransferTest,TBHeap) {
 }
 
 
+TEST(TransferTest,TBIdxHeap) {
+    tbidxheap h;
+    std::vector<tint> ref(1000,TINT_NEVER);
+    srand(7);
+    for(int i=0; i<100000; i++) {
+        int num = rand()%ref.size();
+        if (rand()%4) {
+            ref[num] = rand()%10000;
+            h.set(num,ref[num]);
+        } else if (rand()%2) {
+            ref[num] = TINT_NEVER;
+            h.remove(num);
+        } else if (!h.is_empty()) {
+            tintbin top = h.pop();
+            ASSERT_EQ(ref[(int)top.bin],top.time);
+            ASSERT_EQ(*std::min_element(ref.begin(),ref.end()),top.time);
+            ref[(int)top.bin] = TINT_NEVER;
+        }
+        ASSERT_EQ(ref[num],h.time(num));
+    }
+    int live = ref.size() - std::count(ref.begin(),ref.end(),TINT_NEVER);
+    ASSERT_EQ(live,h.size());
+}
+
+
+/** Every channel has one timer; sends reschedule the sender, incoming
+    datagrams reschedule some other channel, now and then a channel closes
+    and a new one opens. Compares to the former stale-entry tbheap. */
+TEST(TransferTest,SendQueueBenchmark) {
+    const int channels = 100000, steps = 1000000;
+    std::vector<tint> next(channels);
+    tint now;
+
+    tbheap old;
+    srand(1);
+    now = 0;
+    for(int i=0; i<channels; i++)
+        old.push(tintbin(next[i]=rand()%TINT_SEC,bin64_t((uint64_t)i)));
+    int peak = 0;
+    tint start = usec_time();
+    for(int s=0; s<steps; s++) {
+        tintbin top = old.pop();
+        if (top.time!=next[(int)top.bin]) {
+            s--;
+            continue; // stale
+        }
+        now = top.time;
+        next[(int)top.bin] = now + rand()%TINT_SEC;
+        old.push(tintbin(next[(int)top.bin],top.bin));
+        int other = rand()%channels; // recv
+        next[other] = now + rand()%TINT_SEC;
+        old.push(tintbin(next[other],bin64_t((uint64_t)other)));
+        if (s%16==0) { // close and reopen
+            other = rand()%channels;
+            next[other] = now + rand()%TINT_SEC;
+            old.push(tintbin(next[other],bin64_t((uint64_t)other)));
+        }
+        if (old.size()>peak)
+            peak = old.size();
+    }
+    tint took_old = usec_time() - start;
+
+    tbidxheap idx;
+    srand(1);
+    now = 0;
+    for(int i=0; i<channels; i++)
+        idx.set(i,rand()%TINT_SEC);
+    start = usec_time();
+    for(int s=0; s<steps; s++) {
+        tintbin top = idx.pop();
+        now = top.time;
+        idx.set((int)top.bin,now+rand()%TINT_SEC);
+        int other = rand()%channels;
+        idx.set(other,now+rand()%TINT_SEC);
+        if (s%16==0) {
+            other = rand()%channels;
+            idx.remove(other);
+            idx.set(other,now+rand()%TINT_SEC);
+        }
+    }
+    tint took_idx = usec_time() - start;
+    EXPECT_EQ(channels,idx.size());
+
+    printf("%i channels, %i sends: tbheap %lli sends/s, peak %i entries; "
+           "tbidxheap %lli sends/s, %i entries\n",channels,steps,
+           (long long)steps*TINT_SEC/took_old,peak,
+           (long long)steps*TINT_SEC/took_idx,idx.size());
+}
+
 TEST(TransferTest,TransferFile) {
 
     AB = Sha1Hash(A,B);
@@ -117,6 +211,400 @@ TEST(TransferTest,TransferFile) {
  - always rehashes (even fresh files)
  */
 
+/** Data coming in only marks a checkpoint as due; it is written out
+    when the loop is idle. */
+TEST(TransferTest,IdleCheckpoint) {
+    FileTransfer* seed = new FileTransfer(BTF);
+    unlink("ckpt");
+    unlink("ckpt.mhash");
+    unlink("ckpt.mhash.ack");
+    FileTransfer* copy = new FileTransfer("ckpt",seed->root_hash());
+    for(int i=0; i<seed->file().peak_count(); i++)
+        copy->file().OfferHash(seed->file().peak(i),seed->file().peak_hash(i));
+    tint interval = FileTransfer::CHECKPOINT_INTERVAL;
+    FileTransfer::CHECKPOINT_INTERVAL = 1;
+    usleep(10);
+    Datagram::Time();
+    uint8_t buf[1024];
+    bin64_t e(0,4);
+    size_t len = pread(seed->fd(),buf,1024,e.base_offset()<<10);
+    ASSERT_TRUE(copy->file().OfferData(e,(char*)buf,len));
+    copy->OnDataIn(e);
+    struct stat st;
+    EXPECT_NE(0,stat("ckpt.mhash.ack",&st));
+    EXPECT_TRUE(FileTransfer::Checkpoint());
+    EXPECT_EQ(0,stat("ckpt.mhash.ack",&st));
+    EXPECT_FALSE(FileTransfer::Checkpoint());
+    FileTransfer::CHECKPOINT_INTERVAL = interval;
+    delete copy;
+    delete seed;
+    unlink("ckpt");
+    unlink("ckpt.mhash");
+    unlink("ckpt.mhash.ack");
+}
+
+TEST(TransferTest,AddrIndex) {
+    addrindex idx;
+    std::multimap<int,uint32_t> ref; // port -> id, one ip
+    srand(5);
+    for(int i=0; i<100000; i++) {
+        Address addr(0x0a000001,rand()%500);
+        if (rand()%3) {
+            uint32_t id = 1 + rand()%5000;
+            idx.add(addr,id);
+            ref.insert(std::make_pair((int)addr.port(),id));
+        } else {
+            std::multimap<int,uint32_t>::iterator it = ref.find(addr.port());
+            if (it!=ref.end()) {
+                idx.remove(addr,it->second);
+                ref.erase(it);
+            }
+        }
+        std::multiset<uint32_t> got, want;
+        int pos = -1;
+        for(uint32_t id; (id=idx.next(addr,pos)); )
+            got.insert(id);
+        for(std::multimap<int,uint32_t>::iterator it=ref.lower_bound(addr.port());
+            it!=ref.upper_bound(addr.port()); it++)
+            want.insert(it->second);
+        ASSERT_TRUE(got==want);
+    }
+    ASSERT_EQ(ref.size(),idx.size());
+}
+
+/** Peers come and go: a million channels opened and closed, at most
+    256 open at a time. The channel table must not grow with the total. */
+TEST(TransferTest,ChannelChurn) {
+    FileTransfer* trans = new FileTransfer(BTF);
+    std::vector<Channel*> open;
+#ifdef __linux__
+    size_t heap = mallinfo2().uordblks;
+#endif
+    srand(3);
+    tint start = usec_time();
+    for(int i=0; i<1000000; i++) {
+        if (open.size()==256) {
+            int j = rand()%open.size();
+            delete open[j];
+            open[j] = open.back();
+            open.pop_back();
+        }
+        open.push_back(new Channel(trans,INVALID_SOCKET,
+                                   Address(0x7f000001,10000+i%50000)));
+    }
+    tint took = usec_time() - start;
+    EXPECT_EQ(256,trans->channel_count());
+    EXPECT_EQ(open.back(),Channel::Find(open.back()->peer(),trans));
+    EXPECT_EQ(NULL,Channel::Find(Address(0x7f000001,9999),trans));
+#ifdef __linux__
+    printf("1M channels churned in %lli ms, heap grew by %lli KB\n",
+           (long long)took/TINT_MSEC,
+           ((long long)mallinfo2().uordblks-(long long)heap)>>10);
+#endif
+    for(int i=0; i<open.size(); i++)
+        delete open[i];
+    EXPECT_EQ(0,trans->channel_count());
+    delete trans;
+}
+
+
+/** Every initial handshake looks its transfer up by the root hash; the
+    rate should not depend on the number of transfers served. */
+TEST(TransferTest,FindBenchmark) {
+    const int steps[] = {10, 100, 1000, 8000};
+    std::vector<FileTransfer*> trans;
+    std::vector<std::string> names;
+    std::vector<Sha1Hash> roots;
+    mkdir("findbench",S_IRWXU);
+    for(int s=0; s<4; s++) {
+        while (trans.size()<steps[s]) {
+            char name[64];
+            sprintf(name,"findbench/%i",(int)trans.size());
+            int f = open(name,O_RDWR|O_CREAT|O_TRUNC,S_IRUSR|S_IWUSR);
+            ASSERT_TRUE(f>=0);
+            write(f,name,strlen(name));
+            close(f);
+            names.push_back(name);
+            trans.push_back(new FileTransfer(name));
+            roots.push_back(trans.back()->root_hash());
+        }
+        const int count = 1000000;
+        int found = 0;
+        tint start = usec_time();
+        for(int i=0; i<count; i++)
+            if (FileTransfer::Find(trans[i%trans.size()]->root_hash()))
+                found++;
+        tint took = usec_time() - start;
+        EXPECT_EQ(count,found);
+        EXPECT_EQ(NULL,FileTransfer::Find(Sha1Hash("no such file")));
+        printf("%i transfers: %lli lookups/s\n",(int)trans.size(),
+               took ? (long long)count*TINT_SEC/took : 0LL);
+    }
+    for(int i=0; i<trans.size(); i+=2) {
+        delete trans[i];
+        trans[i] = NULL;
+    }
+    for(int i=0; i<trans.size(); i++)
+        EXPECT_EQ(trans[i],FileTransfer::Find(roots[i]));
+    for(int i=0; i<trans.size(); i++) {
+        delete trans[i];
+        unlink(names[i].c_str());
+        unlink((names[i]+".mhash").c_str());
+        unlink((names[i]+".mhash.ack").c_str());
+    }
+    rmdir("findbench");
+}
+
+
+/** A channel that sends into the void and gets acks made up below. */
+class AckBenchChannel : public Channel {
+public:
+    AckBenchChannel (FileTransfer* trans) :
+        Channel(trans,INVALID_SOCKET,Address(0x7f000001,7777)) {}
+    void Sent (bin64_t pos) { PushDataOut(pos); }
+    void Timeout () { TimeoutDataOut(); }
+    void Ack (bin64_t pos) {
+        Datagram ack;
+        ack.Push32(pos.to32());
+        ack.Push64(NOW);
+        OnAck(ack);
+    }
+    int Lost () const { return ack_not_rcvd_recent_; }
+    int Outstanding () const { return data_out_.size(); }
+};
+
+
+/** A bin sent again while the first copy is out (say, hinted again):
+    once it is acked, the first copy does not count as lost. */
+TEST(TransferTest,AckRetransmit) {
+    unlink("ackbench");
+    unlink("ackbench.mhash");
+    FileTransfer* trans = new FileTransfer("ackbench",
+        Sha1Hash(true,"0123456789abcdef0123456789abcdef01234567"));
+    AckBenchChannel* ch = new AckBenchChannel(trans);
+    for(int i=0; i<6; i++)
+        ch->Sent(bin64_t(0,i));
+    ch->Sent(bin64_t(0,1)); // 1 is 5 packets behind now
+    ch->Ack(bin64_t(0,0));
+    for(int i=2; i<6; i++)
+        ch->Ack(bin64_t(0,i));
+    EXPECT_EQ(0,ch->Lost());
+    ch->Ack(bin64_t(0,1));
+    EXPECT_EQ(0,ch->Lost());
+    EXPECT_EQ(0,ch->Outstanding());
+    ch->Sent(bin64_t(0,6));
+    for(int i=7; i<13; i++) { // 6 is lost for real
+        ch->Sent(bin64_t(0,i));
+        ch->Ack(bin64_t(0,i));
+    }
+    EXPECT_EQ(1,ch->Lost());
+    delete ch;
+    delete trans;
+    unlink("ackbench");
+    unlink("ackbench.mhash");
+    unlink("ackbench.mhash.ack");
+}
+
+
+/** CPU cost of an ACK with large windows; 1% of packets is lost, so there
+    are losses by reordering and timeouts, as well; 10% of acks come
+    twice, as datagrams may be duplicated. */
+TEST(TransferTest,AckBenchmark) {
+    const int windows[] = {64, 1024, 16384};
+    const int packets = 200000;
+    tint now = NOW;
+    unlink("ackbench");
+    unlink("ackbench.mhash");
+    FileTransfer* trans = new FileTransfer("ackbench",
+        Sha1Hash(true,"0123456789abcdef0123456789abcdef01234567"));
+    for(int w=0; w<3; w++) {
+        AckBenchChannel* ch = new AckBenchChannel(trans);
+        int acks = 0;
+        tint took = 0;
+        for(int i=0; i<packets; i++) {
+            NOW += 100;
+            ch->Sent(bin64_t(0,i));
+            int j = i - windows[w];
+            if (j<0 || j%100==7)
+                continue;
+            for(int k=0; k<(j%10==3?2:1); k++) {
+                Datagram ack;
+                ack.Push32(bin64_t(0,j).to32());
+                ack.Push64(NOW);
+                tint start = usec_time();
+                ch->OnAck(ack);
+                ch->Timeout();
+                took += usec_time() - start;
+                acks++;
+            }
+        }
+        printf("window %i: %lli ns per ack\n",windows[w],
+               (long long)took*1000/acks);
+        delete ch;
+    }
+    delete trans;
+    NOW = now;
+    unlink("ackbench");
+    unlink("ackbench.mhash");
+    unlink("ackbench.mhash.ack");
+}
+
+
+/** A channel that sends HAVEs into the void. */
+class HaveBenchChannel : public Channel {
+public:
+    HaveBenchChannel (FileTransfer* trans) :
+        Channel(trans,INVALID_SOCKET,Address(0x7f000001,7777)) {}
+    int Have () {
+        Datagram dgram;
+        AddHave(dgram);
+        return dgram.size();
+    }
+    bool Told (bin64_t pos) { return have_out_.is_filled(pos); }
+};
+
+
+/** CPU cost of the HAVEs in a datagram, with many channels and a big,
+    fragmented ack_out: 64 peers fill 64 runs of the file. The channel
+    that got a chunk sends a datagram, other channels send some more. */
+TEST(TransferTest,HaveBenchmark) {
+    const int peers = 64, rates[] = {2, 16}, layers[] = {18, 16};
+    for(int r=0; r<2; r++) {
+        const int chunks = 1<<layers[r];
+        unlink("havebench");
+        unlink("havebench.mhash");
+        FileTransfer* trans = new FileTransfer("havebench",
+            Sha1Hash(true,"0123456789abcdef0123456789abcdef01234567"));
+        std::vector<HaveBenchChannel*> chans;
+        for(int i=0; i<peers; i++)
+            chans.push_back(new HaveBenchChannel(trans));
+        int calls = 0;
+        uint64_t bytes = 0;
+        tint took = 0;
+        for(int i=0; i<chunks; i++) {
+            bin64_t pos(0,(i%peers)*(chunks/peers)+i/peers);
+            trans->ack_out().set(pos);
+            trans->OnDataIn(pos);
+            tint start = usec_time();
+            bytes += chans[i%peers]->Have();
+            for(int j=1; j<rates[r]; j++)
+                bytes += chans[(i*7+j*13+3)%peers]->Have();
+            took += usec_time() - start;
+            calls += rates[r];
+        }
+        for(int i=0; i<peers; i++) { // catch up, nothing left behind
+            for(int j=0; j<4 && chans[i]->Have(); j++);
+            EXPECT_EQ(0,chans[i]->Have());
+            EXPECT_TRUE(chans[i]->Told(bin64_t(layers[r],0)));
+        }
+        printf("%i channels, %i datagrams per chunk: %lli ns per datagram, "
+               "%.2f HAVE bytes per chunk\n",peers,rates[r],
+               (long long)took*1000/calls,(double)bytes/chunks/peers);
+        for(int i=0; i<peers; i++)
+            delete chans[i];
+        delete trans;
+    }
+    unlink("havebench");
+    unlink("havebench.mhash");
+    unlink("havebench.mhash.ack");
+}
+
+
+
+/** A chunk of a live stream, its uncles first, as Channel sends it. */
+static bool DeliverLive (HashTree& from, HashTree& to, bin64_t pos) {
+    char data[1024];
+    if (pread(from.file_descriptor(),data,1024,from.data_offset(pos))!=1024)
+        return false;
+    bin64_t peak = from.peak_for(pos);
+    for(bin64_t p=pos; p!=peak; p=p.parent())
+        to.OfferHash(p.sibling(),from.hash(p.sibling()));
+    return to.OfferData(pos,data,1024);
+}
+
+
+static size_t ResidentKB () {
+    size_t size = 0, resident = 0;
+#ifdef __linux__
+    FILE* statm = fopen("/proc/self/statm","r");
+    if (statm) {
+        if (fscanf(statm,"%lu %lu",&size,&resident)!=2)
+            resident = 0;
+        fclose(statm);
+    }
+#endif
+    return resident * (getpagesize()>>10);
+}
+
+
+/** Hours of a live stream, RATE chunks a second, from the source to a
+    peer that takes every chunk as it comes. Both keep the last WINDOW
+    chunks only: once the window is full, neither memory nor the data
+    files may grow. */
+TEST(TransferTest,LiveSoak) {
+    const int WINDOW = 4096, RATE = 32, HOURS = 4;
+    unlink("livesoak");
+    unlink("livesoakdl");
+    Sha1Hash key("live soak key");
+    FileTransfer* src = new FileTransfer(key,"livesoak",1024,WINDOW);
+    FileTransfer* copy = new FileTransfer(key,"livesoakdl",1024,WINDOW);
+    ASSERT_EQ(src->root_hash(),copy->root_hash());
+    long long heap[HOURS+1], rss[HOURS+1];
+    char data[1024];
+    uint64_t chunks = 0;
+    tint now = NOW, start = usec_time();
+    for(int h=0; h<=HOURS; h++) {
+#ifdef __linux__
+        heap[h] = mallinfo2().uordblks >> 10;
+#else
+        heap[h] = 0;
+#endif
+        rss[h] = ResidentKB();
+        printf("hour %i: %lli chunks, heap %lli KB, resident %lli KB\n",
+               h,(long long)chunks,heap[h],rss[h]);
+        for(int i=0; h<HOURS && i<RATE*3600; i++, chunks++) {
+            NOW += TINT_SEC/RATE;
+            memset(data,(int)chunks,sizeof(data));
+            memcpy(data,&chunks,sizeof(chunks));
+            ASSERT_EQ(1,LiveWrite(src->fd(),data,sizeof(data)));
+            HashTree& file = src->file();
+            bin64_t peaks[64];
+            Sha1Hash hashes[64];
+            for(int p=0; p<file.peak_count(); p++) {
+                peaks[p] = file.peak(p);
+                hashes[p] = file.peak_hash(p);
+            }
+            ASSERT_TRUE(copy->file().OfferKeyedPeaks
+                    (file.peak_count(),peaks,hashes,file.peaks_mac()));
+            bin64_t hint = copy->picker().Pick(src->ack_out(),1,NOW+TINT_SEC);
+            ASSERT_EQ(bin64_t(0,chunks),hint);
+            ASSERT_TRUE(DeliverLive(file,copy->file(),hint));
+            copy->OnDataIn(hint);
+        }
+    }
+    printf("%i hours streamed in %lli ms\n",HOURS,
+           (long long)(usec_time()-start)/TINT_MSEC);
+    NOW = now;
+    EXPECT_EQ(chunks-WINDOW,copy->file().window_start());
+    EXPECT_TRUE(copy->file().is_complete());
+    EXPECT_EQ(WINDOW,copy->file().packets_complete());
+    EXPECT_TRUE(copy->ack_out().is_empty(bin64_t(0,chunks-WINDOW-1)));
+    EXPECT_FALSE(copy->file().OfferData(bin64_t(0,chunks-WINDOW-1),data,1024));
+    uint64_t oldest = 0;
+    EXPECT_EQ(1024,pread(copy->fd(),data,1024,
+                         copy->file().data_offset(bin64_t(0,chunks-WINDOW))));
+    memcpy(&oldest,data,sizeof(oldest));
+    EXPECT_EQ(chunks-WINDOW,oldest);
+    EXPECT_EQ(WINDOW*1024,file_size(src->fd()));
+    EXPECT_EQ(WINDOW*1024,file_size(copy->fd()));
+    EXPECT_LT(heap[HOURS]-heap[1],1024);
+    EXPECT_LT(rss[HOURS]-rss[1],1024);
+    delete copy;
+    delete src;
+    unlink("livesoak");
+    unlink("livesoakdl");
+}
+
 int main (int argc, char** argv) {
 
     unlink("test_file");
@@ -12,31 +12,67 @@
 #include "swift.h"
 
 #include "ext/seq_picker.cpp" // FIXME FIXME FIXME FIXME 
+#include "ext/rarest_picker.cpp"
+#include "ext/stream_picker.cpp"
 
 using namespace swift;
 
 std::vector<FileTransfer*> FileTransfer::files(20);
+std::vector<FileTransfer::hashslot_t> FileTransfer::hash_index(32);
+int FileTransfer::hash_index_count = 0;
+int FileTransfer::rechecks = 0;
+int FileTransfer::checkpoints = 0;
+tint FileTransfer::CHECKPOINT_INTERVAL = 60*TINT_SEC;
+bool EndGame::ENABLED = true;
+tint EndGame::ROUND = TINT_SEC/2;
+
+#define RECHECK_SLICE 64
 
 #define BINHASHSIZE (sizeof(bin64_t)+sizeof(Sha1Hash))
 
 // FIXME: separate Bootstrap() and Download(), then Size(), Progress(), SeqProgress()
 
-FileTransfer::FileTransfer (const char* filename, const Sha1Hash& _root_hash) :
-    file_(filename,_root_hash), hs_in_offset_(0), cb_installed(0)
+FileTransfer::FileTransfer (const char* filename, const Sha1Hash& _root_hash,
+                            size_t chunk_size) :
+    file_(filename,_root_hash,NULL,chunk_size), hs_in_offset_(0), cb_installed(0)
+{
+    Init();
+}
+
+
+FileTransfer::FileTransfer (const Sha1Hash& key, const char* filename,
+                            size_t chunk_size, uint64_t window) :
+    file_(key,filename,chunk_size,window), hs_in_offset_(0), cb_installed(0)
 {
+    Init();
+}
+
+
+void    FileTransfer::Init () {
+    cap_out_ = (1<<SWIFT_HANDSHAKE) | (1<<SWIFT_DATA) | (1<<SWIFT_ACK) |
+               (1<<SWIFT_HAVE) | (1<<SWIFT_HASH) | (1<<SWIFT_PEX_ADD) |
+               (1<<SWIFT_HINT) | (1<<SWIFT_MSGTYPE_RCVD) |
+               (1<<SWIFT_UNCLE_HASHES) | (1<<SWIFT_RANGE_ACK);
+    if (file_.is_live())
+        cap_out_ |= 1<<SWIFT_KEYED_HASH;
     if (files.size()<fd()+1)
         files.resize(fd()+1);
     files[fd()] = this;
+    IndexAdd(this);
     picker_ = new SeqPiecePicker(this);
     picker_->Randomize(rand()&63);
-    init_time_ = Datagram::Time();
+    congestion_ = LEDBAT_CONGESTION;
+    init_time_ = checkpoint_time_ = Datagram::Time();
+    checkpoint_due_ = false;
+    if (file_.recheck_pending())
+        rechecks++;
 }
 
 
 void    Channel::CloseTransfer (FileTransfer* trans) {
     for(int i=0; i<Channel::channels.size(); i++) 
-        if (Channel::channels[i] && Channel::channels[i]->transfer_==trans) 
-            delete Channel::channels[i];
+        if (Channel::channel(i) && Channel::channel(i)->transfer_==trans) 
+            delete Channel::channel(i);
 }
 
 
@@ -54,6 +90,119 @@ void swift::ExternallyRetrieved (int transfer,bin64_t piece) {
     if (!trans)
         return;
     trans->ack_out().set(piece); // that easy
+    trans->OnDataIn(piece);
+}
+
+
+void swift::UsePiecePicker (int transfer, picker_t picker) {
+    FileTransfer* trans = FileTransfer::file(transfer);
+    if (!trans)
+        return;
+    PiecePicker* pp;
+    switch (picker) {
+        case RAREST_FIRST_PICKER: pp = new RarestPiecePicker(trans); break;
+        case STREAMING_PICKER:    pp = new StreamPiecePicker(trans); break;
+        default:                  pp = new SeqPiecePicker(trans);
+    }
+    pp->Randomize(rand()&63);
+    trans->SetPicker(pp);
+}
+
+
+void swift::UseCongestionControl (int transfer, congestion_t kind) {
+    FileTransfer* trans = FileTransfer::file(transfer);
+    if (!trans)
+        return;
+    trans->congestion_ = kind;
+    for(int i=0; i<trans->hs_in_.size(); i++)
+        if (Channel::channel(trans->hs_in_[i]))
+            Channel::channel(trans->hs_in_[i])->
+                SetCongestionController(NewCongestionController(kind));
+}
+
+
+void swift::Playback (int transfer, uint64_t offset, uint64_t bytes_per_sec) {
+    FileTransfer* trans = FileTransfer::file(transfer);
+    if (!trans)
+        return;
+    trans->picker().Playback(offset,bytes_per_sec);
+}
+
+
+int swift::LiveWrite (int transfer, const void* data, size_t length) {
+    FileTransfer* trans = FileTransfer::file(transfer);
+    if (!trans || !trans->file().is_live())
+        return 0;
+    uint64_t from = trans->file().packet_size();
+    uint64_t first = trans->file().window_start();
+    trans->file().AppendData((const char*)data,length);
+    uint64_t till = trans->file().packet_size();
+    for(uint64_t c=std::max(from,trans->file().window_start()); c<till; c++)
+        trans->OnDataIn(bin64_t(0,c));
+    if (trans->file().window_start()>first)
+        trans->OnWindowMoved();
+    if (till>from) // tell the peers now, not at the next keep-alive
+        for(int i=0; i<trans->hs_in_.size(); i++)
+            if (Channel::channel(trans->hs_in_[i]))
+                Channel::channel(trans->hs_in_[i])->Nudge();
+    return till-from;
+}
+
+
+bin64_t EndGame::Pick (binmap_t& offer, binmap_t& have, const tbring& mine,
+                       uint64_t max_width) {
+    if (!ENABLED)
+        return bin64_t::NONE;
+    if (round_==TINT_NEVER || round_+ROUND<NOW) {
+        asked_.range_copy(have,bin64_t::ALL);
+        round_ = NOW;
+    } else
+        asked_.range_or(have,bin64_t::ALL); // got some meanwhile
+    bin64_t hint;
+    if (mine.empty())
+        hint = offer.find_filtered(asked_,bin64_t::ALL,binmap_t::FILLED);
+    else { // not for the other channels to skip
+        binmap_t asked;
+        asked.range_copy(asked_,bin64_t::ALL);
+        for(int i=0; i<mine.size(); i++)
+            asked.set(mine[i].bin);
+        hint = offer.find_filtered(asked,bin64_t::ALL,binmap_t::FILLED);
+    }
+    if (hint==bin64_t::NONE)
+        return hint;
+    while (hint.width()>max_width)
+        hint = hint.left();
+    asked_.set(hint);
+    return hint;
+}
+
+
+void    EndGame::OnDataIn (binmap_t& have) {
+    if (asked_.find_filtered(have,bin64_t::ALL,binmap_t::FILLED)==bin64_t::NONE) {
+        asked_.clear();
+        round_ = TINT_NEVER;
+    }
+}
+
+
+void FileTransfer::SetPicker (PiecePicker* picker) {
+    delete picker_;
+    picker_ = picker;
+    ReportAvailability();
+}
+
+
+void FileTransfer::OnWindowMoved () {
+    for(int i=0; i<hs_in_.size(); i++)
+        if (Channel::channel(hs_in_[i]))
+            Channel::channel(hs_in_[i])->TrimAckIn();
+}
+
+
+void FileTransfer::ReportAvailability () {
+    for(int i=0; i<hs_in_.size(); i++)
+        if (Channel::channel(hs_in_[i]))
+            Channel::channel(hs_in_[i])->ReportAckIn(1);
 }
 
 
@@ -70,19 +219,147 @@ void swift::RemoveProgressCallback (int transfer, ProgressCallback cb) {
 FileTransfer::~FileTransfer ()
 {
     Channel::CloseTransfer(this);
+    Datagram::Flush(); // queued payloads may refer to the data mapping
     files[fd()] = NULL;
+    IndexRemove(this);
+    if (file_.recheck_pending())
+        rechecks--;
+    if (checkpoint_due_) // the HashTree writes it out on closing
+        checkpoints--;
     delete picker_;
 }
 
 
+/** Completion events kept for the channels; a channel that lags
+    further behind starts over (see Channel::WalkHave). */
+#define ACK_LOG_SIZE 1024
+
+bin64_t         FileTransfer::RevealAck (uint64_t& offset) {
+    if (offset<ack_log_.front_seq()) {
+        offset = ack_log_end();
+        return bin64_t::ALL;
+    }
+    for(int i=ack_log_.find(offset); i>=0 && i<ack_log_.size(); i++) {
+        offset++;
+        if (ack_log_[i].bin!=bin64_t::NONE)
+            return ack_log_[i].bin;
+    }
+    return bin64_t::NONE;
+}
+
+
+void            FileTransfer::OnDataIn (bin64_t pos) {
+    if (pos!=bin64_t::NONE) {
+        // the new cover takes in the older ones next to pos (or itself,
+        // if the data came twice)
+        bin64_t cover = ack_out().cover(pos);
+        for(bin64_t b=pos; b.layer()<=cover.layer(); b=b.parent()) {
+            bin64_t old = b==cover ? b : b.sibling();
+            int i = ack_log_.find(ack_log_idx_.get(old,ack_log_end()));
+            if (i>=0) {
+                ack_log_[i].bin = bin64_t::NONE;
+                ack_log_idx_.remove(old);
+            }
+            if (b==cover)
+                break;
+        }
+        if (ack_log_.size()>=ACK_LOG_SIZE) {
+            bin64_t gone = ack_log_.front().bin;
+            if (gone!=bin64_t::NONE)
+                ack_log_idx_.remove(gone);
+            ack_log_.pop_front();
+        }
+        ack_log_idx_.set(cover,ack_log_end());
+        ack_log_.push_back(tintbin(NOW,cover));
+    }
+    if ( !checkpoint_due_ && (file_.is_complete() ||
+         (CHECKPOINT_INTERVAL && NOW-checkpoint_time_>CHECKPOINT_INTERVAL)) ) {
+        checkpoint_due_ = true; // see Checkpoint
+        checkpoints++;
+    }
+}
+
+
+bool            FileTransfer::Checkpoint () {
+    for(int i=0; checkpoints && i<files.size(); i++)
+        if (files[i] && files[i]->checkpoint_due_) {
+            files[i]->checkpoint_due_ = false;
+            checkpoints--;
+            files[i]->file_.Checkpoint();
+            files[i]->checkpoint_time_ = NOW;
+            return true;
+        }
+    return false;
+}
+
+
+bool            FileTransfer::Recheck () {
+    for(int i=0; rechecks && i<files.size(); i++)
+        if (files[i] && files[i]->file_.recheck_pending()) {
+            if (!files[i]->file_.Recheck(RECHECK_SLICE))
+                rechecks--;
+            return true;
+        }
+    return false;
+}
+
+
+/** SHA1 output is uniform already; any four bytes of it do. */
+static inline uint32_t hash_slot (const Sha1Hash& hash, size_t size) {
+    uint32_t h;
+    memcpy(&h,hash.bits,sizeof(h));
+    return h & (size-1);
+}
+
+
 FileTransfer* FileTransfer::Find (const Sha1Hash& root_hash) {
-    for(int i=0; i<files.size(); i++)
-        if (files[i] && files[i]->root_hash()==root_hash)
-            return files[i];
+    for(uint32_t i=hash_slot(root_hash,hash_index.size());
+        hash_index[i].transfer; i=(i+1)&(hash_index.size()-1))
+        if (hash_index[i].hash==root_hash)
+            return hash_index[i].transfer;
     return NULL;
 }
 
 
+void            FileTransfer::IndexAdd (FileTransfer* trans) {
+    if (2*(hash_index_count+1)>hash_index.size()) {
+        std::vector<hashslot_t> old(hash_index.size()*2);
+        old.swap(hash_index);
+        hash_index_count = 0;
+        for(int i=0; i<old.size(); i++)
+            if (old[i].transfer)
+                IndexAdd(old[i].transfer);
+    }
+    uint32_t i = hash_slot(trans->root_hash(),hash_index.size());
+    while (hash_index[i].transfer)
+        i = (i+1) & (hash_index.size()-1);
+    hash_index[i].hash = trans->root_hash();
+    hash_index[i].transfer = trans;
+    hash_index_count++;
+}
+
+
+/** Backward shift deletion: entries after the hole that could live in it
+    are moved in, so there are no tombstones and probes stay short. */
+void            FileTransfer::IndexRemove (FileTransfer* trans) {
+    size_t mask = hash_index.size()-1;
+    uint32_t i = hash_slot(trans->root_hash(),hash_index.size());
+    while (hash_index[i].transfer && hash_index[i].transfer!=trans)
+        i = (i+1) & mask;
+    if (!hash_index[i].transfer)
+        return;
+    for(uint32_t j=(i+1)&mask; hash_index[j].transfer; j=(j+1)&mask) {
+        uint32_t home = hash_slot(hash_index[j].hash,hash_index.size());
+        if ( ((j-home)&mask) >= ((j-i)&mask) ) { // may move back to i
+            hash_index[i] = hash_index[j];
+            i = j;
+        }
+    }
+    hash_index[i] = hashslot_t();
+    hash_index_count--;
+}
+
+
 int       swift:: Find (Sha1Hash hash) {
     FileTransfer* t = FileTransfer::Find(hash);
     if (t)
@@ -93,11 +370,8 @@ int       swift:: Find (Sha1Hash hash) {
 
 
 void            FileTransfer::OnPexIn (const Address& addr) {
-    for(int i=0; i<hs_in_.size(); i++) {
-        Channel* c = Channel::channel(hs_in_[i]);
-        if (c && c->transfer().fd()==this->fd() && c->peer()==addr)
-            return; // already connected
-    }
+    if (Channel::Find(addr,this))
+        return; // already connected
     if (hs_in_.size()<20) {
         new Channel(this,Datagram::default_socket(),addr);
     } else {
@@ -120,13 +394,20 @@ int        FileTransfer::RevealChannel (int& pex_out_) { // FIXME brainfuck
                 return c->id();
             } else
                 pex_out_++;
-        } else {
-            hs_in_[pex_out_] = hs_in_[0];
-            hs_in_.pop_front();
-            hs_in_offset_++;
-        }
+        } else
+            RemoveChannel(pex_out_);
     }
     pex_out_ += hs_in_offset_;
     return -1;
 }
 
+
+void        FileTransfer::RemoveChannel (int i) {
+    Channel* front = Channel::channel(hs_in_.front());
+    if (front && &front->transfer()==this) // takes the place of i
+        front->hs_in_pos_ = i + hs_in_offset_;
+    hs_in_[i] = hs_in_.front();
+    hs_in_.pop_front();
+    hs_in_offset_++;
+}
+